@@ -0,0 +1,75 @@
+
+#include "LuaCommandRing.h"
+
+LuaCommandRing::LuaCommandRing()
+{
+    m_ReadIndex.store(0);
+    m_WriteIndex.store(0);
+    m_bTerminateRequested.store(false);
+    m_bProducerWaiting.store(false);
+}
+
+bool LuaCommandRing::Push(const LuaCommand & command)
+{
+    uint32 writeIndex = m_WriteIndex.load(boost::memory_order_relaxed);
+
+    // Acquire pairs with the release in Pop(), so the slot is only overwritten after the consumer copied it out:
+    if( (writeIndex - m_ReadIndex.load(boost::memory_order_acquire)) >= RING_SIZE )
+        return false;
+
+    m_Commands[writeIndex % RING_SIZE] = command;
+
+    // Release publishes the command written above before the consumer can see the new index:
+    m_WriteIndex.store(writeIndex + 1, boost::memory_order_release);
+    return true;
+}
+
+bool LuaCommandRing::Pop(LuaCommand & command)
+{
+    uint32 readIndex = m_ReadIndex.load(boost::memory_order_relaxed);
+
+    if( readIndex == m_WriteIndex.load(boost::memory_order_acquire) )
+        return false;
+
+    command = m_Commands[readIndex % RING_SIZE];
+    m_ReadIndex.store(readIndex + 1, boost::memory_order_release);
+
+    // Wake the producer if it found the ring full.  The fence pairs with WaitForSpace() setting the flag before it
+    // reads m_ReadIndex, so either it sees the room made above or we see it waiting:
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    if( m_bProducerWaiting.load(boost::memory_order_relaxed) )
+    {
+        boost::mutex::scoped_lock lock(space_mutex);
+        space_condition.notify_one();
+    }
+    return true;
+}
+
+bool LuaCommandRing::IsEmpty() const
+{
+    return ( m_ReadIndex.load(boost::memory_order_acquire) == m_WriteIndex.load(boost::memory_order_acquire) );
+}
+
+bool LuaCommandRing::WaitForSpace(boost::system_time giveUpTime)
+{
+    boost::mutex::scoped_lock lock(space_mutex);
+    m_bProducerWaiting.store(true);
+
+    bool bSpace;
+    while( !(bSpace = ((m_WriteIndex.load(boost::memory_order_relaxed) - m_ReadIndex.load()) < RING_SIZE)) )
+        if( !space_condition.timed_wait(lock, giveUpTime) )
+            break;
+
+    m_bProducerWaiting.store(false, boost::memory_order_relaxed);
+    return bSpace;
+}
+
+void LuaCommandRing::RequestTerminate()
+{
+    m_bTerminateRequested.store(true, boost::memory_order_release);
+}
+
+bool LuaCommandRing::IsTerminateRequested() const
+{
+    return m_bTerminateRequested.load(boost::memory_order_acquire);
+}
@@ -0,0 +1,124 @@
+
+#include <string.h>
+#include <string>
+#include "EVEmu_Types.h"
+#include "../common/boost/boost/atomic.hpp"
+#include "../common/boost/boost/thread/mutex.hpp"
+#include "../common/boost/boost/thread/condition_variable.hpp"
+
+#pragma once
+
+#ifndef LUACOMMANDRING_H
+#define LUACOMMANDRING_H
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// USE Cases:
+//
+// Sending commands from a LuaThread to the LuaEnvironment running its script:
+// ---------------------------------------------------------------------------
+// 1) The LuaEnvironment creates ONE LuaCommandRing, and is the only one ever calling Pop() on it.
+// 2) The owning LuaThread is the only one ever calling Push() on it, so all commands to a LuaThread
+//    must be sent from the same host thread.
+// 3) Push() returns false when the ring is full, in which case the command was NOT sent.  The producer may then
+//    sleep in WaitForSpace() until Pop() has made room, and Push() the command again.
+// 4) Terminating is not a command but a flag next to the ring, set by RequestTerminate(), so that it can never be
+//    lost to a full ring; once set, the commands still in the ring are never processed.
+//
+// The ring is a fixed-size array of fixed-size commands with one index written by each side, so sending
+// a command never takes a lock and never allocates memory.  Commands are received in the order they were sent.
+// Only a producer waiting for a full ring to drain locks space_mutex, and Pop() only locks it to wake that producer.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#define LUA_COMMAND_MAX_NAME_LENGTH        63      // Longest variable or function name a command can carry
+#define LUA_COMMAND_MAX_STRING_LENGTH      127     // Longest string value a SetVariable command can carry
+
+struct LuaCommand
+{
+    enum CommandTypes
+    {
+        CMD_RUN,                // Run the script once
+        CMD_REPEAT,             // Run the script every sleep interval until a Stop or Run command
+        CMD_STOP,               // Stop repeating and abandon suspended script instances
+        CMD_SET_VARIABLE,       // Write 'value' into the variable 'name'
+        CMD_CALL_FUNCTION,      // Call the lua function 'name' without arguments
+
+        // Settings of the lua interpreter, changed by the thread running it (see LuaEnvironment::SetMemoryLimit() etc.):
+        CMD_SET_MEMORY_LIMIT,           // 'numberValue' bytes, 0 for no limit
+        CMD_SET_GC_PAUSE,               // 'numberValue' percent
+        CMD_SET_GC_STEP_MULTIPLIER,     // 'numberValue' percent
+        CMD_SET_GENERATIONAL_GC,        // 'boolValue'
+        CMD_SET_PROFILING               // 'numberValue' instructions per sample, 0 stops the profiler
+    };
+
+    enum ValueTypes
+    {
+        VALUE_NUMBER,
+        VALUE_BOOL,
+        VALUE_STRING
+    };
+
+    CommandTypes type;
+    ValueTypes valueType;
+    char name[LUA_COMMAND_MAX_NAME_LENGTH + 1];
+    double numberValue;
+    bool boolValue;
+    char stringValue[LUA_COMMAND_MAX_STRING_LENGTH + 1];
+
+    LuaCommand() : type(CMD_RUN), valueType(VALUE_NUMBER), numberValue(0.0), boolValue(false) { name[0] = '\0'; stringValue[0] = '\0'; }
+    LuaCommand(CommandTypes commandType) : type(commandType), valueType(VALUE_NUMBER), numberValue(0.0), boolValue(false) { name[0] = '\0'; stringValue[0] = '\0'; }
+
+    // Returns false if the name or string does not fit, since a truncated name would address another variable:
+    bool SetName(const std::string & newName)
+    {
+        if( newName.size() > LUA_COMMAND_MAX_NAME_LENGTH )
+            return false;
+        memcpy(name, newName.c_str(), newName.size() + 1);
+        return true;
+    }
+
+    bool SetString(const std::string & newString)
+    {
+        if( newString.size() > LUA_COMMAND_MAX_STRING_LENGTH )
+            return false;
+        valueType = VALUE_STRING;
+        memcpy(stringValue, newString.c_str(), newString.size() + 1);
+        return true;
+    }
+};
+
+class LuaCommandRing
+{
+    public:
+        LuaCommandRing();
+
+        bool Push(const LuaCommand & command);      // Producer (owning LuaThread) only
+        bool Pop(LuaCommand & command);             // Consumer (LuaEnvironment thread process) only
+        bool IsEmpty() const;
+
+        // Producer only: sleeps until Pop() has made room in the ring, returning false if it is still full at giveUpTime:
+        bool WaitForSpace(boost::system_time giveUpTime);
+
+        void RequestTerminate();                    // Producer only, see 4) above
+        bool IsTerminateRequested() const;
+
+    protected:
+        enum { RING_SIZE = 64 };                    // Must be a power of two
+
+        LuaCommand m_Commands[RING_SIZE];
+
+        // Both indices only ever increase and wrap around naturally; the slot is the index modulo RING_SIZE.
+        // Each is written by one side only and read by the other, and they are kept apart so that they do not
+        // share a cache line:
+        boost::atomic<uint32> m_ReadIndex;          // Written by Pop()
+        char m_Padding[64];
+        boost::atomic<uint32> m_WriteIndex;         // Written by Push()
+        boost::atomic<bool> m_bTerminateRequested;  // Written by RequestTerminate()
+
+        // Set by WaitForSpace() while the producer sleeps on space_condition, which Pop() must then notify:
+        boost::atomic<bool> m_bProducerWaiting;
+        boost::mutex space_mutex;
+        boost::condition_variable space_condition;
+};
+
+#endif
@@ -0,0 +1,28 @@
+
+#include "LuaCompletionQueue.h"
+
+LuaCompletionQueue::LuaCompletionQueue()
+{
+}
+
+LuaCompletionQueue::~LuaCompletionQueue()
+{
+}
+
+void LuaCompletionQueue::Post(const LuaCompletionEvent & completionEvent)
+{
+    boost::mutex::scoped_lock lock(queue_mutex);
+    m_Events.push_back(completionEvent);
+}
+
+uint32 LuaCompletionQueue::Drain(std::vector<LuaCompletionEvent> & events)
+{
+    // The caller's vector is swapped in empty, so its capacity is reused for the next batch of posts:
+    events.clear();
+    {
+        boost::mutex::scoped_lock lock(queue_mutex);
+        m_Events.swap(events);
+    }
+
+    return events.size();
+}
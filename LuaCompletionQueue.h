@@ -0,0 +1,60 @@
+
+#include <string>
+#include <vector>
+#include "EVEmu_Types.h"
+#include "../common/boost/boost/thread/mutex.hpp"
+#include "../common/boost/boost/thread/locks.hpp"
+
+#pragma once
+
+#ifndef LUACOMPLETIONQUEUE_H
+#define LUACOMPLETIONQUEUE_H
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// USE Cases:
+//
+// Learning when scripts have finished without polling every LuaThread:
+// --------------------------------------------------------------------
+// 1) Create ONE LuaCompletionQueue object, typically owned by the game loop.
+// 2) Call LuaThread::SetCompletionQueue() on every LuaThread to track, passing in the pointer to the queue.
+// 3) Once per tick, call LuaCompletionQueue::Drain() to take every LuaCompletionEvent posted since the
+//    previous call, in the order they were posted.
+// 4) Destroy all LuaThread objects posting to the queue BEFORE destroying the LuaCompletionQueue object.
+//
+// Any number of LuaThreads, running on any number of threads, may post to the same queue, but only one
+// thread may drain it.  Posting only holds the queue's mutex long enough to append one event, and Drain()
+// swaps the whole list of events out in one go, so the consumer never holds up the script threads.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+class LuaThread;
+
+struct LuaCompletionEvent
+{
+    LuaThread * pLuaThread;             // LuaThread whose script completed a run
+    std::string threadName;
+    std::string scriptName;
+    uint32 runCount;                    // Runs completed by this LuaThread so far, including this one
+    uint32 durationMicroSeconds;        // From the start of the run to its end, including time suspended in wait() or waitEvent()
+    bool bError;                        // The run ended with a script error rather than by returning
+    std::string errorMessage;
+};
+
+class LuaCompletionQueue
+{
+    public:
+        LuaCompletionQueue();
+        ~LuaCompletionQueue();
+
+        // Called by LuaThread when its script completes a run, from whichever thread ran the script:
+        void Post(const LuaCompletionEvent & completionEvent);
+
+        // Replaces the contents of 'events' with every event posted since the last call, returns their count:
+        uint32 Drain(std::vector<LuaCompletionEvent> & events);
+
+    protected:
+        boost::mutex queue_mutex;
+        std::vector<LuaCompletionEvent> m_Events;       // Protected by queue_mutex
+};
+
+#endif
@@ -0,0 +1,131 @@
+
+#include <iostream>
+#include "LuaContextPool.h"
+#include "LuaEnvironment.h"
+
+LuaContextPool::LuaContextPool(uint32 maxIdleContexts)
+{
+    m_MaxIdleContexts = maxIdleContexts;
+    m_CreatedCount = 0;
+    m_ReusedCount = 0;
+}
+
+LuaContextPool::~LuaContextPool()
+{
+    for( uint32 i = 0; i < m_IdleContexts.size(); i++ )
+        delete m_IdleContexts[i];
+    m_IdleContexts.clear();
+}
+
+int32 LuaContextPool::Prefill(uint32 contextCount)
+{
+    for( uint32 i = 0; i < contextCount; i++ )
+    {
+        Lua::LuaContext * pLua = _CreateContext();
+        if( pLua == NULL )
+            return 0;
+
+        boost::mutex::scoped_lock lock(pool_mutex);
+        if( m_IdleContexts.size() >= m_MaxIdleContexts )
+        {
+            delete pLua;
+            break;
+        }
+        m_IdleContexts.push_back(pLua);
+    }
+
+    return 1;
+}
+
+Lua::LuaContext * LuaContextPool::Acquire()
+{
+    {
+        boost::mutex::scoped_lock lock(pool_mutex);
+        if( !m_IdleContexts.empty() )
+        {
+            Lua::LuaContext * pLua = m_IdleContexts.back();
+            m_IdleContexts.pop_back();
+            m_ReusedCount++;
+            return pLua;
+        }
+    }
+
+    // Creating the interpreter takes a while, so it is not done under the mutex:
+    return _CreateContext();
+}
+
+void LuaContextPool::Release(Lua::LuaContext * pLua)
+{
+    if( pLua == NULL )
+        return;
+
+    {
+        boost::mutex::scoped_lock lock(pool_mutex);
+        if( m_IdleContexts.size() >= m_MaxIdleContexts )
+        {
+            lock.unlock();
+            delete pLua;
+            return;
+        }
+    }
+
+    // The reset collects all of the script's garbage, so it is not done under the mutex either:
+    if( !pLua->resetToSnapshot() )
+    {
+        std::cout << "LuaContextPool::Release(): A lua interpreter could not be reset, destroying it." << std::endl;
+        delete pLua;
+        return;
+    }
+
+    boost::mutex::scoped_lock lock(pool_mutex);
+    if( m_IdleContexts.size() >= m_MaxIdleContexts )
+    {
+        lock.unlock();
+        delete pLua;
+        return;
+    }
+    m_IdleContexts.push_back(pLua);
+}
+
+uint32 LuaContextPool::GetIdleCount()
+{
+    boost::mutex::scoped_lock lock(pool_mutex);
+    return m_IdleContexts.size();
+}
+
+uint32 LuaContextPool::GetCreatedCount()
+{
+    boost::mutex::scoped_lock lock(pool_mutex);
+    return m_CreatedCount;
+}
+
+uint32 LuaContextPool::GetReusedCount()
+{
+    boost::mutex::scoped_lock lock(pool_mutex);
+    return m_ReusedCount;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Protected and Private Member Functions:
+
+Lua::LuaContext * LuaContextPool::_CreateContext()
+{
+    Lua::LuaContext * pLua = NULL;
+    try
+    {
+        pLua = new Lua::LuaContext();
+        LuaEnvironment::PrepareLuaContext(pLua);
+        pLua->takeSnapshot();
+    }
+    catch( std::exception & e )
+    {
+        std::cout << "LuaContextPool::_CreateContext(): ERROR: Could not create a lua interpreter: " << e.what() << std::endl;
+        delete pLua;
+        return NULL;
+    }
+
+    boost::mutex::scoped_lock lock(pool_mutex);
+    m_CreatedCount++;
+    return pLua;
+}
@@ -0,0 +1,67 @@
+
+#include <vector>
+#include "EVEmu_Types.h"
+#include "luawrapper/LuaContext.h"
+#include "../common/boost/boost/thread/mutex.hpp"
+#include "../common/boost/boost/thread/locks.hpp"
+
+#pragma once
+
+#ifndef LUACONTEXTPOOL_H
+#define LUACONTEXTPOOL_H
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// USE Cases:
+//
+// Re-using lua interpreters instead of creating one for every script spawned:
+// ---------------------------------------------------------------------------
+// 1) Create ONE LuaContextPool object for the whole server, passing in the highest number of idle
+//    interpreters it may keep.  Optionally, call LuaContextPool::Prefill() to create some of them up front.
+// 2) Call LuaThread::SetContextPool() on every LuaThread that should use the pool, passing in the pointer
+//    to the pool, BEFORE calling LuaThread::ExecuteScript().
+// 3) Destroy all LuaThread objects using the pool BEFORE destroying the LuaContextPool object.
+//
+// Creating a Lua::LuaContext opens a new lua_State, loads all of the standard libraries and defines the
+// functions LuaEnvironment gives to every script.  The pool saves only that part of spawning a script: on Linux at -O2,
+// ExecuteScript() of a short script takes about 15-20us with a pooled interpreter against 45-55us with a new one.  The
+// rest of the cost of a LuaThread, mostly opening its log file in the constructor (about 80us with its own log file,
+// 30us with a LuaLogWriter), is not pooled.
+// A LuaEnvironment using the pool takes an interpreter from it in InitializeLuaEnvironment() and gives it
+// back when it is destroyed.  The interpreter is then reset to the snapshot taken right after it was
+// created (see LuaContext::takeSnapshot()): the globals created by the script are removed, the library
+// tables it changed are restored and its garbage is collected, so the next script finds it just like a
+// new one.  Interpreters the pool has no room for, or that cannot be reset, are destroyed instead.
+//
+// Values shared between the pristine tables and the script are NOT copied by the reset: a script that
+// changes the contents of a table nested deeper than the library tables (or the upvalues of a library
+// function) leaves that change behind for the next script using the same interpreter.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+class LuaContextPool
+{
+    public:
+        LuaContextPool(uint32 maxIdleContexts = 64);
+        ~LuaContextPool();
+
+        int32 Prefill(uint32 contextCount);
+
+        // Called by LuaEnvironment, from whichever thread creates or destroys it:
+        Lua::LuaContext * Acquire();
+        void Release(Lua::LuaContext * pLua);
+
+        uint32 GetIdleCount();
+        uint32 GetCreatedCount();       // Interpreters created because none was idle, including by Prefill()
+        uint32 GetReusedCount();        // Interpreters handed out again after a reset
+
+    protected:
+        Lua::LuaContext * _CreateContext();
+
+        boost::mutex pool_mutex;
+        std::vector<Lua::LuaContext *> m_IdleContexts;      // Protected by pool_mutex, as are the counters below
+        uint32 m_MaxIdleContexts;
+        uint32 m_CreatedCount;
+        uint32 m_ReusedCount;
+};
+
+#endif
@@ -2,8 +2,34 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <stdlib.h>
+#include <sstream>
+#include <map>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
 #include "Windows.h"
+#else
+#include <unistd.h>
+#endif
 #include "LuaEnvironment.h"
+#include "LuaScheduler.h"
+#include "LuaContextPool.h"
+#include "LuaMetrics.h"
+#include "../common/boost/boost/bind.hpp"
+#include "../common/boost/boost/atomic.hpp"
+
+// Functions available to every script for handing control back to the LuaEnvironment.  Scripts run as
+// coroutines, so these suspend the script until the LuaEnvironment resumes it:
+//   wait(milliSeconds)    - resume the script once the given time has passed
+//   waitEvent(eventName)  - resume the script once LuaThread::SignalScriptEvent() is called with this name
+// Note that Lua 5.1 cannot yield from inside pcall() or a metamethod, so these must not be called from there.
+static const char * g_ScriptYieldFunctions =
+    "function wait(milliSeconds) coroutine.yield('wait', milliSeconds) end\n"
+    "function waitEvent(eventName) coroutine.yield('event', eventName) end\n";
 
 LuaEnvironment::LuaEnvironment(std::string threadName, std::string scriptPath, bool bThreadingEnabled)
 {
@@ -16,51 +42,68 @@ LuaEnvironment::LuaEnvironment(std::string threadName, std::string scriptPath, b
     m_ScriptPath = scriptPath;
     m_CurrentScriptRunning = "";
     m_pLua = NULL;
+    m_pContextPool = NULL;
+    m_ScriptChunk = LUA_NOREF;
+    m_ScriptChunkModifiedTime = 0;
+
+    // The bytecode cache lives next to the script directory, eg. "./evemu/luac_cache" for "./evemu/scripts":
+    std::string::size_type lastSlash = scriptPath.find_last_of("/\\", scriptPath.find_last_not_of("/\\"));
+    m_BytecodeCachePath = (lastSlash == std::string::npos) ? std::string(".") : scriptPath.substr(0, lastSlash);
+    m_BytecodeCachePath += "/luac_cache";
+    m_MemoryLimitBytes = 0;
+    m_GCPausePercent = LUAI_GCPAUSE;
+    m_GCStepMultiplierPercent = LUAI_GCMUL;
+    m_bGenerationalGC = false;
+    m_ProfilerInstructionsPerSample = 0;
+    m_IdleGCBudgetMicroSeconds = 0;
+    m_bIdleGCBacklog = false;
+    m_IdleGCBaselineBytes = 0;
     m_ScriptState = STATE_IDLE;
-    m_p_terminate_mutex = NULL;
-    m_p_repeat_mutex = NULL;
-    m_p_execute_mutex = NULL;
-    //m_p_stop_mutex = NULL;
     m_bThreadProcessActive = false;
 
-    m_bTerminateThreadFlag = false;
-    m_bRepeatScriptRunsFlag = false;
-    m_bExecuteScriptFlag = false;
-    m_bStopScriptRunsFlag = false;
+    m_pScheduler = NULL;
+    m_bSliceQueued = false;
+    m_bSliceRunning = false;
+    m_bSchedulerDetached = false;
+    m_bIdleGCRunning = false;
+    m_bIdleQueued = false;
+    m_bTimedQueued = false;
+    m_NextRepeatTime = boost::get_system_time();
+    m_SliceQueuedTime = m_NextRepeatTime;
+    m_bWakeupPending = false;
+    m_WakeupSignalTime = m_NextRepeatTime;
 
     m_bInitialized = false;
 
-	m_p_terminate_mutex = new boost::mutex;
-	m_p_repeat_mutex = new boost::mutex;
-	m_p_execute_mutex = new boost::mutex;
-	m_p_stop_mutex = new boost::mutex;
+	m_pCommandRing.reset(new LuaCommandRing);
+	m_p_wakeup_mutex.reset(new boost::mutex);
+	m_p_wakeup_condition.reset(new boost::condition_variable);
 
-    std::cout << "LuaEnvironment CONSTRUCTOR called!" << std::endl;
+    LUAENV_TRACE("LuaEnvironment CONSTRUCTOR called!", LuaLogArgs());
     return;
 }
 
 LuaEnvironment::~LuaEnvironment()
 {
+	_ReleaseSharedScriptChunk();
 	if( m_pLua != NULL)
-		delete m_pLua;
-	//if( m_p_terminate_mutex != NULL)
-	//	delete m_p_terminate_mutex;
-	//if( m_p_repeat_mutex != NULL)
-	//	delete m_p_repeat_mutex;
-	//if( m_p_execute_mutex != NULL)
-	//	delete m_p_execute_mutex;
-	//if( m_p_stop_mutex != NULL)
-	//	delete m_p_stop_mutex;
-    std::cout << "LuaEnvironment DESTRUCTOR called!" << std::endl;
+	{
+		// The interpreter goes back to the pool only once the script's chunk and coroutines have been released:
+		if( m_pContextPool != NULL )
+			m_pContextPool->Release(m_pLua);
+		else
+			delete m_pLua;
+	}
+    LUAENV_TRACE("LuaEnvironment DESTRUCTOR called!", LuaLogArgs());
 }
 
 void LuaEnvironment::operator()(LuaThread * pMyLuaThread, std::string scriptName, uint32 accessCode)
 {
 	// This gets called when boost::thread is used to create a thread with a copy of this object:
-    std::cout << "LuaEnvironment class functor called, starting Thread Process!" << std::endl;
+    LUAENV_TRACE("LuaEnvironment class functor called, starting Thread Process!", LuaLogArgs());
     if( m_bThreadProcessActive )
     {
-        std::cout << "LuaEnvironment class _ThreadProcess() already Active!  You cannot call the LuaEnvironment class functor TWICE!" << std::endl;
+        LUAENV_ERROR("LuaEnvironment class _ThreadProcess() already Active!  You cannot call the LuaEnvironment class functor TWICE!", LuaLogArgs());
         return;
     }
 
@@ -68,14 +111,15 @@ void LuaEnvironment::operator()(LuaThread * pMyLuaThread, std::string scriptName
     m_CurrentScriptRunning = m_ScriptPath + "/";
 	m_CurrentScriptRunning += scriptName;
     SetScriptAccessCode(0, accessCode);
-	std::cout << "LuaEnvironment set to execute script '" << m_CurrentScriptRunning.c_str() << "'" << std::endl;
+	LUAENV_DEBUG("LuaEnvironment set to execute script '%s'", LuaLogArgs() << m_CurrentScriptRunning);
 
-    // Send back to owning LuaThread object instance our pointer:
+    // Send back to owning LuaThread object instance our pointer, which also tells it we have started, so only once
+    // GetLua() is valid; the owner must hear back even if the interpreter could not be created:
+    bool bInitialized = (InitializeLuaEnvironment() > 0);
     m_pMyLuaThread->Script_SetOwnedLuaEnvironment(this,m_MyScriptAccessCode);
 
-    InitializeLuaEnvironment();
-
-    _ThreadProcess();
+    if( bInitialized )
+        _ThreadProcess();
 }
 
 void LuaEnvironment::SetThreadOwner(LuaThread * pMyLuaThread)
@@ -93,48 +137,133 @@ int32 LuaEnvironment::InitializeLuaEnvironment()
 {
     if( m_bInitialized )
     {
-        std::cout << "LuaEnvironment::InitializeLuaEnvironment(): Environment already Initialized!  You cannot call this more than once!" << std::endl;
+        LUAENV_ERROR("LuaEnvironment::InitializeLuaEnvironment(): Environment already Initialized!  You cannot call this more than once!", LuaLogArgs());
         return 0;
     }
 
-    std::cout << "LuaEnvironment::InitializeLuaEnvironment(): Initializing Lua Environment object..." << std::endl;
+    LUAENV_DEBUG("LuaEnvironment::InitializeLuaEnvironment(): Initializing Lua Environment object...", LuaLogArgs());
 
     // Create new object instances for critical objects that CANNOT be created in the constructor in the case that
     // this class in instantiated then copied into a thread.  This function MUST either be called inside this class'
     // functor, LuaEnvironment::operator()(), or explicitly by the owner object, LuaThread.
-    m_pLua = new Lua::LuaContext();
-    m_bTerminateThreadFlag = false;
-    m_bRepeatScriptRunsFlag = false;
-    m_bExecuteScriptFlag = false;
-    m_bStopScriptRunsFlag = false;
+    if( m_pContextPool != NULL )
+        m_pLua = m_pContextPool->Acquire();
+    else
+    {
+        m_pLua = new Lua::LuaContext();
+        PrepareLuaContext(m_pLua);
+    }
     m_bTerminateThreadProcess = false;
 
     if( m_pLua == NULL )
     {
-        std::cout << "LuaEnvironment::InitializeLuaEnvironment(): ERROR: Could not successfully create LuaContext object instance." << std::endl;
+        LUAENV_ERROR("LuaEnvironment::InitializeLuaEnvironment(): ERROR: Could not successfully create LuaContext object instance.", LuaLogArgs());
         return 0;
     }
 
     if( m_pMyLuaThread == NULL )
     {
-        std::cout << "LuaEnvironment::InitializeLuaEnvironment(): ERROR: You MUST call SetThreadOwner() to set the pointer to the LuaThread class object!" << std::endl;
+        LUAENV_ERROR("LuaEnvironment::InitializeLuaEnvironment(): ERROR: You MUST call SetThreadOwner() to set the pointer to the LuaThread class object!", LuaLogArgs());
         return 0;
     }
 
+    m_pLua->setMemoryLimit(m_MemoryLimitBytes);
+    m_pLua->setGarbageCollectorPause(m_GCPausePercent);
+    m_pLua->setGarbageCollectorStepMultiplier(m_GCStepMultiplierPercent);
+    if( m_bGenerationalGC )
+        m_pLua->setGenerationalGarbageCollector(true);
+    m_pLua->setCallbackObserver(boost::bind(&LuaThreadMetrics::RecordCallback, m_pMyLuaThread->GetMetrics(), _1));
+    if( m_ProfilerInstructionsPerSample != 0 )
+        m_pLua->startProfiler(int(m_ProfilerInstructionsPerSample));
+    if( m_IdleGCBudgetMicroSeconds != 0 )
+    {
+        m_IdleGCBaselineBytes = m_pLua->getMemoryStatistics().bytesInUse;
+        m_pLua->stopGarbageCollector();
+    }
+
     m_bInitialized = true;
 
     return 1;
 }
 
+void LuaEnvironment::PrepareLuaContext(Lua::LuaContext * pLua)
+{
+    pLua->executeCode(std::string(g_ScriptYieldFunctions));
+}
+
+int32 LuaEnvironment::SetContextPool(LuaContextPool * pContextPool)
+{
+	// The interpreter is taken by InitializeLuaEnvironment(), so this may only be changed before then:
+	if( m_bInitialized )
+	{
+		LUAENV_ERROR("LuaEnvironment::SetContextPool(): ERROR: You MUST call this BEFORE InitializeLuaEnvironment()!", LuaLogArgs());
+		return 0;
+	}
+
+	m_pContextPool = pContextPool;
+	return 1;
+}
+
 int32 LuaEnvironment::SetSleepInterval(uint32 sleepIntervalMilliSeconds)
 {
 	m_SleepIntervalMilliSeconds = sleepIntervalMilliSeconds;
 	return 1;
 }
 
+int32 LuaEnvironment::SetBytecodeCachePath(std::string cachePath)
+{
+	m_BytecodeCachePath = cachePath;
+	return 1;
+}
+
+int32 LuaEnvironment::SetMemoryLimit(uint32 maxBytes)
+{
+	LuaCommand command(LuaCommand::CMD_SET_MEMORY_LIMIT);
+	command.numberValue = double(maxBytes);
+	return _ChangeSetting(command);
+}
+
+int32 LuaEnvironment::SetGarbageCollectorTuning(int pausePercent, int stepMultiplierPercent)
+{
+	LuaCommand pauseCommand(LuaCommand::CMD_SET_GC_PAUSE);
+	pauseCommand.numberValue = double(pausePercent);
+	LuaCommand stepMultiplierCommand(LuaCommand::CMD_SET_GC_STEP_MULTIPLIER);
+	stepMultiplierCommand.numberValue = double(stepMultiplierPercent);
+
+	int32 check = _ChangeSetting(pauseCommand);
+	return ((_ChangeSetting(stepMultiplierCommand) > 0) ? check : 0);
+}
+
+int32 LuaEnvironment::SetGenerationalGarbageCollection(bool bEnabled)
+{
+	LuaCommand command(LuaCommand::CMD_SET_GENERATIONAL_GC);
+	command.boolValue = bEnabled;
+	return _ChangeSetting(command);
+}
+
+int32 LuaEnvironment::SetProfiling(uint32 instructionsPerSample)
+{
+	LuaCommand command(LuaCommand::CMD_SET_PROFILING);
+	command.numberValue = double(instructionsPerSample);
+	return _ChangeSetting(command);
+}
+
+int32 LuaEnvironment::SetIdleGarbageCollection(uint32 budgetMicroSeconds)
+{
+	// The collector is stopped by InitializeLuaEnvironment(), so this may only be changed before then:
+	if( m_bInitialized )
+	{
+		LUAENV_ERROR("LuaEnvironment::SetIdleGarbageCollection(): ERROR: You MUST call this BEFORE InitializeLuaEnvironment()!", LuaLogArgs());
+		return 0;
+	}
+
+	m_IdleGCBudgetMicroSeconds = budgetMicroSeconds;
+	return 1;
+}
+
 void LuaEnvironment::KillThread()
 {
-    m_bTerminateThreadProcess = true;
+    _RequestTerminate();
 }
 
 int32 LuaEnvironment::ExecuteScript(std::string scriptName, uint32 accessCode)
@@ -145,18 +274,18 @@ int32 LuaEnvironment::ExecuteScript(std::string scriptName, uint32 accessCode)
     {
         m_CurrentScriptRunning = m_ScriptPath + "/";
         m_CurrentScriptRunning += scriptName;
-        std::cout << "LuaEnvironment::ExecuteScript(): Attempting to Execute Script '" << scriptName << "'..." << std::endl;
+        LUAENV_DEBUG("LuaEnvironment::ExecuteScript(): Attempting to Execute Script '%s'...", LuaLogArgs() << scriptName);
 
         if( ((check = _CheckInitializedState()) <= 0) )
         {
-            std::cout << "LuaEnvironment::ExecuteScript(): THREAD[" << m_ThreadName << "]: LuaEnvironment NOT initialized!  You MUST call InitializeLuaEnvironment() BEFORE attempting to execute a script!" << std::endl;
+            LUAENV_ERROR("LuaEnvironment::ExecuteScript(): LuaEnvironment NOT initialized!  You MUST call InitializeLuaEnvironment() BEFORE attempting to execute a script!", LuaLogArgs());
             return 0;
         }
 
         if( m_bThreadProcessActive == false )
         {
             if( !(m_bThreadingEnabled) )
-                _SetExecuteScriptFlag();    // Set Execute Script flag right away when threading is disabled
+                _SendCommand(LuaCommand(LuaCommand::CMD_RUN));  // Send Run command right away when threading is disabled
                                             // because we want the script to execute immediately so that it will
                                             // return, notify LuaThread that it completed, then LuaThread will notify
                                             // LuaEnvironment to stop script execution.  This is the flow for non-threading.
@@ -164,7 +293,7 @@ int32 LuaEnvironment::ExecuteScript(std::string scriptName, uint32 accessCode)
             _ThreadProcess();
         }
         else
-            std::cout << "LuaEnvironment::ExecuteScript(): ERROR: Cannot execute script, _ThreadProcess() already Active!" << std::endl;
+            LUAENV_ERROR("LuaEnvironment::ExecuteScript(): ERROR: Cannot execute script, _ThreadProcess() already Active!", LuaLogArgs());
     }
     else
         return 0;
@@ -177,9 +306,9 @@ int32 LuaEnvironment::RunScriptProcess(uint32 accessCode, bool repeat)
     if( accessCode == m_MyScriptAccessCode )
     {
 		if( repeat )
-			_SetRepeatScriptRunsFlag();
+			return _SendCommand(LuaCommand(LuaCommand::CMD_REPEAT));
 		else
-			_SetExecuteScriptFlag();
+			return _SendCommand(LuaCommand(LuaCommand::CMD_RUN));
     }
     else
         return 0;
@@ -191,9 +320,11 @@ int32 LuaEnvironment::StopScriptProcess(uint32 accessCode)
 {
     if( accessCode == m_MyScriptAccessCode )
     {
-        _SetStopScriptRunsFlag();
+        int32 sent = _SendCommand(LuaCommand(LuaCommand::CMD_STOP));
         if( !(m_bThreadingEnabled) )
             m_bTerminateThreadProcess = true;
+        else
+            return sent;
     }
     else
         return 0;
@@ -205,7 +336,8 @@ int32 LuaEnvironment::TerminateThread(uint32 accessCode)
 {
     if( accessCode == m_MyScriptAccessCode )
     {
-        _SetTerminateThreadFlag();
+        _RequestTerminate();
+        return 1;
     }
     else
         return 0;
@@ -214,6 +346,221 @@ int32 LuaEnvironment::TerminateThread(uint32 accessCode)
 }
 
 
+int32 LuaEnvironment::SignalScriptEvent(std::string eventName, uint32 accessCode)
+{
+    if( accessCode != m_MyScriptAccessCode )
+        return 0;
+
+    {
+        boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+        m_PendingEvents.push_back(eventName);
+    }
+    _SignalWakeup();
+
+    return 1;
+}
+
+int32 LuaEnvironment::QueueSetDouble(std::string varName, double doubleVal, uint32 accessCode)
+{
+    LuaCommand command(LuaCommand::CMD_SET_VARIABLE);
+
+    if( accessCode != m_MyScriptAccessCode )
+        return 0;
+
+    if( !(command.SetName(varName)) )
+    {
+        LUAENV_ERROR("LuaEnvironment::QueueSetDouble(): ERROR: Variable name too long for a command: %s", LuaLogArgs() << varName);
+        return 0;
+    }
+
+    command.valueType = LuaCommand::VALUE_NUMBER;
+    command.numberValue = doubleVal;
+    return _SendCommand(command);
+}
+
+int32 LuaEnvironment::QueueSetBool(std::string varName, bool boolVal, uint32 accessCode)
+{
+    LuaCommand command(LuaCommand::CMD_SET_VARIABLE);
+
+    if( accessCode != m_MyScriptAccessCode )
+        return 0;
+
+    if( !(command.SetName(varName)) )
+    {
+        LUAENV_ERROR("LuaEnvironment::QueueSetBool(): ERROR: Variable name too long for a command: %s", LuaLogArgs() << varName);
+        return 0;
+    }
+
+    command.valueType = LuaCommand::VALUE_BOOL;
+    command.boolValue = boolVal;
+    return _SendCommand(command);
+}
+
+int32 LuaEnvironment::QueueSetString(std::string varName, std::string strVal, uint32 accessCode)
+{
+    LuaCommand command(LuaCommand::CMD_SET_VARIABLE);
+
+    if( accessCode != m_MyScriptAccessCode )
+        return 0;
+
+    if( !(command.SetName(varName)) || !(command.SetString(strVal)) )
+    {
+        LUAENV_ERROR("LuaEnvironment::QueueSetString(): ERROR: Variable name or string too long for a command: %s", LuaLogArgs() << varName);
+        return 0;
+    }
+
+    return _SendCommand(command);
+}
+
+int32 LuaEnvironment::QueueCallFunction(std::string functionName, uint32 accessCode)
+{
+    LuaCommand command(LuaCommand::CMD_CALL_FUNCTION);
+
+    if( accessCode != m_MyScriptAccessCode )
+        return 0;
+
+    if( !(command.SetName(functionName)) )
+    {
+        LUAENV_ERROR("LuaEnvironment::QueueCallFunction(): ERROR: Function name too long for a command: %s", LuaLogArgs() << functionName);
+        return 0;
+    }
+
+    return _SendCommand(command);
+}
+
+int32 LuaEnvironment::ScheduleScript(LuaScheduler * pScheduler, std::string scriptName, uint32 accessCode)
+{
+    int32 check = 0;
+
+    if( accessCode != m_MyScriptAccessCode )
+        return 0;
+
+    if( pScheduler == NULL )
+    {
+        LUAENV_ERROR("LuaEnvironment::ScheduleScript(): ERROR: LuaScheduler pointer is NULL!", LuaLogArgs());
+        return 0;
+    }
+
+    if( ((check = _CheckInitializedState()) <= 0) || (m_pLua == NULL) )
+    {
+        LUAENV_ERROR("LuaEnvironment::ScheduleScript(): LuaEnvironment NOT initialized!  You MUST call InitializeLuaEnvironment() BEFORE attempting to schedule a script!", LuaLogArgs());
+        return 0;
+    }
+
+    if( m_bThreadProcessActive || (m_pScheduler != NULL) )
+    {
+        LUAENV_ERROR("LuaEnvironment::ScheduleScript(): ERROR: Cannot schedule script, _ThreadProcess() already Active!", LuaLogArgs());
+        return 0;
+    }
+
+    m_CurrentScriptRunning = m_ScriptPath + "/";
+    m_CurrentScriptRunning += scriptName;
+    m_bTerminateThreadProcess = false;
+    m_pScheduler = pScheduler;
+    LUAENV_DEBUG("LuaEnvironment::ScheduleScript(): Scheduling Script '%s'...", LuaLogArgs() << scriptName);
+
+    // The first slice opens the script and then waits for the Run/Repeat commands like _ThreadProcess() does:
+    _RequestScheduledSlice();
+
+    return 1;
+}
+
+LuaEnvironment::SliceResult LuaEnvironment::RunScheduledSlice(boost::system_time & wakeTime)
+{
+    boost::posix_time::time_duration queueWait;
+    {
+        boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+        if( m_bSchedulerDetached )
+            return SLICE_FINISHED;
+        m_bSliceQueued = false;
+        m_bSliceRunning = true;
+        queueWait = boost::get_system_time() - m_SliceQueuedTime;
+
+        // Another worker may be collecting garbage for us, which takes no longer than the idle budget:
+        while( m_bIdleGCRunning )
+            m_p_wakeup_condition->wait(lock);
+    }
+    _RecordQueueWait(queueWait);
+
+    // This is one pass of the loop in _ThreadProcess(), run on whichever LuaScheduler worker picked us up.
+    // Once terminated, the thread process is never started again, whatever commands are still sent to us:
+    bool bTerminated = m_bTerminateThreadProcess;
+    if( (!bTerminated) && (!m_bThreadProcessActive) )
+    {
+        _StartThreadProcess();
+        bTerminated = m_bTerminateThreadProcess;
+    }
+
+    if( !bTerminated )
+    {
+        _ProcessScriptState();
+        bTerminated = m_bTerminateThreadProcess;
+    }
+
+    if( bTerminated && m_bThreadProcessActive )
+        _StopThreadProcess();
+
+    boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+    m_bSliceRunning = false;
+    m_p_wakeup_condition->notify_all();     // DetachScheduler() may be waiting for this slice to finish
+
+    if( bTerminated || m_bSchedulerDetached )
+        return SLICE_FINISHED;
+
+    // Any command sent while this slice was running found m_bSliceRunning set and did not queue us, so do it now:
+    if( _IsCommandPending() )
+    {
+        m_bSliceQueued = true;
+        m_SliceQueuedTime = boost::get_system_time();
+        return SLICE_REQUEUE;
+    }
+
+    // Waiting for the REPEAT interval or for a script instance's wait() to expire:
+    if( _GetNextWakeTime(wakeTime) )
+        return SLICE_WAIT;
+
+    return SLICE_IDLE;
+}
+
+void LuaEnvironment::DetachScheduler()
+{
+    // After this returns, no LuaScheduler worker is running this LuaEnvironment, and none ever will again,
+    // so the owning LuaThread may safely be destroyed even while the scheduler still holds a reference to us:
+    boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+    m_bSchedulerDetached = true;
+    while( m_bSliceRunning || m_bIdleGCRunning )
+        m_p_wakeup_condition->wait(lock);
+
+    // Nor may our diagnostics go to its log, nor our metrics to its LuaThreadMetrics, since the scheduler may well
+    // destroy us after the owner:
+    m_pMyLuaThread = NULL;
+    lock.unlock();
+    if( m_pLua != NULL )
+        m_pLua->setCallbackObserver(std::function<void (unsigned long long)>());
+}
+
+bool LuaEnvironment::RunIdleGarbageCollection()
+{
+    if( (m_IdleGCBudgetMicroSeconds == 0) || (m_pLua == NULL) )
+        return false;
+
+    {
+        // A slice that is queued will give us back to the scheduler's idle work when it ends anyway:
+        boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+        if( m_bSchedulerDetached || m_bSliceRunning || m_bSliceQueued )
+            return false;
+        m_bIdleGCRunning = true;
+    }
+
+    bool bCycleIncomplete = _StepIdleGarbageCollector();
+
+    boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+    m_bIdleGCRunning = false;
+    m_p_wakeup_condition->notify_all();     // RunScheduledSlice() or DetachScheduler() may be waiting for us
+    return bCycleIncomplete;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Protected and Private Member Functions:
 
@@ -227,97 +574,855 @@ int32 LuaEnvironment::_CheckInitializedState()
 //    if( m_pLua == NULL )
 //        return -2;
 
-    if( m_p_stop_mutex == NULL )
+    if( m_pCommandRing.get() == NULL )
         return -3;
 
-    if( m_p_execute_mutex == NULL)
-        return -4;
-
-    if( m_p_terminate_mutex == NULL)
-        return -5;
-
-    if( m_p_repeat_mutex == NULL)
-        return -6;
+    if( (m_p_wakeup_mutex.get() == NULL) || (m_p_wakeup_condition.get() == NULL) )
+        return -7;
 
     // All checks PASSED, return true
     return 1;
 }
 
 void LuaEnvironment::_ThreadProcess()
+{
+    _StartThreadProcess();
+
+    while( !m_bTerminateThreadProcess )
+    {
+        _ProcessScriptState();
+
+        // Block in this thread until the next command arrives ONLY if threading is enabled:
+        if( m_bThreadingEnabled )
+        {
+            if( m_IdleGCBudgetMicroSeconds != 0 )
+                _CollectGarbageUntilCommand();
+
+            LUAENV_TRACE("LuaEnvironment::ThreadProcess(): Thread Process going to sleep...", LuaLogArgs());
+            _WaitForCommand();
+            LUAENV_TRACE("LuaEnvironment::ThreadProcess(): Thread Process has reawakened!", LuaLogArgs());
+        }
+        else if( !m_ScriptInstances.empty() )
+        {
+            // Without threading, a script that called wait() is resumed from here, but nothing can ever
+            // call SignalScriptEvent() while we block the caller's thread, so give up on waitEvent():
+            boost::system_time wakeTime;
+            if( !_GetNextWakeTime(wakeTime) )
+            {
+                LUAENV_ERROR("LuaEnvironment::ThreadProcess(): ERROR: Script is waiting for an event, which requires threading to be enabled!", LuaLogArgs());
+                break;
+            }
+            _WaitForCommand();
+        }
+    }
+
+    _StopThreadProcess();
+}
+
+void LuaEnvironment::_StartThreadProcess()
 {
     m_bThreadProcessActive = true;
-    std::ifstream * scriptFileStream;
-    scriptFileStream = new std::ifstream(m_CurrentScriptRunning.c_str(), std::ifstream::in);
 
-    // If the file stream failed to load the script file, we have a major problem
-    // so terminate the thread process:
-    if( scriptFileStream->fail() )
+    // Compile the script up front.  If the script file can't be opened, we have a major problem so terminate the
+    // thread process, completing the run with an error so that no one waits for it; a script failing to compile is
+    // only reported, since it is compiled again once fixed:
+    if( (m_pLua == NULL) || (_UpdateScriptChunk() < 0) )
     {
-        std::cout << m_ThreadName.c_str() << " ERROR: Failed to open script " << m_CurrentScriptRunning.c_str() << std::endl;
-        _SetTerminateThreadFlag();
+        m_bTerminateThreadProcess = true;
+        _Owner_ScriptCompleteNotify(0, "Failed to open script " + m_CurrentScriptRunning);
     }
 
-	std::cout << m_ThreadName.c_str() << " STARTING UP..." << std::endl;
-    while( (!m_bTerminateThreadProcess) && (!_GetTerminateThreadFlag()) )
+	LUAENV_DEBUG("LuaEnvironment: STARTING UP...", LuaLogArgs());
+}
+
+void LuaEnvironment::_ProcessScriptState()
+{
+    boost::system_time const now = boost::get_system_time();
+    bool bRepeatDue = false;
+
+    // Receive Commands and change state accordingly:
+    _ProcessCommands(bRepeatDue);
+    if( m_bTerminateThreadProcess )
+        return;
+
+    if( m_IdleGCBudgetMicroSeconds != 0 )
+        _CheckIdleGarbageCollectorBacklog();
+
+    // Actions taken by State:
+    switch (m_ScriptState)
+    {
+        case STATE_IDLE:
+            LUAENV_TRACE("LuaEnvironment::ThreadProcess(): Executing IDLE state", LuaLogArgs());
+            break;
+
+        case STATE_RUN:
+            LUAENV_TRACE("LuaEnvironment::ThreadProcess(): Executing RUN state", LuaLogArgs());
+            LUAENV_TRACE("LuaEnvironment::ThreadProcess(): EXECUTING Lua script...", LuaLogArgs());
+            _CreateScriptInstance();
+            m_ScriptState = STATE_IDLE;     // The script instance carries on by itself, so wait for the next command
+            break;
+
+        case STATE_REPEAT:
+            // m_ScriptState stays STATE_REPEAT until a Stop or Run command arrives
+            if( !(bRepeatDue || (now >= m_NextRepeatTime)) )
+                break;
+
+            LUAENV_TRACE("LuaEnvironment::ThreadProcess(): Executing REPEAT state", LuaLogArgs());
+            m_NextRepeatTime = now + boost::posix_time::milliseconds(m_SleepIntervalMilliSeconds);
+
+            // Runs do not pile up: while the previous run is still suspended in wait() or waitEvent(), this one is skipped
+            if( m_ScriptInstances.empty() )
+            {
+                LUAENV_TRACE("LuaEnvironment::ThreadProcess(): EXECUTING Lua script w/ REPEAT...", LuaLogArgs());
+                _CreateScriptInstance();
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    _ResumeScriptInstances();
+}
+
+// 64-bit FNV-1a hash of the script source, used to name its file in the bytecode cache:
+static std::string HashScriptSource(const char * source, size_t size)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for( size_t i = 0; i < size; i++ )
+    {
+        hash ^= (unsigned char)source[i];
+        hash *= 1099511628211ULL;
+    }
+
+    std::ostringstream hashString;
+    hashString.width(16);
+    hashString.fill('0');
+    hashString << std::hex << hash;
+    return hashString.str();
+}
+
+// Compiled scripts shared by every LuaEnvironment running the same version of the same script file, keyed by the
+// script name and the hash of its source.  An entry is kept while any LuaEnvironment uses it and, once unused, until
+// the script is modified, so that a script spawned again later is not compiled again either:
+struct SharedScriptChunk
+{
+    std::string scriptName;
+    lua_SharedChunk * pChunk;
+    uint32 users;                       // LuaEnvironments that acquired the entry and have not released it yet
+    bool bOutdated;                     // A newer version of the script was compiled since
+};
+
+static boost::mutex g_SharedScriptChunksMutex;
+static std::map<std::string, SharedScriptChunk> g_SharedScriptChunks;
+
+static lua_SharedChunk * AcquireSharedScriptChunk(const std::string & key)
+{
+    boost::mutex::scoped_lock lock(g_SharedScriptChunksMutex);
+    std::map<std::string, SharedScriptChunk>::iterator it = g_SharedScriptChunks.find(key);
+    if( it == g_SharedScriptChunks.end() )
+        return NULL;
+
+    it->second.users++;
+    return it->second.pChunk;
+}
+
+// Adds a chunk made by LuaContext::shareChunk() and acquires it, unless another LuaEnvironment added the same one first,
+// in which case that one is acquired instead:
+static lua_SharedChunk * PublishSharedScriptChunk(const std::string & key, const std::string & scriptName, lua_SharedChunk * pChunk)
+{
+    if( pChunk == NULL )
+        return NULL;
+
+    boost::mutex::scoped_lock lock(g_SharedScriptChunksMutex);
+    std::map<std::string, SharedScriptChunk>::iterator it = g_SharedScriptChunks.find(key);
+    if( it != g_SharedScriptChunks.end() )
     {
-        // Check Flags and change state accordingly:
-        if( _GetExecuteScriptFlag() )
-            m_ScriptState = STATE_RUN;
-        if( _GetRepeatScriptRunsFlag() )
-            m_ScriptState = STATE_REPEAT;
-        if( _GetStopScriptRunsFlag() )
-            m_ScriptState = STATE_IDLE;
+        Lua::LuaContext::releaseSharedChunk(pChunk);
+        it->second.users++;
+        return it->second.pChunk;
+    }
 
-        // Actions taken by State:
-        switch (m_ScriptState)
+    // The previous versions of the script go away as soon as nothing runs them anymore:
+    for( it = g_SharedScriptChunks.begin(); it != g_SharedScriptChunks.end(); )
+    {
+        if( it->second.scriptName == scriptName )
         {
-            case STATE_IDLE:
-                std::cout << "LuaEnvironment::ThreadProcess(): (" << m_ThreadName.c_str() << ") Executing IDLE state" << std::endl;
-                _ClearRepeatScriptRunsFlag();
-                _ClearExecuteScriptFlag();
-                _ClearStopScriptRunsFlag();
+            it->second.bOutdated = true;
+            if( it->second.users == 0 )
+            {
+                Lua::LuaContext::releaseSharedChunk(it->second.pChunk);
+                g_SharedScriptChunks.erase(it++);
+                continue;
+            }
+        }
+        ++it;
+    }
+
+    SharedScriptChunk entry;
+    entry.scriptName = scriptName;
+    entry.pChunk = pChunk;
+    entry.users = 1;
+    entry.bOutdated = false;
+    g_SharedScriptChunks[key] = entry;
+    return pChunk;
+}
+
+static void ReleaseSharedScriptChunk(const std::string & key)
+{
+    // The lua_States that loaded the chunk keep their own reference to it, so it may be released while they run:
+    boost::mutex::scoped_lock lock(g_SharedScriptChunksMutex);
+    std::map<std::string, SharedScriptChunk>::iterator it = g_SharedScriptChunks.find(key);
+    if( it == g_SharedScriptChunks.end() )
+        return;
+
+    it->second.users--;
+    if( (it->second.users == 0) && it->second.bOutdated )
+    {
+        Lua::LuaContext::releaseSharedChunk(it->second.pChunk);
+        g_SharedScriptChunks.erase(it);
+    }
+}
+
+int32 LuaEnvironment::_UpdateScriptChunk()
+{
+    // The script is only compiled again when the file was modified since it was last compiled:
+    struct stat fileInfo;
+    if( stat(m_CurrentScriptRunning.c_str(), &fileInfo) != 0 )
+    {
+        if( m_ScriptChunk != LUA_NOREF )
+            return 1;       // Keep running the last version we compiled
+        LUAENV_ERROR("LuaEnvironment::_UpdateScriptChunk(): ERROR: Failed to open script %s", LuaLogArgs() << m_CurrentScriptRunning);
+        return -1;
+    }
+
+    if( (m_ScriptChunk != LUA_NOREF) && (fileInfo.st_mtime == m_ScriptChunkModifiedTime) )
+        return 1;
+
+    // Map the file again, since it may have been replaced rather than rewritten.  The source is hashed and
+    // compiled straight from the mapping, without being copied:
+    Lua::MappedFile source(m_CurrentScriptRunning);
+    if( !(source.isOpen()) )
+    {
+        LUAENV_ERROR("LuaEnvironment::_UpdateScriptChunk(): ERROR: Failed to open or map script %s", LuaLogArgs() << m_CurrentScriptRunning);
+        return (m_ScriptChunk != LUA_NOREF) ? 1 : -1;
+    }
+
+    std::string sourceHash = HashScriptSource(source.data(), source.size());
+    std::string chunkName = "@" + m_CurrentScriptRunning;
+    std::string compileError;
+    int newChunk = LUA_NOREF;
+
+    // Use the instructions another LuaEnvironment already compiled for this exact script, if any:
+    std::string sharedChunkKey = m_CurrentScriptRunning + ":" + sourceHash;
+    lua_SharedChunk * pSharedChunk = AcquireSharedScriptChunk(sharedChunkKey);
+    if( pSharedChunk != NULL )
+        newChunk = m_pLua->loadSharedChunk(pSharedChunk, chunkName.c_str());
+
+    if( newChunk == LUA_NOREF )
+    {
+        std::string cacheFile;
+
+        // Load the precompiled bytecode for this exact source if any LuaEnvironment already produced it,
+        // otherwise compile the source and produce it for the others:
+        if( !(m_BytecodeCachePath.empty()) )
+        {
+            cacheFile = m_BytecodeCachePath + "/" + sourceHash + ".luac";
+            newChunk = _LoadCachedBytecode(cacheFile);
+        }
+
+        if( newChunk == LUA_NOREF )
+        {
+            newChunk = m_pLua->loadChunk(source.data(), source.size(), chunkName.c_str(), &compileError);
+            if( (newChunk != LUA_NOREF) && !(cacheFile.empty()) )
+                _StoreCachedBytecode(cacheFile, newChunk);
+        }
+
+        // Hand the instructions to the other LuaEnvironments, and use the shared copy ourselves so that our own
+        // copy can be freed:
+        if( (newChunk != LUA_NOREF) && (pSharedChunk == NULL) )
+        {
+            pSharedChunk = PublishSharedScriptChunk(sharedChunkKey, m_CurrentScriptRunning, m_pLua->shareChunk(newChunk));
+            int sharedChunk = (pSharedChunk != NULL) ? m_pLua->loadSharedChunk(pSharedChunk, chunkName.c_str()) : LUA_NOREF;
+            if( sharedChunk != LUA_NOREF )
+            {
+                m_pLua->releaseChunk(newChunk);
+                newChunk = sharedChunk;
+            }
+        }
+    }
+
+    if( pSharedChunk == NULL )
+        sharedChunkKey.clear();
+
+    if( newChunk == LUA_NOREF )
+    {
+        LUAENV_ERROR("LuaEnvironment::_UpdateScriptChunk(): ERROR: Failed to compile script %s: %s", LuaLogArgs() << m_CurrentScriptRunning << compileError);
+        if( !(sharedChunkKey.empty()) )
+            ReleaseSharedScriptChunk(sharedChunkKey);
+        return (m_ScriptChunk != LUA_NOREF) ? 1 : 0;
+    }
+
+    if( m_ScriptChunk != LUA_NOREF )
+    {
+        LUAENV_INFO("LuaEnvironment::_UpdateScriptChunk(): Script modified, recompiled %s", LuaLogArgs() << m_CurrentScriptRunning);
+        m_pLua->releaseChunk(m_ScriptChunk);
+    }
+    _ReleaseSharedScriptChunk();
+
+    m_ScriptChunk = newChunk;
+    m_ScriptChunkModifiedTime = fileInfo.st_mtime;
+    m_SharedScriptChunkKey = sharedChunkKey;
+
+    return 1;
+}
+
+void LuaEnvironment::_ReleaseSharedScriptChunk()
+{
+    if( !(m_SharedScriptChunkKey.empty()) )
+    {
+        ReleaseSharedScriptChunk(m_SharedScriptChunkKey);
+        m_SharedScriptChunkKey.clear();
+    }
+}
+
+int LuaEnvironment::_LoadCachedBytecode(const std::string & cacheFile)
+{
+    Lua::MappedFile bytecode(cacheFile);
+    if( !(bytecode.isOpen()) || (bytecode.size() == 0) )      // An empty file would load as an empty script
+        return LUA_NOREF;
+
+    // lua_load checks the bytecode header, so a file produced by an incompatible build of Lua (or a truncated one)
+    // simply fails to load here, and is then replaced by _StoreCachedBytecode():
+    int chunk = m_pLua->loadChunk(bytecode.data(), bytecode.size(), ("@" + cacheFile).c_str());
+    if( chunk == LUA_NOREF )
+        LUAENV_WARNING("LuaEnvironment::_LoadCachedBytecode(): Ignoring unusable bytecode file %s", LuaLogArgs() << cacheFile);
+
+    return chunk;
+}
+
+// Numbers the temporary bytecode files of this process, which are also named after the process id, since the
+// LuaEnvironments of several server processes may share the same cache directory:
+static boost::atomic<uint32> g_BytecodeTempFileCounter(0);
+
+void LuaEnvironment::_StoreCachedBytecode(const std::string & cacheFile, int chunk)
+{
+#ifdef _WIN32
+    _mkdir(m_BytecodeCachePath.c_str());
+#else
+    mkdir(m_BytecodeCachePath.c_str(), 0755);
+#endif
+
+    // Write to a file of our own first and rename it into place, so that other LuaEnvironments
+    // compiling the same script at the same time never load a partially written file:
+    std::ostringstream tempFile;
+#ifdef _WIN32
+    tempFile << cacheFile << "." << _getpid() << "." << g_BytecodeTempFileCounter++ << ".tmp";
+#else
+    tempFile << cacheFile << "." << getpid() << "." << g_BytecodeTempFileCounter++ << ".tmp";
+#endif
+
+    bool bWritten = false;
+    {
+        std::ofstream bytecodeStream(tempFile.str().c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+        if( !(bytecodeStream.fail()) )
+            bWritten = m_pLua->dumpChunk(chunk, bytecodeStream);
+    }
+
+#ifdef _WIN32
+    // rename() does not replace an existing file on Windows, so the cache entry is missing for a moment, during
+    // which the others just compile the source; on POSIX rename() replaces it atomically:
+    if( bWritten )
+        remove(cacheFile.c_str());
+#endif
+    if( (!bWritten) || (rename(tempFile.str().c_str(), cacheFile.c_str()) != 0) )
+    {
+        remove(tempFile.str().c_str());
+        LUAENV_WARNING("LuaEnvironment::_StoreCachedBytecode(): WARNING: Could not write bytecode file %s", LuaLogArgs() << cacheFile);
+    }
+}
+
+int32 LuaEnvironment::_CreateScriptInstance()
+{
+    // Every run of the script gets a new coroutine calling the same compiled chunk:
+    if( _UpdateScriptChunk() <= 0 )
+    {
+        LUAENV_ERROR("LuaEnvironment: ERROR - Failed to load script %s", LuaLogArgs() << m_CurrentScriptRunning);
+        _Owner_ScriptCompleteNotify(0, "Failed to load script " + m_CurrentScriptRunning);   // This run completes without starting
+        return 0;
+    }
+
+    ScriptInstance instance;
+    instance.coroutine = m_pLua->createCoroutine(m_ScriptChunk);
+    instance.bWaitingForTime = false;
+    instance.wakeTime = boost::get_system_time();
+    instance.startTime = instance.wakeTime;
+
+    if( instance.coroutine == LUA_NOREF )
+    {
+        LUAENV_ERROR("LuaEnvironment: ERROR - Failed to create coroutine for script %s", LuaLogArgs() << m_CurrentScriptRunning);
+        return 0;
+    }
+
+    m_ScriptInstances.push_back(instance);
+
+    return 1;
+}
+
+void LuaEnvironment::_ResumeScriptInstances()
+{
+    std::vector<std::string> events;
+    {
+        boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+        events.swap(m_PendingEvents);
+    }
+
+    // Garbage collected and memory allocated while the instances run, for the LuaThreadMetrics:
+    LuaThreadMetrics * pMetrics = _GetMetrics();
+    unsigned long long startBytesAllocated = 0;
+    unsigned long long startGCMicroSeconds = 0;
+    if( pMetrics != NULL )
+        m_pLua->getAllocationCounters(startBytesAllocated, startGCMicroSeconds);
+    bool bResumed = false;
+
+    boost::system_time const now = boost::get_system_time();
+    std::list<ScriptInstance>::iterator it = m_ScriptInstances.begin();
+    while( it != m_ScriptInstances.end() )
+    {
+        // Release instances waiting for one of the events signaled since the last pass:
+        if( !(it->waitEventName.empty()) )
+        {
+            if( std::find(events.begin(), events.end(), it->waitEventName) == events.end() )
+            {
+                ++it;
+                continue;
+            }
+            it->waitEventName = "";
+        }
+
+        if( it->bWaitingForTime && (now < it->wakeTime) )
+        {
+            ++it;
+            continue;
+        }
+        it->bWaitingForTime = false;
+
+        // Run this instance until it yields back to us or finishes.  The LuaContext is only locked while
+        // it runs, so the owner can read and write script variables while the instance is suspended:
+        bool bSuspended = false;
+        std::string errorMessage;
+        std::tuple<std::string, std::string> yielded;
+        bResumed = true;
+        try
+        {
+            bSuspended = m_pLua->resumeCoroutine(it->coroutine, yielded);
+        }
+        catch( std::bad_alloc & )
+        {
+            // LuaContext reports both the memory limit being reached and the system running out of memory this way:
+            std::ostringstream message;
+            message << "not enough memory";
+            if( m_MemoryLimitBytes != 0 )
+                message << " (memory limit of " << m_MemoryLimitBytes << " bytes)";
+            errorMessage = message.str();
+            LUAENV_ERROR("LuaEnvironment: SCRIPT ERROR - %s", LuaLogArgs() << errorMessage);
+        }
+        catch( std::exception & e )
+        {
+            LUAENV_ERROR("LuaEnvironment: SCRIPT ERROR - %s", LuaLogArgs() << e.what());
+            errorMessage = e.what();
+            if( errorMessage.empty() )
+                errorMessage = "unknown error";     // An empty message means no error to the owner
+        }
+
+        if( bSuspended )
+        {
+            if( std::get<0>(yielded) == "wait" )
+            {
+                it->bWaitingForTime = true;
+                it->wakeTime = now + boost::posix_time::milliseconds(atol(std::get<1>(yielded).c_str()));
+            }
+            else if( std::get<0>(yielded) == "event" )
+                it->waitEventName = std::get<1>(yielded);
+            else
+            {
+                // A plain coroutine.yield() just gives the other scripts a turn, resume it on the next pass:
+                it->bWaitingForTime = true;
+                it->wakeTime = now;
+            }
+            ++it;
+        }
+        else
+        {
+            uint32 durationMicroSeconds = (uint32)((boost::get_system_time() - it->startTime).total_microseconds());
+            m_pLua->destroyCoroutine(it->coroutine);
+            it = m_ScriptInstances.erase(it);
+            _Owner_ScriptCompleteNotify(durationMicroSeconds, errorMessage);
+        }
+    }
+
+    if( bResumed && (pMetrics != NULL) )
+    {
+        unsigned long long endBytesAllocated;
+        unsigned long long endGCMicroSeconds;
+        m_pLua->getAllocationCounters(endBytesAllocated, endGCMicroSeconds);
+        pMetrics->RecordScriptPass(endGCMicroSeconds - startGCMicroSeconds, endBytesAllocated - startBytesAllocated,
+            m_pLua->isGarbageCollectionTimed());
+    }
+}
+
+void LuaEnvironment::_DestroyScriptInstances()
+{
+    for( std::list<ScriptInstance>::iterator it = m_ScriptInstances.begin(); it != m_ScriptInstances.end(); ++it )
+        m_pLua->destroyCoroutine(it->coroutine);
+    m_ScriptInstances.clear();
+}
+
+bool LuaEnvironment::_GetNextWakeTime(boost::system_time & wakeTime)
+{
+    bool bWakeTimeSet = false;
+
+    if( m_ScriptState == STATE_REPEAT )
+    {
+        wakeTime = m_NextRepeatTime;
+        bWakeTimeSet = true;
+    }
+
+    for( std::list<ScriptInstance>::iterator it = m_ScriptInstances.begin(); it != m_ScriptInstances.end(); ++it )
+    {
+        if( it->bWaitingForTime && ((!bWakeTimeSet) || (it->wakeTime < wakeTime)) )
+        {
+            wakeTime = it->wakeTime;
+            bWakeTimeSet = true;
+        }
+    }
+
+    return bWakeTimeSet;
+}
+
+bool LuaEnvironment::_StepIdleGarbageCollector()
+{
+    // Step the collector until the budget is used up or the cycle completes.  A single step is a small fraction
+    // of the budget, see LuaContext::stepGarbageCollector():
+    boost::system_time const endTime = boost::get_system_time() + boost::posix_time::microseconds(m_IdleGCBudgetMicroSeconds);
+
+    do
+    {
+        boost::system_time const stepStartTime = boost::get_system_time();
+        bool const bCycleComplete = m_pLua->stepGarbageCollector();
+        LuaThreadMetrics * pMetrics = _GetMetrics();
+        if( pMetrics != NULL )
+            pMetrics->RecordIdleGarbageCollection((boost::get_system_time() - stepStartTime).total_microseconds());
+
+        if( bCycleComplete )
+        {
+            m_IdleGCBaselineBytes = m_pLua->getMemoryStatistics().bytesInUse;
+            if( m_bIdleGCBacklog )
+            {
+                m_pLua->stopGarbageCollector();
+                m_bIdleGCBacklog = false;
+            }
+            return false;
+        }
+    }
+    while( boost::get_system_time() < endTime );
+
+    return true;
+}
+
+void LuaEnvironment::_CollectGarbageUntilCommand()
+{
+    // Spend the time until the next command, REPEAT run or wait() expiry on the garbage collector, one budget at a
+    // time so that a command is never kept waiting for long, until the collection cycle completes:
+    while( true )
+    {
+        {
+            boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+            boost::system_time wakeTime;
+            if( _IsCommandPending() )
+                return;
+            if( _GetNextWakeTime(wakeTime) && (wakeTime <= boost::get_system_time()) )
+                return;
+        }
+
+        if( !_StepIdleGarbageCollector() )
+            return;
+    }
+}
+
+void LuaEnvironment::_CheckIdleGarbageCollectorBacklog()
+{
+    // If the idle time is not enough to complete a cycle before the memory in use reaches the point where lua
+    // would have started a new one, the collector runs during the script ticks again until the cycle completes:
+    if( m_bIdleGCBacklog )
+        return;
+
+    size_t bytesInUse = m_pLua->getMemoryStatistics().bytesInUse;
+    if( bytesInUse > (m_IdleGCBaselineBytes / 100) * m_GCPausePercent )
+    {
+        LUAENV_WARNING("LuaEnvironment::_CheckIdleGarbageCollectorBacklog(): Idle time cannot keep up, collecting garbage during script ticks.", LuaLogArgs());
+        m_pLua->restartGarbageCollector();
+        m_bIdleGCBacklog = true;
+    }
+}
+
+void LuaEnvironment::_StopThreadProcess()
+{
+    LUAENV_DEBUG("LuaEnvironment: FINISHED!", LuaLogArgs());
+
+    _DestroyScriptInstances();
+
+    if( m_ScriptChunk != LUA_NOREF )
+    {
+        m_pLua->releaseChunk(m_ScriptChunk);
+        m_ScriptChunk = LUA_NOREF;
+    }
+    _ReleaseSharedScriptChunk();
+
+    m_bThreadProcessActive = false;
+}
+
+bool LuaEnvironment::_IsCommandPending()
+{
+    // Must be called with m_p_wakeup_mutex locked, since m_PendingEvents is protected by it:
+    return ( m_bTerminateThreadProcess || m_pCommandRing->IsTerminateRequested() || !(m_pCommandRing->IsEmpty()) ||
+             (!m_PendingEvents.empty()) );
+}
+
+int32 LuaEnvironment::_SendCommand(const LuaCommand & command)
+{
+    bool bSent = m_pCommandRing->Push(command);
+
+    // A busy script may fall behind a burst of commands, so sleep until the thread draining the ring has taken one,
+    // for a moment at most, before giving up on the command.  Without threading nothing drains it until the script
+    // is run again:
+    if( (!bSent) && m_bThreadingEnabled )
+    {
+        _SignalWakeup();
+        boost::system_time const giveUpTime = boost::get_system_time() + boost::posix_time::milliseconds(LUAENV_COMMAND_SEND_TIMEOUT);
+        while( (!bSent) && m_pCommandRing->WaitForSpace(giveUpTime) )
+            bSent = m_pCommandRing->Push(command);
+    }
+
+    if( !bSent )
+    {
+        LUAENV_ERROR("LuaEnvironment::_SendCommand(): ERROR: Command ring full, command %s NOT sent!", LuaLogArgs() << double(command.type));
+        return 0;
+    }
+
+    _SignalWakeup();
+    return 1;
+}
+
+int32 LuaEnvironment::_ChangeSetting(const LuaCommand & command)
+{
+    // Once initialized, the interpreter belongs to the thread running us, so the change is sent to it like any other
+    // command and applies before the script is next resumed.  Before then, or without threading, the caller is the only
+    // thread touching us:
+    if( m_bInitialized && m_bThreadingEnabled )
+        return _SendCommand(command);
+
+    _ApplySetting(command);
+    return 1;
+}
+
+void LuaEnvironment::_ApplySetting(const LuaCommand & command)
+{
+    // The settings are kept for InitializeLuaEnvironment(), and applied right away once the interpreter exists:
+    switch( command.type )
+    {
+        case LuaCommand::CMD_SET_MEMORY_LIMIT:
+            m_MemoryLimitBytes = uint32(command.numberValue);
+            if( m_pLua != NULL )
+                m_pLua->setMemoryLimit(m_MemoryLimitBytes);
+            break;
+
+        case LuaCommand::CMD_SET_GC_PAUSE:
+            m_GCPausePercent = int(command.numberValue);
+            if( m_pLua != NULL )
+                m_pLua->setGarbageCollectorPause(m_GCPausePercent);
+            break;
+
+        case LuaCommand::CMD_SET_GC_STEP_MULTIPLIER:
+            m_GCStepMultiplierPercent = int(command.numberValue);
+            if( m_pLua != NULL )
+                m_pLua->setGarbageCollectorStepMultiplier(m_GCStepMultiplierPercent);
+            break;
+
+        case LuaCommand::CMD_SET_GENERATIONAL_GC:
+            // Switching modes does a full collection, so it is best done before the script has built up its state:
+            m_bGenerationalGC = command.boolValue;
+            if( m_pLua != NULL )
+                m_pLua->setGenerationalGarbageCollector(m_bGenerationalGC);
+            break;
+
+        case LuaCommand::CMD_SET_PROFILING:
+            m_ProfilerInstructionsPerSample = uint32(command.numberValue);
+            if( m_pLua != NULL )
+            {
+                if( m_ProfilerInstructionsPerSample != 0 )
+                    m_pLua->startProfiler(int(m_ProfilerInstructionsPerSample));
+                else
+                    m_pLua->stopProfiler();
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+void LuaEnvironment::_RequestTerminate()
+{
+    // Never lost to a full ring, and seen by _IsCommandPending() once the wakeup is signaled:
+    m_pCommandRing->RequestTerminate();
+    _SignalWakeup();
+}
+
+void LuaEnvironment::_ProcessCommands(bool & bRepeatDue)
+{
+    LuaCommand command;
+
+    // Commands are applied in the order they were sent, so the last state command received wins.  Terminating
+    // takes precedence over all of them, and the ones still in the ring are never processed:
+    while( !(m_pCommandRing->IsTerminateRequested()) && m_pCommandRing->Pop(command) )
+    {
+        switch( command.type )
+        {
+            case LuaCommand::CMD_RUN:
+                m_ScriptState = STATE_RUN;
+                break;
+
+            case LuaCommand::CMD_REPEAT:
+                m_ScriptState = STATE_REPEAT;
+                bRepeatDue = true;          // A new Repeat command starts the first run right away
                 break;
 
-            case STATE_RUN:
-                std::cout << "LuaEnvironment::ThreadProcess(): (" << m_ThreadName.c_str() << ") Executing RUN state" << std::endl;
-                _ClearExecuteScriptFlag();
-                std::cout << "LuaEnvironment::ThreadProcess(): (" << m_ThreadName.c_str() << ") EXECUTING Lua script..." << std::endl;
-                m_pLua->executeCode(*scriptFileStream);		// Alternative:  m_pLua->executeCode(std::ifstream(m_CurrentScriptRunning.c_str()));
-                _Owner_ScriptCompleteNotify();
+            case LuaCommand::CMD_STOP:
+                m_ScriptState = STATE_IDLE;
+                _DestroyScriptInstances();
                 break;
 
-            case STATE_REPEAT:
-                std::cout << "LuaEnvironment::ThreadProcess(): (" << m_ThreadName.c_str() << ") Executing REPEAT state" << std::endl;
-                std::cout << "LuaEnvironment::ThreadProcess(): Executing REPEAT state" << std::endl;
-                std::cout << "LuaEnvironment::ThreadProcess(): (" << m_ThreadName.c_str() << ") EXECUTING Lua script w/ REPEAT..." << std::endl;
-                std::cout << "LuaEnvironment::ThreadProcess(): EXECUTING Lua script w/ REPEAT..." << std::endl;
-                m_pLua->executeCode(*scriptFileStream);		// Alternative:  m_pLua->executeCode(std::ifstream(m_CurrentScriptRunning.c_str()));
-                _Owner_ScriptCompleteNotify();
+            case LuaCommand::CMD_SET_VARIABLE:
+                if( command.valueType == LuaCommand::VALUE_NUMBER )
+                    m_pLua->writeVariable(std::string(command.name), double(command.numberValue));
+                else if( command.valueType == LuaCommand::VALUE_BOOL )
+                    m_pLua->writeVariable(std::string(command.name), bool(command.boolValue));
+                else
+                    m_pLua->writeVariable(std::string(command.name), std::string(command.stringValue));
+                break;
+
+            case LuaCommand::CMD_SET_MEMORY_LIMIT:
+            case LuaCommand::CMD_SET_GC_PAUSE:
+            case LuaCommand::CMD_SET_GC_STEP_MULTIPLIER:
+            case LuaCommand::CMD_SET_GENERATIONAL_GC:
+            case LuaCommand::CMD_SET_PROFILING:
+                _ApplySetting(command);
+                break;
+
+            case LuaCommand::CMD_CALL_FUNCTION:
+                try
+                {
+                    m_pLua->callLuaFunction<void>(std::string(command.name));
+                }
+                catch( std::exception & e )
+                {
+                    LUAENV_ERROR("LuaEnvironment::_ProcessCommands(): ERROR: Calling %s failed: %s", LuaLogArgs() << command.name << e.what());
+                    if( _GetMetrics() != NULL )
+                        _GetMetrics()->RecordError();
+                }
                 break;
 
             default:
                 break;
         }
+    }
 
-        // Sleep in this thread for programmed time ONLY if threading is enabled:
-        if( m_bThreadingEnabled )
+    if( m_pCommandRing->IsTerminateRequested() )
+        m_bTerminateThreadProcess = true;
+}
+
+void LuaEnvironment::_WaitForCommand()
+{
+    // Wait on the wakeup condition until a command is sent or an event is signaled.  Only the REPEAT
+    // interval and script instances in wait() need a timeout; an idle thread never wakes on its own:
+    boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+    boost::system_time wakeTime;
+
+    if( _GetNextWakeTime(wakeTime) )
+    {
+        while( !_IsCommandPending() )
+            if( !m_p_wakeup_condition->timed_wait(lock, wakeTime) )
+                break;
+    }
+    else
+    {
+        while( !_IsCommandPending() )
+            m_p_wakeup_condition->wait(lock);
+    }
+
+    // Picking up the commands and events sent since we last did:
+    if( m_bWakeupPending )
+    {
+        boost::posix_time::time_duration const queueWait = boost::get_system_time() - m_WakeupSignalTime;
+        m_bWakeupPending = false;
+        lock.unlock();
+        _RecordQueueWait(queueWait);
+    }
+}
+
+void LuaEnvironment::_RequestScheduledSlice()
+{
+    bool bQueueSlice = false;
+
+    {
+        boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+        // Only one slice may be queued or running at a time; a running slice re-checks for commands when it ends:
+        if( (!m_bSchedulerDetached) && (!m_bSliceRunning) && (!m_bSliceQueued) )
         {
-            std::cout << "LuaEnvironment::ThreadProcess(): Thread Process going to sleep..." << std::endl;
-            boost::this_thread::sleep(boost::posix_time::milliseconds(m_SleepIntervalMilliSeconds));
-            std::cout << "LuaEnvironment::ThreadProcess(): Thread Process has reawakened!" << std::endl;
+            m_bSliceQueued = true;
+            m_SliceQueuedTime = boost::get_system_time();
+            bQueueSlice = true;
         }
     }
-    std::cout << m_ThreadName.c_str() << " FINISHED!" << std::endl;
 
-    m_bThreadProcessActive = false;
+    if( bQueueSlice )
+        m_pScheduler->Schedule(shared_from_this());
 }
 
-int32 LuaEnvironment::_Owner_LogMessage(std::string logMessage)
+LuaThreadMetrics * LuaEnvironment::_GetMetrics()
 {
-    return m_pMyLuaThread->Script_LogMessage(logMessage, m_MyScriptAccessCode);
+    return ((m_pMyLuaThread != NULL) ? m_pMyLuaThread->GetMetrics() : NULL);
+}
+
+void LuaEnvironment::_RecordQueueWait(boost::posix_time::time_duration queueWait)
+{
+    LuaThreadMetrics * pMetrics = _GetMetrics();
+    if( (pMetrics != NULL) && !(queueWait.is_negative()) )
+        pMetrics->RecordQueueWait(queueWait.total_microseconds());
+}
+
+bool LuaEnvironment::_IsLogged(LuaLogLevels level)
+{
+    if( m_pMyLuaThread == NULL )
+        return (level >= LUALOG_WARNING);
+    return (level >= m_pMyLuaThread->GetLogLevel());
+}
+
+int32 LuaEnvironment::_Owner_LogMessage(LuaLogLevels level, const char * format, const LuaLogArgs & args)
+{
+    if( m_pMyLuaThread != NULL )
+        return m_pMyLuaThread->Script_LogMessage(level, format, args, m_MyScriptAccessCode);
+
+    // Without an owner there is no log to write to:
+    std::string logMessage = "LuaEnvironment (" + m_ThreadName + "): ";
+    logMessage += LuaLogWriter::GetLevelTag(level);
+    LuaLogArgs::Render(format, args.GetPacked().data(), args.GetPacked().size(), logMessage);
+    std::cout << logMessage.c_str() << std::endl;
+    return 0;
 }
 
-int32 LuaEnvironment::_Owner_ScriptCompleteNotify()
+int32 LuaEnvironment::_Owner_ScriptCompleteNotify(uint32 durationMicroSeconds, std::string errorMessage)
 {
-    return m_pMyLuaThread->Script_ExecutionComplete(m_MyScriptAccessCode);
+    return m_pMyLuaThread->Script_ExecutionComplete(m_MyScriptAccessCode, durationMicroSeconds, errorMessage);
 }
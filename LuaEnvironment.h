@@ -1,12 +1,21 @@
 
 #include <stdio.h>
 #include <string>
+#include <fstream>
+#include <list>
+#include <vector>
+#include <time.h>
 #include "EVEmu_Types.h"
-#include "luawrapper\LuaContext.h"
-#include "..\common\boost\boost\thread\thread.hpp"
-#include "..\common\boost\boost\thread\mutex.hpp"
-#include "..\common\boost\boost\thread\locks.hpp"
-#include "..\common\boost\boost\type_traits.hpp"
+#include "luawrapper/LuaContext.h"
+#include "LuaCommandRing.h"
+#include "LuaLogWriter.h"
+#include "../common/boost/boost/thread/thread.hpp"
+#include "../common/boost/boost/thread/mutex.hpp"
+#include "../common/boost/boost/thread/locks.hpp"
+#include "../common/boost/boost/thread/condition_variable.hpp"
+#include "../common/boost/boost/type_traits.hpp"
+#include "../common/boost/boost/enable_shared_from_this.hpp"
+#include "../common/boost/boost/shared_ptr.hpp"
 
 #pragma once
 #include "LuaThread.h"
@@ -24,8 +33,20 @@
 // 3) Call LuaEnvironment::SetScriptAccessCode(0,x) where 'x' is your customized Access Code,
 //    like a password, ensuring only the owner object will have control over this LuaEnvironment object instance.
 // 4) Call LuaEnvironment::SetSleepInterval() passing in the number of milliseconds that the LuaEnvironment
-//    object instance's _ThreadProcess() function's loop will go inactive (sleep) between each attempt to
-//    execute the assigned lua script.
+//    object instance's _ThreadProcess() function's loop will wait between each execution of the assigned
+//    lua script while in REPEAT mode.  Outside of REPEAT mode the loop does not wake up on a timer at all,
+//    it blocks until one of the Run/Repeat/Stop/Terminate commands is signaled.
+//    Optionally, call LuaEnvironment::SetContextPool() to take the lua interpreter from a LuaContextPool instead
+//    of creating a new one (see LuaContextPool.h).
+//    Optionally, call LuaEnvironment::SetBytecodeCachePath() to change where precompiled scripts are kept
+//    (see the note on the bytecode cache below).
+//    Optionally, call LuaEnvironment::SetMemoryLimit() to limit the memory the lua interpreter may use
+//    (see the note on the memory limit below).
+//    Optionally, call LuaEnvironment::SetGarbageCollectorTuning(), SetGenerationalGarbageCollection() and
+//    SetIdleGarbageCollection() to change when and how the garbage collector runs (see the note on garbage
+//    collection below).
+//    Optionally, call LuaEnvironment::SetProfiling() to sample what the script spends its time on (see the note on
+//    profiling below).
 // 5) Call LuaEnvironment::InitializeLuaEnvironment() to initialize critical objects that cannot be initialized
 //    during the LuaEnvironment class constructor.
 // 6) You may now make the call to LuaEnvironment::ExecuteScript() passing in the scriptName and the new Access code
@@ -34,6 +55,57 @@
 //     to be used ONLY where LuaEnvironment is used inside its OWN thread.  Where no threading is required,
 //     use ExecuteScript() instead.
 //
+// Every run of the script is loaded into its own coroutine (a "script instance") of the single lua_State.
+// A script may hand control back to the LuaEnvironment by calling wait(milliSeconds) or waitEvent(eventName),
+// and it is resumed once the time has passed or SignalScriptEvent() is called with the same event name.  While
+// a script instance is suspended, the thread running the LuaEnvironment is free to do other work.
+//
+// The script is compiled once and the compiled chunk is re-used by every run until the script file is modified.
+// Compiled scripts are also written as luac bytecode files to a cache directory, which by default is "luac_cache"
+// next to the script directory (eg. "./evemu/luac_cache" for "./evemu/scripts").  The bytecode files are named after
+// a hash of the script source, so every LuaEnvironment running the same script shares one file, and loading it
+// skips parsing the script entirely.  Call SetBytecodeCachePath("") to disable the cache.
+//
+// Many LuaEnvironments often run the same script.  The first one to compile it makes a shared copy of the compiled
+// script (see LuaContext::shareChunk()), and every LuaEnvironment running the same version of the same script file
+// then loads that copy instead: the instructions and line numbers of its functions, which make up most of a compiled
+// script, exist only once in the process, and each lua_State only allocates the constants and debug names.  This does
+// not depend on the bytecode cache, and a modified script is compiled and shared again like the first time.
+//
+// Every allocation of the lua interpreter is counted by its LuaContext.  When a memory limit is set, a script going
+// over it gets a "not enough memory" error instead of growing until the whole process runs out of memory, and the
+// script instance ends with that error like with any other.  The memory in use, the highest memory use and the number
+// of garbage collection cycles can be read at any time with GetLua()->getMemoryStatistics().
+//
+// Lua's incremental garbage collector normally does its work in small steps while the script runs, so a script
+// tick may take longer whenever it allocates.  SetGarbageCollectorTuning() sets the pause and step multiplier of the
+// collector for this LuaEnvironment only (see collectgarbage("setpause") and collectgarbage("setstepmul") in the lua
+// manual).  SetIdleGarbageCollection() moves the collection out of the script ticks altogether: the collector is
+// stopped while the script runs, and is run for at most the given number of microseconds at a time while the
+// LuaEnvironment has nothing else to do, until a full cycle has completed.  Whoever runs the LuaEnvironment provides
+// the idle time: its own thread before going to sleep, a LuaScheduler worker that finds no slice ready to run, or,
+// without threading, the owner calling RunIdleGarbageCollection().  Should the idle time not be enough to keep up
+// with the script, the collector is restarted during the ticks until the next cycle completes.
+//
+// Scripts run every tick tend to create lots of tables and strings that are garbage by the next tick, while the bulk
+// of the memory (the script's own state) lives on.  SetGenerationalGarbageCollection(true) switches the collector to
+// its generational mode (collectgarbage("generational") in the script does the same): objects surviving a collection
+// become old and are no longer traversed nor swept by the following minor collections, which only reclaim the objects
+// created since, strings excepted: those wait for the next full collection.  The old objects are collected by a full
+// collection once the memory in use has grown by LUAI_GCMAJOR percent (see luaconf.h).  In that mode the pause is how much the
+// young objects may add to the memory in use before the next minor collection, with a floor of 64KB so that a pause
+// of 100 or less does not collect at every allocation, and since the old objects are kept longer, the memory in use
+// is usually higher than with the incremental collector.  Minor collections are done in steps like incremental cycles,
+// so SetIdleGarbageCollection() keeps to its budget, except for the step starting a full collection, which does it all.
+//
+// SetProfiling() with a number of virtual machine instructions starts the LuaContext's sampling profiler, which may be
+// done at any time, even while the script runs, and SetProfiling(0) stops it.  Every that many instructions the call
+// stack of the script instance running is recorded, from the main chunk down to the line being run.  The samples add
+// up, until the interpreter is released, into a flat profile of the functions and lines the script spent its time in,
+// and into the collapsed stacks flame graph tools read, see LuaContext::Profile and LuaThread::WriteProfile().  A sample
+// costs about as much as running a hundred instructions, so at an interval of LUATHREAD_PROFILER_INTERVAL instructions
+// the script runs a couple of percent slower.
+//
 //
 // LuaEnvironment existing in its OWN thread:
 // ------------------------------------------
@@ -43,12 +115,64 @@
 //              'this' is the pointer to the owning LuaThread object instance
 // 2) 
 //
+//
+// LuaEnvironment run by a LuaScheduler worker pool:
+// -------------------------------------------------
+// 1) Create the LuaEnvironment object on the heap, owned by a boost::shared_ptr, and perform steps 2) through 5)
+//    from the first use case above.
+// 2) Call LuaEnvironment::ScheduleScript() passing in the LuaScheduler, the scriptName and the Access code.
+//    Instead of _ThreadProcess() looping in a thread of its own, every command sent to the LuaEnvironment queues
+//    it on the scheduler, and one pass of the state machine is run by a worker thread via RunScheduledSlice().
+// 3) Before the owner releases its boost::shared_ptr, call LuaEnvironment::DetachScheduler() to make sure no
+//    worker thread is running or will run the LuaEnvironment again.
+//
+//
+// Diagnostics:
+// ------------
+// The LuaEnvironment writes its diagnostics to the owning LuaThread's log through the LUAENV_TRACE() to LUAENV_ERROR()
+// macros below.  Those below LUALOG_MIN_LEVEL (see LuaLogWriter.h) are compiled out, which by default leaves the trace
+// and debug messages out of release builds, and those below the level given to LuaThread::SetLogLevel() are skipped
+// before their arguments are packed.  A LuaEnvironment without an owner prints its warnings and errors to the console.
+//
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 class LuaThread;
+class LuaScheduler;
+class LuaContextPool;
+class LuaThreadMetrics;
 
-class LuaEnvironment
+// How long sending a command to a LuaEnvironment whose command ring is full waits for the ring to drain, in milliseconds,
+// before the command is dropped and the Queue/Run/Stop call returns 0:
+#define LUAENV_COMMAND_SEND_TIMEOUT         100
+
+// Diagnostics of LuaEnvironment member functions; 'format' MUST be a string literal and 'args' a LuaLogArgs,
+// eg. LUAENV_DEBUG("Scheduling Script '%s'...", LuaLogArgs() << scriptName):
+#define LUAENV_LOG(level, format, args)     do { if( _IsLogged(level) ) _Owner_LogMessage(level, format, args); } while( 0 )
+
+#if LUALOG_MIN_LEVEL <= LUALOG_LEVEL_TRACE
+#define LUAENV_TRACE(format, args)          LUAENV_LOG(LUALOG_TRACE, format, args)
+#else
+#define LUAENV_TRACE(format, args)          do { } while( 0 )
+#endif
+#if LUALOG_MIN_LEVEL <= LUALOG_LEVEL_DEBUG
+#define LUAENV_DEBUG(format, args)          LUAENV_LOG(LUALOG_DEBUG, format, args)
+#else
+#define LUAENV_DEBUG(format, args)          do { } while( 0 )
+#endif
+#if LUALOG_MIN_LEVEL <= LUALOG_LEVEL_INFO
+#define LUAENV_INFO(format, args)           LUAENV_LOG(LUALOG_INFO, format, args)
+#else
+#define LUAENV_INFO(format, args)           do { } while( 0 )
+#endif
+#if LUALOG_MIN_LEVEL <= LUALOG_LEVEL_WARNING
+#define LUAENV_WARNING(format, args)        LUAENV_LOG(LUALOG_WARNING, format, args)
+#else
+#define LUAENV_WARNING(format, args)        do { } while( 0 )
+#endif
+#define LUAENV_ERROR(format, args)          LUAENV_LOG(LUALOG_ERROR, format, args)
+
+class LuaEnvironment : public boost::enable_shared_from_this<LuaEnvironment>
 {
     public:
         LuaEnvironment(std::string threadName, std::string scriptPath, bool bThreadingEnabled);
@@ -60,7 +184,14 @@ class LuaEnvironment
         void SetThreadOwner(LuaThread * pMyLuaThread);
         void SetScriptAccessCode(uint32 currentAccessCode, uint32 accessCode = 0xFFFFFFFF);
         int32 InitializeLuaEnvironment();
+		int32 SetContextPool(LuaContextPool * pContextPool);        // Call BEFORE InitializeLuaEnvironment(), see LuaContextPool.h
 		int32 SetSleepInterval(uint32 sleepIntervalMilliSeconds);
+		int32 SetBytecodeCachePath(std::string cachePath);
+		int32 SetMemoryLimit(uint32 maxBytes);     // 0 means no limit, which is the default
+		int32 SetGarbageCollectorTuning(int pausePercent = LUAI_GCPAUSE, int stepMultiplierPercent = LUAI_GCMUL);
+		int32 SetGenerationalGarbageCollection(bool bEnabled);         // false (incremental) is the default
+		int32 SetIdleGarbageCollection(uint32 budgetMicroSeconds);     // 0 collects while the script runs, which is the default
+		int32 SetProfiling(uint32 instructionsPerSample);              // 0 stops the profiler, which is the default
 		void KillThread();
 
 		// Thread Operations:
@@ -68,6 +199,31 @@ class LuaEnvironment
         int32 RunScriptProcess(uint32 accessCode = 0, bool repeat = false);
         int32 StopScriptProcess(uint32 accessCode = 0);
         int32 TerminateThread(uint32 accessCode = 0);
+        int32 SignalScriptEvent(std::string eventName, uint32 accessCode = 0);
+        int32 QueueSetDouble(std::string varName, double doubleVal, uint32 accessCode = 0);
+        int32 QueueSetBool(std::string varName, bool boolVal, uint32 accessCode = 0);
+        int32 QueueSetString(std::string varName, std::string strVal, uint32 accessCode = 0);
+        int32 QueueCallFunction(std::string functionName, uint32 accessCode = 0);
+
+        // Scheduler Operations:
+        enum SliceResult
+        {
+            SLICE_IDLE,         // Nothing to do until the next command arrives
+            SLICE_REQUEUE,      // Another command arrived while the slice ran, run another slice right away
+            SLICE_WAIT,         // Run another slice at the returned wake time (REPEAT state interval)
+            SLICE_FINISHED      // The thread process has terminated
+        };
+
+        int32 ScheduleScript(LuaScheduler * pScheduler, std::string scriptName, uint32 accessCode = 0);
+        SliceResult RunScheduledSlice(boost::system_time & wakeTime);
+        void ScheduledWakeup() { _SignalWakeup(); }
+        void DetachScheduler();
+
+        // Garbage Collection in Idle Time:
+        // (RunIdleGarbageCollection() collects for one budget, it returns true if the current collection cycle is not
+        // complete yet and it should be called again, false once it is or when the LuaEnvironment is busy or detached)
+        bool HasIdleGarbageCollection() { return (m_IdleGCBudgetMicroSeconds != 0); }
+        bool RunIdleGarbageCollection();
 
         // Ideally access to the m_pLua member would be protected or private, however,
         // since it is only exposed to the layer above (LuaThread) and no further, its
@@ -76,74 +232,74 @@ class LuaEnvironment
         // Perhaps this will be done at some other time, but for now, it is exposed as public.
         Lua::LuaContext * GetLua() { return m_pLua; }
 
+        // Defines the functions every script may call (wait() and waitEvent()) in a new interpreter, which is done
+        // by InitializeLuaEnvironment() or, for interpreters kept in a LuaContextPool, once when the pool creates them:
+        static void PrepareLuaContext(Lua::LuaContext * pLua);
+
 protected:
         int32 _CheckInitializedState();
 		void _ThreadProcess();
 
-        // Mutex-protected Flag Modifier Functions:
-        bool _GetTerminateThreadFlag() { return m_bTerminateThreadFlag; };
-		uint32 _SetTerminateThreadFlag()
-		{
-			boost::mutex::scoped_lock lock(*m_p_terminate_mutex);
-			m_bTerminateThreadFlag = true;
-			return 1;
-		}
-
-		uint32 _ClearTerminateThreadFlag()
-		{
-			boost::mutex::scoped_lock lock(*m_p_terminate_mutex);
-			m_bTerminateThreadFlag = false;
-			return 1;
-		}
-
-        bool _GetRepeatScriptRunsFlag() { return m_bRepeatScriptRunsFlag; };
-		uint32 _SetRepeatScriptRunsFlag()
-		{
-			boost::mutex::scoped_lock lock(*m_p_repeat_mutex);
-			m_bRepeatScriptRunsFlag = true;
-			return 1;
-		}
-
-		uint32 _ClearRepeatScriptRunsFlag()
-		{
-			boost::mutex::scoped_lock lock(*m_p_repeat_mutex);
-			m_bRepeatScriptRunsFlag = false;
-			return 1;
-		}
-
-        bool _GetExecuteScriptFlag() { return m_bExecuteScriptFlag; };
-		uint32 _SetExecuteScriptFlag()
-		{
-			boost::mutex::scoped_lock lock(*m_p_execute_mutex);
-			m_bExecuteScriptFlag = true;
-			return 1;
-		}
-
-		uint32 _ClearExecuteScriptFlag()
-		{
-			boost::mutex::scoped_lock lock(*m_p_execute_mutex);
-			m_bExecuteScriptFlag = false;
-			return 1;
-		}
-
-        bool _GetStopScriptRunsFlag() { return m_bStopScriptRunsFlag; };
-		uint32 _SetStopScriptRunsFlag()
-		{
-			boost::mutex::scoped_lock lock(*m_p_stop_mutex);
-			m_bStopScriptRunsFlag = true;
-			return 1;
-		}
-
-		uint32 _ClearStopScriptRunsFlag()
-		{
-			boost::mutex::scoped_lock lock(*m_p_stop_mutex);
-			m_bStopScriptRunsFlag = false;
-			return 1;
-		}
+        void _StartThreadProcess();
+        void _ProcessScriptState();
+        void _StopThreadProcess();
+
+        // Wakes up _ThreadProcess() when it is blocked waiting for a command.  The wakeup mutex is
+        // taken before notifying so that a command sent between _ThreadProcess() checking the ring and
+        // going to wait on the condition can never be missed.  When run by a LuaScheduler, the
+        // LuaEnvironment is queued for its next slice instead:
+        void _SignalWakeup()
+        {
+            if( m_pScheduler != NULL )
+            {
+                _RequestScheduledSlice();
+                return;
+            }
+
+            {
+                boost::mutex::scoped_lock lock(*m_p_wakeup_mutex);
+                if( m_bThreadingEnabled && !m_bWakeupPending )
+                {
+                    m_bWakeupPending = true;
+                    m_WakeupSignalTime = boost::get_system_time();
+                }
+            }
+            m_p_wakeup_condition->notify_all();
+        }
+
+        void _RequestScheduledSlice();
+        LuaThreadMetrics * _GetMetrics();
+        void _RecordQueueWait(boost::posix_time::time_duration queueWait);
+
+        bool _IsCommandPending();
+        void _WaitForCommand();
+        bool _GetNextWakeTime(boost::system_time & wakeTime);
+
+        // Garbage Collection in Idle Time:
+        bool _StepIdleGarbageCollector();
+        void _CollectGarbageUntilCommand();
+        void _CheckIdleGarbageCollectorBacklog();
+
+        // Script Instance Management:
+        int32 _UpdateScriptChunk();             // 1 when m_ScriptChunk can run, 0 when it failed to compile, -1 when the file can't be opened
+        void _ReleaseSharedScriptChunk();
+        int _LoadCachedBytecode(const std::string & cacheFile);
+        void _StoreCachedBytecode(const std::string & cacheFile, int chunk);
+        int32 _CreateScriptInstance();
+        void _ResumeScriptInstances();
+        void _DestroyScriptInstances();
+
+        // Sends a command to the thread process through the command ring and wakes it up:
+        int32 _SendCommand(const LuaCommand & command);
+        void _RequestTerminate();
+        int32 _ChangeSetting(const LuaCommand & command);
+        void _ApplySetting(const LuaCommand & command);
+        void _ProcessCommands(bool & bRepeatDue);
 
         // Remote Methods - Accessed via pointer to LuaThread object:
-        int32 _Owner_LogMessage(std::string logMessage);
-        int32 _Owner_ScriptCompleteNotify();
+        bool _IsLogged(LuaLogLevels level);
+        int32 _Owner_LogMessage(LuaLogLevels level, const char * format, const LuaLogArgs & args);     // Use the LUAENV_...() macros
+        int32 _Owner_ScriptCompleteNotify(uint32 durationMicroSeconds, std::string errorMessage);
 
         enum ScriptStates
         {
@@ -152,6 +308,16 @@ protected:
             STATE_REPEAT
         };
 
+        // A coroutine running one run of the script, see LuaContext::createCoroutine():
+        struct ScriptInstance
+        {
+            int coroutine;
+            boost::system_time startTime;   // When the run was started, for the completion notification
+            bool bWaitingForTime;           // Suspended in wait() until wakeTime
+            boost::system_time wakeTime;
+            std::string waitEventName;      // Suspended in waitEvent() until this event is signaled, empty otherwise
+        };
+
         bool m_bThreadingEnabled;
         ScriptStates m_ScriptState;
         bool m_bTerminateThreadProcess;
@@ -163,19 +329,52 @@ protected:
 		uint32 m_SleepIntervalMilliSeconds;
         bool m_bThreadProcessActive;
         Lua::LuaContext * m_pLua;
+        LuaContextPool * m_pContextPool;        // Where m_pLua comes from and goes back to, NULL when not pooled
+        int m_ScriptChunk;                      // Script compiled once by LuaContext::loadChunk(), LUA_NOREF when not loaded
+        time_t m_ScriptChunkModifiedTime;       // Modification time of the script file when m_ScriptChunk was compiled
+        std::string m_SharedScriptChunkKey;     // Shared compiled script m_ScriptChunk was loaded from, empty if none
+        std::string m_BytecodeCachePath;        // Directory of the shared luac bytecode cache, empty when disabled
+        uint32 m_MemoryLimitBytes;              // Given to the LuaContext when it is created, 0 when unlimited
+        int m_GCPausePercent;                   // Given to the LuaContext when it is created
+        int m_GCStepMultiplierPercent;
+        bool m_bGenerationalGC;
+        uint32 m_ProfilerInstructionsPerSample; // Same, 0 when not profiling
+
+        // Garbage collection in idle time, only used by the thread running the LuaEnvironment:
+        uint32 m_IdleGCBudgetMicroSeconds;      // 0 when the garbage is collected while the script runs
+        bool m_bIdleGCBacklog;                  // The collector was restarted since the idle time did not keep up
+        size_t m_IdleGCBaselineBytes;           // Memory in use when the last collection cycle completed
+
+        // Scheduler state, protected by m_p_wakeup_mutex:
+        LuaScheduler * m_pScheduler;
+        bool m_bSliceQueued;
+        bool m_bSliceRunning;
+        bool m_bSchedulerDetached;
+        bool m_bIdleGCRunning;                  // RunIdleGarbageCollection() is running on a worker thread
+        boost::system_time m_NextRepeatTime;
+        boost::system_time m_SliceQueuedTime;   // When the slice now queued or running was queued
+
+        // In the LuaScheduler's idle queue, and in its timed queue to be woken at m_TimedWakeTime; only touched by the
+        // LuaScheduler under its own scheduler_mutex:
+        friend class LuaScheduler;
+        bool m_bIdleQueued;
+        bool m_bTimedQueued;
+        boost::system_time m_TimedWakeTime;
+
+        // Commands and events not picked up yet by our own thread, protected by m_p_wakeup_mutex:
+        bool m_bWakeupPending;
+        boost::system_time m_WakeupSignalTime;  // When the first of them was sent
+
+        std::list<ScriptInstance> m_ScriptInstances;
+        std::vector<std::string> m_PendingEvents;       // Protected by m_p_wakeup_mutex
+
+		// Commands sent by the owning LuaThread, see LuaCommandRing.h.  These are shared with the copy of this object
+		// made for boost::thread, and freed with the last copy:
+		boost::shared_ptr<LuaCommandRing> m_pCommandRing;
 
-		// Thread Mutexes and Mutex-protected Flags:
-		boost::mutex * m_p_terminate_mutex;
-		boost::mutex * m_p_repeat_mutex;
-		boost::mutex * m_p_execute_mutex;
-		boost::mutex * m_p_stop_mutex;
-
-		// DO NOT Modify these directly, use their modifier functions even inside this class!
-        // DO NOT Reference these directly either, use their Get() functions even inside this class!
-		bool m_bTerminateThreadFlag;
-		bool m_bRepeatScriptRunsFlag;
-		bool m_bExecuteScriptFlag;
-		bool m_bStopScriptRunsFlag;
+		// Thread Mutexes:
+		boost::shared_ptr<boost::mutex> m_p_wakeup_mutex;
+		boost::shared_ptr<boost::condition_variable> m_p_wakeup_condition;
 
     private:
         bool m_bInitialized;
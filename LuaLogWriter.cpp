@@ -0,0 +1,676 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <iostream>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+#include "LuaLogWriter.h"
+#include "../common/boost/boost/bind.hpp"
+#include "../common/boost/boost/date_time/c_local_time_adjustor.hpp"
+
+// Lines handed to one writev() call, each line taking three iovecs (time stamp, text and newline), which keeps
+// well below the IOV_MAX of 1024 found on every POSIX system:
+#define LOG_MAX_LINES_PER_WRITE     256
+
+// Bytes of binary records gathered before they are written out:
+#define LOG_MAX_BINARY_BYTES        65536
+
+static const char g_LogLineEnd = '\n';
+
+// Appends little endian numbers to a binary log record:
+static void PutUInt32(std::string & bytes, uint32 value)
+{
+    for( uint32 i = 0; i < 4; i++ )
+        bytes += char((value >> (8 * i)) & 0xFF);
+}
+
+static void PutUInt64(std::string & bytes, boost::uint64_t value)
+{
+    for( uint32 i = 0; i < 8; i++ )
+        bytes += char((value >> (8 * i)) & 0xFF);
+}
+
+static boost::uint64_t GetUInt64(const char * bytes)
+{
+    boost::uint64_t value = 0;
+    for( uint32 i = 0; i < 8; i++ )
+        value |= boost::uint64_t((unsigned char)bytes[i]) << (8 * i);
+    return value;
+}
+
+static uint32 GetUInt32(const char * bytes)
+{
+    uint32 value = 0;
+    for( uint32 i = 0; i < 4; i++ )
+        value |= uint32((unsigned char)bytes[i]) << (8 * i);
+    return value;
+}
+
+// Writes all the bytes, carrying on after partial writes:
+static void WriteBytes(int fileHandle, const char * bytes, size_t size)
+{
+    while( size > 0 )
+    {
+#ifdef _WIN32
+        int written = _write(fileHandle, bytes, (unsigned int)size);
+#else
+        ssize_t written = write(fileHandle, bytes, size);
+        if( (written < 0) && (errno == EINTR) )
+            continue;
+#endif
+        if( written <= 0 )
+            return;     // The bytes are lost, as they were when fputs() failed on a full disk
+        bytes += written;
+        size -= size_t(written);
+    }
+}
+
+#ifndef _WIN32
+// Writes all the vectors, carrying on after partial writes:
+static void WriteVectors(int fileHandle, struct iovec * vectors, int count)
+{
+    while( count > 0 )
+    {
+        ssize_t written = writev(fileHandle, vectors, count);
+        if( written < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            return;     // The lines are lost, as they were when fputs() failed on a full disk
+        }
+
+        while( (count > 0) && (size_t(written) >= vectors->iov_len) )
+        {
+            written -= vectors->iov_len;
+            vectors++;
+            count--;
+        }
+        if( count > 0 )
+        {
+            vectors->iov_base = (char *)vectors->iov_base + written;
+            vectors->iov_len -= written;
+        }
+    }
+}
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// LuaLogArgs:
+
+LuaLogArgs & LuaLogArgs::operator<<(double value)
+{
+    boost::uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    m_Packed += 'n';
+    PutUInt64(m_Packed, bits);
+    m_Count++;
+    return *this;
+}
+
+LuaLogArgs & LuaLogArgs::operator<<(const std::string & value)
+{
+    _PackString(value.data(), value.size());
+    return *this;
+}
+
+LuaLogArgs & LuaLogArgs::operator<<(const char * value)
+{
+    if( value == NULL )
+        value = "(null)";
+    _PackString(value, strlen(value));
+    return *this;
+}
+
+bool LuaLogArgs::Render(const char * format, const char * packed, size_t packedSize, std::string & text)
+{
+    size_t position = 0;
+    for( const char * pFormat = format; *pFormat != '\0'; pFormat++ )
+    {
+        if( (pFormat[0] != '%') || ((pFormat[1] != 's') && (pFormat[1] != '%')) )
+        {
+            text += *pFormat;
+            continue;
+        }
+
+        pFormat++;
+        if( *pFormat == '%' )
+            text += '%';
+        else if( position >= packedSize )
+            continue;       // More "%s" than arguments, which leaves them out
+        else if( packed[position] == 'n' )
+        {
+            if( (packedSize - position) < 9 )
+                return false;
+            boost::uint64_t bits = GetUInt64(packed + position + 1);
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            char number[32];
+            sprintf(number, "%.14g", value);
+            text += number;
+            position += 9;
+        }
+        else if( packed[position] == 's' )
+        {
+            if( (packedSize - position) < 5 )
+                return false;
+            uint32 length = GetUInt32(packed + position + 1);
+            if( (packedSize - position - 5) < length )
+                return false;
+            text.append(packed + position + 5, length);
+            position += 5 + length;
+        }
+        else
+            return false;
+    }
+
+    return true;
+}
+
+void LuaLogArgs::_PackString(const char * value, size_t length)
+{
+    m_Packed += 's';
+    PutUInt32(m_Packed, uint32(length));
+    m_Packed.append(value, length);
+    m_Count++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// LuaLogWriter:
+
+LuaLogWriter::LuaLogWriter(uint32 flushIntervalMilliSeconds, uint32 flushBatchSize, LuaLogFormats logFormat)
+{
+    m_pRecords = new Record[RING_SIZE];
+    for( uint32 i = 0; i < RING_SIZE; i++ )
+        m_pRecords[i].sequence.store(i);        // Slot i is free for the write index i
+    m_ReadIndex.store(0);
+    m_WriteIndex.store(0);
+    m_NextLogId.store(LUALOGWRITER_INVALID_LOG + 1);
+    m_BlockedProducers.store(0);
+
+    m_FlushIntervalMilliSeconds = flushIntervalMilliSeconds;
+    m_FlushBatchSize = flushBatchSize;
+    if( m_FlushBatchSize == 0 )
+        m_FlushBatchSize = 1;
+    if( m_FlushBatchSize > RING_SIZE / 2 )
+        m_FlushBatchSize = RING_SIZE / 2;       // Wake the writer while there is still room left in the ring
+    m_LogFormat = logFormat;
+    m_pThread = NULL;
+    m_bShutdown = false;
+}
+
+LuaLogWriter::~LuaLogWriter()
+{
+    Shutdown();
+
+    // In case the writer was never started, write out and close whatever was queued:
+    _TakeRecords();
+    _CloseLogFiles();
+
+    delete [] m_pRecords;
+}
+
+int32 LuaLogWriter::Start()
+{
+    if( m_pThread != NULL )
+    {
+        std::cout << "LuaLogWriter::Start(): Writer already Started!  You cannot call this more than once!" << std::endl;
+        return 0;
+    }
+
+    m_bShutdown = false;
+    m_pThread = new boost::thread(boost::bind(&LuaLogWriter::_WriterProcess, this));
+
+    return 1;
+}
+
+void LuaLogWriter::Shutdown()
+{
+    if( m_pThread == NULL )
+        return;
+
+    {
+        boost::mutex::scoped_lock lock(writer_mutex);
+        m_bShutdown = true;
+    }
+    writer_condition.notify_all();
+
+    m_pThread->join();
+    delete m_pThread;
+    m_pThread = NULL;
+}
+
+uint32 LuaLogWriter::OpenLog(std::string logFileName, std::string threadName)
+{
+    // The file is opened here rather than by the writer thread, so that the caller learns whether it could be:
+#ifdef _WIN32
+    int fileMode = ((m_LogFormat == LUALOG_FORMAT_BINARY) ? _O_BINARY : _O_TEXT);
+    int fileHandle = _open(logFileName.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | fileMode, _S_IREAD | _S_IWRITE);
+#else
+    int fileHandle = open(logFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if( fileHandle < 0 )
+        return LUALOGWRITER_INVALID_LOG;
+
+    uint32 logId = m_NextLogId.fetch_add(1);
+    _Push(Record::RECORD_OPEN, logId, fileHandle, threadName);
+
+    return logId;
+}
+
+void LuaLogWriter::CloseLog(uint32 logId)
+{
+    if( logId == LUALOGWRITER_INVALID_LOG )
+        return;
+
+    std::string noText;
+    _Push(Record::RECORD_CLOSE, logId, -1, noText);
+}
+
+uint32 LuaLogWriter::InternScript(std::string scriptName)
+{
+    boost::mutex::scoped_lock lock(script_mutex);
+
+    std::map<std::string, uint32>::iterator script = m_ScriptIds.find(scriptName);
+    if( script != m_ScriptIds.end() )
+        return script->second;
+
+    // The name is queued while the lock is still held, so it is always taken from the ring before any message with its id:
+    uint32 scriptId = uint32(m_ScriptIds.size()) + 1;
+    m_ScriptIds[scriptName] = scriptId;
+    _Push(Record::RECORD_SCRIPT, LUALOGWRITER_INVALID_LOG, -1, scriptName, LUALOG_INFO, scriptId);
+
+    return scriptId;
+}
+
+void LuaLogWriter::Write(uint32 logId, std::string & logMessage)
+{
+    if( logId == LUALOGWRITER_INVALID_LOG )
+        return;
+
+    _Push(Record::RECORD_MESSAGE, logId, -1, logMessage);
+}
+
+void LuaLogWriter::Write(uint32 logId, LuaLogLevels level, uint32 scriptId, const char * format, const LuaLogArgs & args)
+{
+    if( logId == LUALOGWRITER_INVALID_LOG )
+        return;
+
+    std::string packed = args.GetPacked();
+    _Push(Record::RECORD_MESSAGE, logId, -1, packed, level, scriptId, format, args.GetCount());
+}
+
+void LuaLogWriter::FormatTimestamp(boost::system_time time, char * buffer)
+{
+    boost::posix_time::ptime localTime = boost::date_time::c_local_adjustor<boost::posix_time::ptime>::utc_to_local(time);
+    boost::gregorian::date date = localTime.date();
+    boost::posix_time::time_duration timeOfDay = localTime.time_of_day();
+
+    sprintf(buffer, "[%04d-%02d-%02d] [%02d:%02d:%02d.%03d] ", int(date.year()), int(date.month()), int(date.day()),
+        int(timeOfDay.hours()), int(timeOfDay.minutes()), int(timeOfDay.seconds()), int(timeOfDay.total_milliseconds() % 1000));
+}
+
+const char * LuaLogWriter::GetLevelTag(LuaLogLevels level)
+{
+    switch( level )
+    {
+        case LUALOG_TRACE:      return "[TRACE] ";
+        case LUALOG_DEBUG:      return "[DEBUG] ";
+        case LUALOG_WARNING:    return "[WARNING] ";
+        case LUALOG_ERROR:      return "[ERROR] ";
+        default:                return "";
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Protected and Private Member Functions:
+
+void LuaLogWriter::_Push(Record::RecordTypes type, uint32 logId, int fileHandle, std::string & text,
+    LuaLogLevels level, uint32 scriptId, const char * format, uint32 argCount)
+{
+    boost::system_time const now = boost::get_system_time();
+
+    // Claim the slot for the current write index, which is free once its sequence has caught up with the index:
+    uint32 writeIndex = m_WriteIndex.load(boost::memory_order_relaxed);
+    Record * pRecord;
+    while( true )
+    {
+        pRecord = &(m_pRecords[writeIndex % RING_SIZE]);
+        int32 difference = int32(pRecord->sequence.load(boost::memory_order_acquire) - writeIndex);
+        if( difference == 0 )
+        {
+            if( m_WriteIndex.compare_exchange_weak(writeIndex, writeIndex + 1, boost::memory_order_relaxed) )
+                break;
+        }
+        else if( difference < 0 )
+        {
+            // The ring is full, so sleep until the writer thread has taken the record still in this slot.  Counting
+            // this producer before looking at the slot again pairs with the writer reading the count after it has
+            // freed slots, so one of the two sees the other and the wakeup cannot be missed:
+            boost::mutex::scoped_lock lock(writer_mutex);
+            m_BlockedProducers.fetch_add(1);
+            writer_condition.notify_one();
+            if( int32(pRecord->sequence.load() - writeIndex) < 0 )
+                space_condition.wait(lock);
+            m_BlockedProducers.fetch_sub(1, boost::memory_order_relaxed);
+            writeIndex = m_WriteIndex.load(boost::memory_order_relaxed);
+        }
+        else
+            writeIndex = m_WriteIndex.load(boost::memory_order_relaxed);    // Another producer claimed it first
+    }
+
+    pRecord->type = type;
+    pRecord->logId = logId;
+    pRecord->fileHandle = fileHandle;
+    pRecord->time = now;
+    pRecord->level = level;
+    pRecord->scriptId = scriptId;
+    pRecord->format = format;
+    pRecord->argCount = argCount;
+    pRecord->text.swap(text);
+
+    // Release publishes the record written above before the writer thread can see the new sequence:
+    pRecord->sequence.store(writeIndex + 1, boost::memory_order_release);
+
+    // Wake the writer early once a batch is waiting.  The notify is not made under writer_mutex, so the writer may
+    // miss it if it was just about to wait, in which case the batch is written when the flush interval expires:
+    if( (writeIndex + 1 - m_ReadIndex.load(boost::memory_order_relaxed)) == m_FlushBatchSize )
+        writer_condition.notify_one();
+}
+
+bool LuaLogWriter::_Pop(Record & record)
+{
+    uint32 readIndex = m_ReadIndex.load(boost::memory_order_relaxed);
+    Record & slot = m_pRecords[readIndex % RING_SIZE];
+
+    // The slot may have been claimed by a producer that has not finished filling it in yet:
+    if( slot.sequence.load(boost::memory_order_acquire) != (readIndex + 1) )
+        return false;
+
+    record.type = slot.type;
+    record.logId = slot.logId;
+    record.fileHandle = slot.fileHandle;
+    record.time = slot.time;
+    record.level = slot.level;
+    record.scriptId = slot.scriptId;
+    record.format = slot.format;
+    record.argCount = slot.argCount;
+    record.text.swap(slot.text);
+    slot.text.clear();          // The next producer gets this string back from Write(), and was promised an empty one
+
+    // Hand the slot to the producer that will claim it on the next pass around the ring:
+    slot.sequence.store(readIndex + RING_SIZE, boost::memory_order_release);
+    m_ReadIndex.store(readIndex + 1, boost::memory_order_release);
+    return true;
+}
+
+void LuaLogWriter::_WriterProcess()
+{
+    while( true )
+    {
+        bool bShutdown;
+        {
+            // Sleep until a batch is waiting or the flush interval expires:
+            boost::mutex::scoped_lock lock(writer_mutex);
+            boost::system_time const flushTime = boost::get_system_time() + boost::posix_time::milliseconds(m_FlushIntervalMilliSeconds);
+            while( (!m_bShutdown) && ((m_WriteIndex.load(boost::memory_order_relaxed) - m_ReadIndex.load(boost::memory_order_relaxed)) < m_FlushBatchSize) )
+                if( !writer_condition.timed_wait(lock, flushTime) )
+                    break;
+            bShutdown = m_bShutdown;
+        }
+
+        _TakeRecords();
+
+        // Wake the producers that found the ring full, now that there is room again:
+        boost::atomic_thread_fence(boost::memory_order_seq_cst);
+        if( m_BlockedProducers.load(boost::memory_order_relaxed) != 0 )
+        {
+            boost::mutex::scoped_lock lock(writer_mutex);
+            space_condition.notify_all();
+        }
+
+        if( bShutdown )
+            break;
+    }
+
+    _CloseLogFiles();
+}
+
+void LuaLogWriter::_TakeRecords()
+{
+    std::vector<uint32> pendingLogs;
+    Record record;
+
+    while( _Pop(record) )
+    {
+        if( record.type == Record::RECORD_SCRIPT )
+        {
+            m_ScriptNames[record.scriptId].swap(record.text);
+            continue;
+        }
+
+        std::map<uint32, LogFile>::iterator logFile = m_LogFiles.find(record.logId);
+
+        switch( record.type )
+        {
+            case Record::RECORD_OPEN:
+                logFile = m_LogFiles.insert(std::make_pair(record.logId, LogFile())).first;
+                logFile->second.fileHandle = record.fileHandle;
+                logFile->second.pendingCount = 0;
+                if( m_LogFormat == LUALOG_FORMAT_BINARY )
+                {
+                    logFile->second.pendingBytes.assign(LUALOG_BINARY_MAGIC, LUALOG_BINARY_MAGIC_SIZE);
+                    logFile->second.pendingBytes += char(LUALOG_RECORD_THREAD);
+                    PutUInt32(logFile->second.pendingBytes, uint32(4 + record.text.size()));
+                    PutUInt32(logFile->second.pendingBytes, record.logId);
+                    logFile->second.pendingBytes += record.text;
+                    pendingLogs.push_back(record.logId);
+                }
+                break;
+
+            case Record::RECORD_MESSAGE:
+                if( logFile == m_LogFiles.end() )
+                    break;
+                if( (logFile->second.pendingCount == 0) && logFile->second.pendingBytes.empty() )
+                    pendingLogs.push_back(record.logId);
+
+                if( m_LogFormat == LUALOG_FORMAT_BINARY )
+                {
+                    _AddBinaryRecords(logFile->second, record);
+                    if( logFile->second.pendingBytes.size() >= LOG_MAX_BINARY_BYTES )
+                        _WriteLog(logFile->second);
+                }
+                else
+                {
+                    _AddTextLine(logFile->second, record);
+                    if( logFile->second.pendingCount == LOG_MAX_LINES_PER_WRITE )
+                        _WriteLog(logFile->second);
+                }
+                break;
+
+            case Record::RECORD_CLOSE:
+                if( logFile == m_LogFiles.end() )
+                    break;
+                _WriteLog(logFile->second);
+#ifdef _WIN32
+                _close(logFile->second.fileHandle);
+#else
+                close(logFile->second.fileHandle);
+#endif
+                m_LogFiles.erase(logFile);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    // Write out whatever is left over, a log closed above is simply not found any more:
+    for( uint32 i = 0; i < pendingLogs.size(); i++ )
+    {
+        std::map<uint32, LogFile>::iterator logFile = m_LogFiles.find(pendingLogs[i]);
+        if( logFile != m_LogFiles.end() )
+            _WriteLog(logFile->second);
+    }
+}
+
+void LuaLogWriter::_AddTextLine(LogFile & logFile, Record & record)
+{
+    if( logFile.pendingCount == logFile.pendingLines.size() )
+        logFile.pendingLines.push_back(PendingLine());
+    PendingLine & line = logFile.pendingLines[logFile.pendingCount++];
+
+    _FormatTimestamp(record.time, line.timestamp);
+
+    // A plain message is taken as it is, without copying it:
+    if( (record.format == NULL) && (record.level == LUALOG_INFO) )
+    {
+        line.text.swap(record.text);
+        return;
+    }
+
+    line.text = GetLevelTag(record.level);
+    if( record.format == NULL )
+        line.text += record.text;
+    else
+        LuaLogArgs::Render(record.format, record.text.data(), record.text.size(), line.text);
+}
+
+void LuaLogWriter::_AddBinaryRecords(LogFile & logFile, Record & record)
+{
+    std::string & bytes = logFile.pendingBytes;
+
+    // Format strings are told apart by their address, and written to each file the first time the file needs them:
+    uint32 formatId = LUALOG_TEXT_FORMAT_ID;
+    if( record.format != NULL )
+    {
+        std::map<const char *, uint32>::iterator format = m_FormatIds.find(record.format);
+        if( format == m_FormatIds.end() )
+            format = m_FormatIds.insert(std::make_pair(record.format, uint32(m_FormatIds.size()) + 1)).first;
+        formatId = format->second;
+
+        if( logFile.writtenFormats.insert(formatId).second )
+        {
+            size_t formatLength = strlen(record.format);
+            bytes += char(LUALOG_RECORD_FORMAT);
+            PutUInt32(bytes, uint32(4 + formatLength));
+            PutUInt32(bytes, formatId);
+            bytes.append(record.format, formatLength);
+        }
+    }
+
+    if( (record.scriptId != LUALOG_NO_SCRIPT_ID) && logFile.writtenScripts.insert(record.scriptId).second )
+    {
+        const std::string & scriptName = m_ScriptNames[record.scriptId];
+        bytes += char(LUALOG_RECORD_SCRIPT);
+        PutUInt32(bytes, uint32(4 + scriptName.size()));
+        PutUInt32(bytes, record.scriptId);
+        bytes += scriptName;
+    }
+
+    // A plain message is written as the only argument of the text format:
+    size_t argsSize = record.text.size();
+    if( record.format == NULL )
+        argsSize += 5;
+
+    boost::posix_time::ptime const epoch(boost::gregorian::date(1970, 1, 1));
+    bytes += char(LUALOG_RECORD_MESSAGE);
+    PutUInt32(bytes, uint32(8 + 4 + 4 + 1 + 4 + 1 + argsSize));
+    PutUInt64(bytes, boost::uint64_t((record.time - epoch).total_microseconds()));
+    PutUInt32(bytes, record.logId);
+    PutUInt32(bytes, record.scriptId);
+    bytes += char(record.level);
+    PutUInt32(bytes, formatId);
+    if( record.format == NULL )
+    {
+        bytes += char(1);
+        bytes += 's';
+        PutUInt32(bytes, uint32(record.text.size()));
+    }
+    else
+        bytes += char(record.argCount);
+    bytes += record.text;
+}
+
+void LuaLogWriter::_WriteLog(LogFile & logFile)
+{
+    if( !(logFile.pendingBytes.empty()) )
+    {
+        WriteBytes(logFile.fileHandle, logFile.pendingBytes.data(), logFile.pendingBytes.size());
+        logFile.pendingBytes.clear();
+    }
+
+    if( logFile.pendingCount == 0 )
+        return;
+
+#ifdef _WIN32
+    // Windows has no writev(), so gather the lines into one buffer and write that in one call instead:
+    std::string buffer;
+    for( uint32 i = 0; i < logFile.pendingCount; i++ )
+    {
+        buffer += logFile.pendingLines[i].timestamp;
+        buffer += logFile.pendingLines[i].text;
+        buffer += g_LogLineEnd;
+    }
+    WriteBytes(logFile.fileHandle, buffer.data(), buffer.size());
+#else
+    struct iovec vectors[LOG_MAX_LINES_PER_WRITE * 3];
+    int count = 0;
+    for( uint32 i = 0; i < logFile.pendingCount; i++ )
+    {
+        PendingLine & line = logFile.pendingLines[i];
+        vectors[count].iov_base = line.timestamp;
+        vectors[count].iov_len = strlen(line.timestamp);
+        vectors[count + 1].iov_base = (void *)line.text.data();
+        vectors[count + 1].iov_len = line.text.size();
+        vectors[count + 2].iov_base = (void *)&g_LogLineEnd;
+        vectors[count + 2].iov_len = 1;
+        count += 3;
+    }
+    WriteVectors(logFile.fileHandle, vectors, count);
+#endif
+
+    logFile.pendingCount = 0;
+}
+
+void LuaLogWriter::_CloseLogFiles()
+{
+    for( std::map<uint32, LogFile>::iterator logFile = m_LogFiles.begin(); logFile != m_LogFiles.end(); logFile++ )
+    {
+        _WriteLog(logFile->second);
+#ifdef _WIN32
+        _close(logFile->second.fileHandle);
+#else
+        close(logFile->second.fileHandle);
+#endif
+    }
+    m_LogFiles.clear();
+}
+
+void LuaLogWriter::_FormatTimestamp(boost::system_time time, char * buffer)
+{
+    // Converting to local time is the expensive part, so only do that once per second:
+    boost::posix_time::time_duration timeOfDay = time.time_of_day();
+    boost::system_time second(time.date(), boost::posix_time::seconds(timeOfDay.total_seconds()));
+    if( second != m_TimestampSecond )
+    {
+        FormatTimestamp(second, m_TimestampPrefix);
+        m_TimestampSecond = second;
+    }
+
+    // "[YYYY-MM-DD] [HH:MM:SS.mmm] " - only the milliseconds differ within the second:
+    int milliSeconds = int(timeOfDay.total_milliseconds() % 1000);
+    memcpy(buffer, m_TimestampPrefix, LUALOGWRITER_TIMESTAMP_SIZE);
+    buffer[23] = char('0' + (milliSeconds / 100));
+    buffer[24] = char('0' + ((milliSeconds / 10) % 10));
+    buffer[25] = char('0' + (milliSeconds % 10));
+}
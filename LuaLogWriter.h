@@ -0,0 +1,254 @@
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include "EVEmu_Types.h"
+#include "../common/boost/boost/cstdint.hpp"
+#include "../common/boost/boost/atomic.hpp"
+#include "../common/boost/boost/thread/thread.hpp"
+#include "../common/boost/boost/thread/mutex.hpp"
+#include "../common/boost/boost/thread/locks.hpp"
+#include "../common/boost/boost/thread/condition_variable.hpp"
+
+#pragma once
+
+#ifndef LUALOGWRITER_H
+#define LUALOGWRITER_H
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// USE Cases:
+//
+// Writing the log files of many LuaThreads without stalling their scripts on disk I/O:
+// ------------------------------------------------------------------------------------
+// 1) Create ONE LuaLogWriter object for the whole server, optionally passing in how often, in milliseconds,
+//    queued messages are written out, how many queued messages wake the writer up before that, and whether
+//    the log files are written as text or in the binary format described below.
+// 2) Call LuaLogWriter::Start() to create the writer thread.
+// 3) Create each LuaThread passing in the pointer to the LuaLogWriter.  The LuaThread then opens its log file
+//    through the writer with OpenLog(), and every message it logs is queued with Write() instead of being
+//    written to the file by the thread logging it.
+// 4) Destroy all LuaThread objects using the writer BEFORE calling LuaLogWriter::Shutdown() or destroying the
+//    LuaLogWriter object.  Shutdown() writes out every message still queued before closing the log files.
+//
+// Messages are queued in a fixed-size ring that any number of threads may write to without taking a lock.
+// Each message is stamped with the time it was queued, and the writer thread formats the time stamps and
+// writes all the messages queued for the same file with a single writev() call.  Opening and closing a log
+// file are queued like messages, so every message queued before CloseLog() is written before the file is
+// closed.  When the ring is full, Write() sleeps until the writer thread has made room rather than lose the message.
+//
+// Structured messages:
+// --------------------
+// A message may be queued as a format string and its arguments, packed into a LuaLogArgs, rather than as text.
+// The format string must be a string literal, since only its address is queued, and each "%s" in it is replaced
+// by the next argument.  With LUALOG_FORMAT_TEXT the writer thread does the replacing, so the thread logging the
+// message never formats any text.  With LUALOG_FORMAT_BINARY nothing is formatted at all: the file holds one
+// record per message, each format string is written once per file and referred to by its id after that, and
+// the LuaLogDecoder tool (logdecoder/LuaLogDecoder.cpp) renders the file as text when it is read.
+//
+// Binary log files start with the LUALOG_BINARY_MAGIC_SIZE bytes of LUALOG_BINARY_MAGIC, followed by records
+// made of one type byte, the uint32 length of the rest of the record, and then the fields below.  All numbers
+// are little endian:
+//   LUALOG_RECORD_THREAD    uint32 threadId, thread name                 (the first record of the file)
+//   LUALOG_RECORD_SCRIPT    uint32 scriptId, script name                 (before the first message using the id)
+//   LUALOG_RECORD_FORMAT    uint32 formatId, format string               (same)
+//   LUALOG_RECORD_MESSAGE   int64 microseconds since 1970-01-01 UTC, uint32 threadId, uint32 scriptId,
+//                           uint8 level, uint32 formatId, uint8 argCount, the arguments packed as by LuaLogArgs
+// A message queued as text has the format id LUALOG_TEXT_FORMAT_ID and the text as its only argument.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#define LUALOGWRITER_INVALID_LOG        0           // Log id returned by OpenLog() when the file could not be opened
+#define LUALOGWRITER_TIMESTAMP_SIZE     32          // Buffer size needed by FormatTimestamp()
+
+#define LUALOG_BINARY_MAGIC             "LUALOG\x00\x01"    // The last byte is the version of the format
+#define LUALOG_BINARY_MAGIC_SIZE        8
+#define LUALOG_TEXT_FORMAT_ID           0           // Format id of messages queued as text
+#define LUALOG_NO_SCRIPT_ID             0           // Script id of messages logged before a script was given
+
+// The levels as numbers the preprocessor can compare, for LUALOG_MIN_LEVEL:
+#define LUALOG_LEVEL_TRACE              0
+#define LUALOG_LEVEL_DEBUG              1
+#define LUALOG_LEVEL_INFO               2
+#define LUALOG_LEVEL_WARNING            3
+#define LUALOG_LEVEL_ERROR              4
+
+// Diagnostics below this level are compiled out (see the LUAENV_...() macros in LuaEnvironment.h), define it in the
+// project settings to keep more or fewer of them:
+#ifndef LUALOG_MIN_LEVEL
+#ifdef _DEBUG
+#define LUALOG_MIN_LEVEL                LUALOG_LEVEL_TRACE
+#else
+#define LUALOG_MIN_LEVEL                LUALOG_LEVEL_INFO
+#endif
+#endif
+
+enum LuaLogLevels
+{
+    LUALOG_TRACE = LUALOG_LEVEL_TRACE,
+    LUALOG_DEBUG = LUALOG_LEVEL_DEBUG,
+    LUALOG_INFO = LUALOG_LEVEL_INFO,
+    LUALOG_WARNING = LUALOG_LEVEL_WARNING,
+    LUALOG_ERROR = LUALOG_LEVEL_ERROR
+};
+
+enum LuaLogFormats
+{
+    LUALOG_FORMAT_TEXT,
+    LUALOG_FORMAT_BINARY
+};
+
+enum LuaLogRecordTypes
+{
+    LUALOG_RECORD_THREAD = 1,
+    LUALOG_RECORD_SCRIPT = 2,
+    LUALOG_RECORD_FORMAT = 3,
+    LUALOG_RECORD_MESSAGE = 4
+};
+
+// Arguments of a structured message, packed as they are added, each as one type byte followed by the
+// value: 'n' and the 8 bytes of a double, or 's' and the uint32 length followed by the characters:
+class LuaLogArgs
+{
+    public:
+        LuaLogArgs() : m_Count(0) {}
+
+        LuaLogArgs & operator<<(double value);
+        LuaLogArgs & operator<<(const std::string & value);
+        LuaLogArgs & operator<<(const char * value);
+
+        uint32 GetCount() const { return m_Count; }
+        const std::string & GetPacked() const { return m_Packed; }
+
+        // Replaces each "%s" in 'format' by the next of the packed arguments, and "%%" by '%', appending the result
+        // to 'text'.  Returns false if the packed arguments are cut short, which only a damaged log file causes:
+        static bool Render(const char * format, const char * packed, size_t packedSize, std::string & text);
+
+    protected:
+        void _PackString(const char * value, size_t length);
+
+        uint32 m_Count;
+        std::string m_Packed;
+};
+
+class LuaLogWriter
+{
+    public:
+        LuaLogWriter(uint32 flushIntervalMilliSeconds = 100, uint32 flushBatchSize = 256, LuaLogFormats logFormat = LUALOG_FORMAT_TEXT);
+        ~LuaLogWriter();
+
+        int32 Start();
+        void Shutdown();
+
+        LuaLogFormats GetLogFormat() { return m_LogFormat; }
+        const char * GetFileExtension() { return ((m_LogFormat == LUALOG_FORMAT_BINARY) ? ".blog" : ".log"); }
+
+        // Creates or truncates the file and returns the id to pass to Write() and CloseLog(), which is also the
+        // thread id of its messages in a binary log; 'threadName' is only written to binary logs:
+        uint32 OpenLog(std::string logFileName, std::string threadName = "");
+        void CloseLog(uint32 logId);
+
+        // Returns the id to log messages about the script under, which is the same for every call with the same name:
+        uint32 InternScript(std::string scriptName);
+
+        // Queues the message to be written to the log file with the current time; 'logMessage' is left empty,
+        // its text is moved into the queue rather than copied:
+        void Write(uint32 logId, std::string & logMessage);
+
+        // Queues a structured message, see above; 'format' MUST be a string literal:
+        void Write(uint32 logId, LuaLogLevels level, uint32 scriptId, const char * format, const LuaLogArgs & args);
+
+        // Formats the time the way every log line starts, "[YYYY-MM-DD] [HH:MM:SS.mmm] " in local time, into a buffer
+        // of at least LUALOGWRITER_TIMESTAMP_SIZE chars:
+        static void FormatTimestamp(boost::system_time time, char * buffer);
+
+        // Returns what a text log line at that level has after its time stamp, which is nothing for LUALOG_INFO:
+        static const char * GetLevelTag(LuaLogLevels level);
+
+    protected:
+        struct Record
+        {
+            enum RecordTypes
+            {
+                RECORD_MESSAGE,
+                RECORD_OPEN,
+                RECORD_CLOSE,
+                RECORD_SCRIPT
+            };
+
+            boost::atomic<uint32> sequence;         // Tells whether the slot is free, being written, or ready to be read
+            RecordTypes type;
+            uint32 logId;
+            int fileHandle;                         // RECORD_OPEN only
+            boost::system_time time;
+            LuaLogLevels level;
+            uint32 scriptId;
+            const char * format;                    // NULL when 'text' is the message itself
+            uint32 argCount;
+            std::string text;                       // The message, the packed arguments, the thread name or the script name
+        };
+
+        struct PendingLine
+        {
+            char timestamp[LUALOGWRITER_TIMESTAMP_SIZE];
+            std::string text;
+        };
+
+        struct LogFile
+        {
+            int fileHandle;
+            std::vector<PendingLine> pendingLines;  // Taken from the ring and waiting for the next writev()
+            uint32 pendingCount;                    // Lines in use at the front of pendingLines, which is never shrunk
+            std::string pendingBytes;               // Same for binary logs, the records waiting for the next write()
+            std::set<uint32> writtenFormats;        // Binary logs only, the ids already defined in the file
+            std::set<uint32> writtenScripts;
+        };
+
+        void _Push(Record::RecordTypes type, uint32 logId, int fileHandle, std::string & text,
+            LuaLogLevels level = LUALOG_INFO, uint32 scriptId = LUALOG_NO_SCRIPT_ID, const char * format = NULL, uint32 argCount = 0);
+        bool _Pop(Record & record);
+        void _WriterProcess();
+        void _TakeRecords();
+        void _AddTextLine(LogFile & logFile, Record & record);
+        void _AddBinaryRecords(LogFile & logFile, Record & record);
+        void _WriteLog(LogFile & logFile);
+        void _CloseLogFiles();
+        void _FormatTimestamp(boost::system_time time, char * buffer);
+
+        enum { RING_SIZE = 4096 };                  // Must be a power of two
+
+        Record * m_pRecords;
+
+        // Same scheme as LuaCommandRing, except that many producers claim slots by raising m_WriteIndex together, and
+        // each slot's sequence tells the consumer when the producer that claimed it has finished filling it in:
+        boost::atomic<uint32> m_ReadIndex;          // Written by the writer thread only
+        char m_Padding[64];
+        boost::atomic<uint32> m_WriteIndex;
+
+        boost::atomic<uint32> m_NextLogId;
+
+        uint32 m_FlushIntervalMilliSeconds;
+        uint32 m_FlushBatchSize;
+        LuaLogFormats m_LogFormat;
+        boost::thread * m_pThread;
+
+        // Only touched by the writer thread:
+        std::map<uint32, LogFile> m_LogFiles;
+        std::map<const char *, uint32> m_FormatIds; // Keyed by the address of the string literal
+        std::map<uint32, std::string> m_ScriptNames;
+        boost::system_time m_TimestampSecond;       // The whole second m_TimestampPrefix was formatted for
+        char m_TimestampPrefix[LUALOGWRITER_TIMESTAMP_SIZE];
+
+        // Protects m_ScriptIds, which is only used when a LuaThread is given a script:
+        boost::mutex script_mutex;
+        std::map<std::string, uint32> m_ScriptIds;
+
+        // Protects m_bShutdown, and is the mutex the writer thread and the producers finding the ring full wait on:
+        boost::mutex writer_mutex;
+        boost::condition_variable writer_condition;
+        boost::condition_variable space_condition;  // Notified by the writer thread after taking records
+        boost::atomic<uint32> m_BlockedProducers;
+        bool m_bShutdown;
+};
+
+#endif
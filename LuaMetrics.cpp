@@ -0,0 +1,243 @@
+
+#include <set>
+#include <iomanip>
+#include "LuaMetrics.h"
+#include "../common/boost/boost/thread/mutex.hpp"
+#include "../common/boost/boost/thread/locks.hpp"
+
+// Every LuaThreadMetrics alive, and the metrics of those already destroyed, for LuaThreadMetrics::GetTotals():
+static boost::mutex g_MetricsRegistryMutex;
+static std::set<const LuaThreadMetrics *> g_LiveMetrics;
+static LuaMetricsSnapshot g_RetiredMetrics;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// LuaHistogramSnapshot:
+
+boost::uint64_t LuaHistogramSnapshot::GetPercentile(double percentile) const
+{
+    if( count == 0 )
+        return 0;
+
+    // The rank of the value looked for, counting from 1:
+    boost::uint64_t rank = boost::uint64_t((percentile / 100.0) * double(count) + 0.5);
+    if( rank < 1 )
+        rank = 1;
+    if( rank > count )
+        rank = count;
+
+    boost::uint64_t counted = 0;
+    for( uint32 i = 0; i < counts.size(); i++ )
+    {
+        counted += counts[i];
+        if( counted >= rank )
+        {
+            boost::uint64_t value = LuaHistogram::GetBucketHighestValue(i);
+            return ((value < max) ? value : max);
+        }
+    }
+
+    return max;
+}
+
+void LuaHistogramSnapshot::Add(const LuaHistogramSnapshot & other)
+{
+    count += other.count;
+    sum += other.sum;
+    if( other.max > max )
+        max = other.max;
+    for( uint32 i = 0; (i < counts.size()) && (i < other.counts.size()); i++ )
+        counts[i] += other.counts[i];
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// LuaHistogram:
+
+LuaHistogram::LuaHistogram()
+{
+    for( uint32 i = 0; i < LUAHISTOGRAM_BUCKET_COUNT; i++ )
+        m_Counts[i] = 0;
+    m_Count = 0;
+    m_Sum = 0;
+    m_Max = 0;
+}
+
+void LuaHistogram::Record(boost::uint64_t value)
+{
+    if( value > LUAHISTOGRAM_MAX_VALUE )
+        value = LUAHISTOGRAM_MAX_VALUE;
+
+    // The counters are only read by snapshots, which don't need them in any particular order:
+    m_Counts[GetBucketIndex(value)].fetch_add(1, boost::memory_order_relaxed);
+    m_Count.fetch_add(1, boost::memory_order_relaxed);
+    m_Sum.fetch_add(value, boost::memory_order_relaxed);
+
+    boost::uint64_t max = m_Max.load(boost::memory_order_relaxed);
+    while( (value > max) && !(m_Max.compare_exchange_weak(max, value, boost::memory_order_relaxed)) )
+        ;
+}
+
+void LuaHistogram::GetSnapshot(LuaHistogramSnapshot & snapshot) const
+{
+    snapshot.counts.resize(LUAHISTOGRAM_BUCKET_COUNT);
+    for( uint32 i = 0; i < LUAHISTOGRAM_BUCKET_COUNT; i++ )
+        snapshot.counts[i] = m_Counts[i].load(boost::memory_order_relaxed);
+    snapshot.count = m_Count.load(boost::memory_order_relaxed);
+    snapshot.sum = m_Sum.load(boost::memory_order_relaxed);
+    snapshot.max = m_Max.load(boost::memory_order_relaxed);
+}
+
+uint32 LuaHistogram::GetBucketIndex(boost::uint64_t value)
+{
+    // Values below 16 have a bucket each, above that each power of two is split in 16 buckets of the same width:
+    if( value < (boost::uint64_t(1) << LUAHISTOGRAM_SUB_BUCKET_BITS) )
+        return uint32(value);
+
+    uint32 highestBit = 0;
+    for( uint32 shift = 32; shift != 0; shift >>= 1 )
+        if( (value >> (highestBit + shift)) != 0 )
+            highestBit += shift;
+
+    uint32 const subBucketShift = highestBit - LUAHISTOGRAM_SUB_BUCKET_BITS;
+    uint32 const subBucket = uint32(value >> subBucketShift) & ((1 << LUAHISTOGRAM_SUB_BUCKET_BITS) - 1);
+    return ((subBucketShift + 1) << LUAHISTOGRAM_SUB_BUCKET_BITS) + subBucket;
+}
+
+boost::uint64_t LuaHistogram::GetBucketHighestValue(uint32 bucketIndex)
+{
+    if( bucketIndex < (1 << LUAHISTOGRAM_SUB_BUCKET_BITS) )
+        return bucketIndex;
+
+    uint32 const subBucketShift = (bucketIndex >> LUAHISTOGRAM_SUB_BUCKET_BITS) - 1;
+    uint32 const subBucket = bucketIndex & ((1 << LUAHISTOGRAM_SUB_BUCKET_BITS) - 1);
+    boost::uint64_t const lowestValue = boost::uint64_t((1 << LUAHISTOGRAM_SUB_BUCKET_BITS) + subBucket) << subBucketShift;
+    return lowestValue + (boost::uint64_t(1) << subBucketShift) - 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// LuaMetricsSnapshot:
+
+void LuaMetricsSnapshot::Add(const LuaMetricsSnapshot & other)
+{
+    threadCount += other.threadCount;
+    errors += other.errors;
+    gcUntimedPasses += other.gcUntimedPasses;
+    runMicroSeconds.Add(other.runMicroSeconds);
+    queueWaitMicroSeconds.Add(other.queueWaitMicroSeconds);
+    callbackNanoSeconds.Add(other.callbackNanoSeconds);
+    gcMicroSeconds.Add(other.gcMicroSeconds);
+    bytesAllocated.Add(other.bytesAllocated);
+}
+
+static void WriteHistogram(std::ostream & output, const char * name, const LuaHistogramSnapshot & histogram)
+{
+    output << std::left << std::setw(24) << name << std::right
+        << " count=" << histogram.count
+        << " total=" << histogram.sum
+        << " mean=" << std::fixed << std::setprecision(1) << histogram.GetMean()
+        << " p50=" << histogram.GetPercentile(50.0)
+        << " p90=" << histogram.GetPercentile(90.0)
+        << " p99=" << histogram.GetPercentile(99.0)
+        << " p99.9=" << histogram.GetPercentile(99.9)
+        << " max=" << histogram.max << std::endl;
+}
+
+void LuaMetricsSnapshot::Write(std::ostream & output) const
+{
+    output << "LuaThreads: " << threadCount << "  errors: " << errors << std::endl;
+    WriteHistogram(output, "runMicroSeconds", runMicroSeconds);
+    WriteHistogram(output, "queueWaitMicroSeconds", queueWaitMicroSeconds);
+    WriteHistogram(output, "callbackNanoSeconds", callbackNanoSeconds);
+    WriteHistogram(output, "gcMicroSeconds", gcMicroSeconds);
+    if( gcUntimedPasses != 0 )
+        output << std::left << std::setw(24) << "gcMicroSeconds" << std::right << " n/a for " << gcUntimedPasses
+            << " passes (LUA_GCTIMING off)" << std::endl;
+    WriteHistogram(output, "bytesAllocated", bytesAllocated);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// LuaThreadMetrics:
+
+LuaThreadMetrics::LuaThreadMetrics()
+{
+    m_Errors = 0;
+    m_GCUntimedPasses = 0;
+
+    boost::mutex::scoped_lock lock(g_MetricsRegistryMutex);
+    g_LiveMetrics.insert(this);
+}
+
+LuaThreadMetrics::~LuaThreadMetrics()
+{
+    LuaMetricsSnapshot snapshot;
+    GetSnapshot(snapshot);
+    snapshot.threadCount = 0;
+
+    boost::mutex::scoped_lock lock(g_MetricsRegistryMutex);
+    g_LiveMetrics.erase(this);
+    g_RetiredMetrics.Add(snapshot);
+}
+
+void LuaThreadMetrics::RecordRun(boost::uint64_t durationMicroSeconds, bool bError)
+{
+    m_RunMicroSeconds.Record(durationMicroSeconds);
+    if( bError )
+        RecordError();
+}
+
+void LuaThreadMetrics::RecordError()
+{
+    m_Errors.fetch_add(1, boost::memory_order_relaxed);
+}
+
+void LuaThreadMetrics::RecordQueueWait(boost::uint64_t microSeconds)
+{
+    m_QueueWaitMicroSeconds.Record(microSeconds);
+}
+
+void LuaThreadMetrics::RecordCallback(boost::uint64_t nanoSeconds)
+{
+    m_CallbackNanoSeconds.Record(nanoSeconds);
+}
+
+void LuaThreadMetrics::RecordScriptPass(boost::uint64_t gcMicroSeconds, boost::uint64_t bytesAllocated, bool bGCTimed)
+{
+    if( bGCTimed )
+        m_GCMicroSeconds.Record(gcMicroSeconds);
+    else
+        m_GCUntimedPasses.fetch_add(1, boost::memory_order_relaxed);
+    m_BytesAllocated.Record(bytesAllocated);
+}
+
+void LuaThreadMetrics::RecordIdleGarbageCollection(boost::uint64_t gcMicroSeconds)
+{
+    m_GCMicroSeconds.Record(gcMicroSeconds);
+}
+
+void LuaThreadMetrics::GetSnapshot(LuaMetricsSnapshot & snapshot) const
+{
+    snapshot.threadCount = 1;
+    snapshot.errors = m_Errors.load(boost::memory_order_relaxed);
+    snapshot.gcUntimedPasses = m_GCUntimedPasses.load(boost::memory_order_relaxed);
+    m_RunMicroSeconds.GetSnapshot(snapshot.runMicroSeconds);
+    m_QueueWaitMicroSeconds.GetSnapshot(snapshot.queueWaitMicroSeconds);
+    m_CallbackNanoSeconds.GetSnapshot(snapshot.callbackNanoSeconds);
+    m_GCMicroSeconds.GetSnapshot(snapshot.gcMicroSeconds);
+    m_BytesAllocated.GetSnapshot(snapshot.bytesAllocated);
+}
+
+void LuaThreadMetrics::GetTotals(LuaMetricsSnapshot & snapshot)
+{
+    boost::mutex::scoped_lock lock(g_MetricsRegistryMutex);
+
+    snapshot = g_RetiredMetrics;
+    LuaMetricsSnapshot threadSnapshot;
+    for( std::set<const LuaThreadMetrics *>::const_iterator it = g_LiveMetrics.begin(); it != g_LiveMetrics.end(); ++it )
+    {
+        (*it)->GetSnapshot(threadSnapshot);
+        snapshot.Add(threadSnapshot);
+    }
+}
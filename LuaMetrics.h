@@ -0,0 +1,141 @@
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "EVEmu_Types.h"
+#include "../common/boost/boost/cstdint.hpp"
+#include "../common/boost/boost/atomic.hpp"
+
+#pragma once
+
+#ifndef LUAMETRICS_H
+#define LUAMETRICS_H
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// USE Cases:
+//
+// Measuring what the scripts of the server cost, for capacity planning:
+// ---------------------------------------------------------------------
+// 1) Every LuaThread owns a LuaThreadMetrics object, which its LuaEnvironment records into while it runs the script.
+// 2) Call LuaThread::GetMetricsSnapshot() to read the metrics of one LuaThread, or LuaThreadMetrics::GetTotals() to
+//    read the metrics of all of them added together, including the LuaThreads already destroyed.
+// 3) Read the counts, means and percentiles from the LuaMetricsSnapshot, or have it write them out with Write().
+//
+// What is measured:
+//   runMicroSeconds        each completed run of the script, from its start to its end, the time spent in wait() included
+//   queueWaitMicroSeconds  from a command or event being sent to the LuaEnvironment, or its LuaScheduler slice being queued,
+//                          until the thread running it picks it up
+//   callbackNanoSeconds    each call from the script into a C++ function (see LuaContext::setCallbackObserver())
+//   gcMicroSeconds         the garbage collection done in each pass resuming the script, as timed by lua itself when
+//                          built with LUA_GCTIMING (see luaconf.h), which the projects define; and the wall clock time of
+//                          each step of the idle garbage collector
+//   gcUntimedPasses        passes resuming the script while lua was built without LUA_GCTIMING, whose garbage collection
+//                          could not be timed and is left out of gcMicroSeconds rather than counted as 0
+//   bytesAllocated         the bytes lua allocated in each pass resuming the script
+//   errors                 script runs ending with an error, and queued function calls that failed
+//
+// Recording never takes a lock: a LuaHistogram is a fixed array of counters, one per bucket, that are incremented
+// atomically.  The buckets are laid out like an HDR histogram, 16 buckets for each power of two, so any value is counted
+// within 1/16th (6.25%) of its actual value, from 0 to LUAHISTOGRAM_MAX_VALUE.  A LuaThreadMetrics takes about 24KB.
+// A snapshot reads the counters one by one while they may still change, so its figures may be a few samples apart.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#define LUAHISTOGRAM_SUB_BUCKET_BITS    4                               // 16 buckets per power of two
+#define LUAHISTOGRAM_MAX_VALUE_BITS     40                              // Values of 2^40 and more are counted as 2^40 - 1
+#define LUAHISTOGRAM_MAX_VALUE          ((boost::uint64_t(1) << LUAHISTOGRAM_MAX_VALUE_BITS) - 1)
+#define LUAHISTOGRAM_BUCKET_COUNT       ((LUAHISTOGRAM_MAX_VALUE_BITS - LUAHISTOGRAM_SUB_BUCKET_BITS + 1) << LUAHISTOGRAM_SUB_BUCKET_BITS)
+
+// The contents of a LuaHistogram at one point in time:
+struct LuaHistogramSnapshot
+{
+    boost::uint64_t count;
+    boost::uint64_t sum;
+    boost::uint64_t max;
+    std::vector<boost::uint64_t> counts;    // LUAHISTOGRAM_BUCKET_COUNT entries
+
+    LuaHistogramSnapshot() : count(0), sum(0), max(0), counts(LUAHISTOGRAM_BUCKET_COUNT, 0) {}
+
+    double GetMean() const { return ((count != 0) ? (double(sum) / double(count)) : 0.0); }
+
+    // Returns the value that 'percentile' percent of the values are less than or equal to, eg. 99.9; like for an HDR
+    // histogram it is the highest value counted in the same bucket, and never more than 'max':
+    boost::uint64_t GetPercentile(double percentile) const;
+
+    void Add(const LuaHistogramSnapshot & other);
+};
+
+class LuaHistogram
+{
+    public:
+        LuaHistogram();
+
+        void Record(boost::uint64_t value);
+        void GetSnapshot(LuaHistogramSnapshot & snapshot) const;
+
+        static uint32 GetBucketIndex(boost::uint64_t value);
+        static boost::uint64_t GetBucketHighestValue(uint32 bucketIndex);
+
+    protected:
+        boost::atomic<boost::uint64_t> m_Counts[LUAHISTOGRAM_BUCKET_COUNT];
+        boost::atomic<boost::uint64_t> m_Count;
+        boost::atomic<boost::uint64_t> m_Sum;
+        boost::atomic<boost::uint64_t> m_Max;
+
+    private:
+        LuaHistogram(const LuaHistogram &);
+        LuaHistogram & operator=(const LuaHistogram &);
+};
+
+struct LuaMetricsSnapshot
+{
+    uint32 threadCount;                     // LuaThreads measured, those already destroyed are not counted
+    boost::uint64_t errors;
+    boost::uint64_t gcUntimedPasses;
+    LuaHistogramSnapshot runMicroSeconds;
+    LuaHistogramSnapshot queueWaitMicroSeconds;
+    LuaHistogramSnapshot callbackNanoSeconds;
+    LuaHistogramSnapshot gcMicroSeconds;
+    LuaHistogramSnapshot bytesAllocated;
+
+    LuaMetricsSnapshot() : threadCount(0), errors(0), gcUntimedPasses(0) {}
+
+    void Add(const LuaMetricsSnapshot & other);
+
+    // Writes the count, total, mean, percentiles and maximum of each histogram, one line each:
+    void Write(std::ostream & output) const;
+};
+
+class LuaThreadMetrics
+{
+    public:
+        LuaThreadMetrics();
+        ~LuaThreadMetrics();        // Adds the metrics to those of the LuaThreads already destroyed
+
+        void RecordRun(boost::uint64_t durationMicroSeconds, bool bError);
+        void RecordError();
+        void RecordQueueWait(boost::uint64_t microSeconds);
+        void RecordCallback(boost::uint64_t nanoSeconds);
+        void RecordScriptPass(boost::uint64_t gcMicroSeconds, boost::uint64_t bytesAllocated, bool bGCTimed);
+        void RecordIdleGarbageCollection(boost::uint64_t gcMicroSeconds);
+
+        void GetSnapshot(LuaMetricsSnapshot & snapshot) const;
+
+        // The metrics of every LuaThread of the process added together, the ones already destroyed included:
+        static void GetTotals(LuaMetricsSnapshot & snapshot);
+
+    protected:
+        LuaHistogram m_RunMicroSeconds;
+        LuaHistogram m_QueueWaitMicroSeconds;
+        LuaHistogram m_CallbackNanoSeconds;
+        LuaHistogram m_GCMicroSeconds;
+        LuaHistogram m_BytesAllocated;
+        boost::atomic<boost::uint64_t> m_Errors;
+        boost::atomic<boost::uint64_t> m_GCUntimedPasses;
+
+    private:
+        LuaThreadMetrics(const LuaThreadMetrics &);
+        LuaThreadMetrics & operator=(const LuaThreadMetrics &);
+};
+
+#endif
@@ -0,0 +1,320 @@
+
+#include <iostream>
+#include "LuaScheduler.h"
+#include "LuaEnvironment.h"
+#include "../common/boost/boost/bind.hpp"
+#include "../common/boost/boost/integer_traits.hpp"
+
+LuaScheduler::LuaScheduler(uint32 workerCount)
+{
+    m_WorkerCount = workerCount;
+    if( m_WorkerCount == 0 )
+        m_WorkerCount = boost::thread::hardware_concurrency();
+    if( m_WorkerCount == 0 )
+        m_WorkerCount = 1;      // hardware_concurrency() returns 0 when the count cannot be determined
+
+    m_NextWorker = 0;
+    m_bStarted = false;
+    m_ReadyCount = 0;
+    m_SleepingWorkers = 0;
+    m_EpochTime = boost::get_system_time();
+    m_NextTimedWake = boost::integer_traits<boost::int64_t>::const_max;
+    m_bShutdown = false;
+}
+
+LuaScheduler::~LuaScheduler()
+{
+    Shutdown();
+}
+
+int32 LuaScheduler::Start()
+{
+    if( m_bStarted )
+    {
+        std::cout << "LuaScheduler::Start(): Scheduler already Started!  You cannot call this more than once!" << std::endl;
+        return 0;
+    }
+
+    // All Worker objects must exist before any thread starts, since every worker may steal from every other:
+    for( uint32 i = 0; i < m_WorkerCount; i++ )
+    {
+        Worker * pWorker = new Worker;
+        pWorker->pThread = NULL;
+        m_Workers.push_back(pWorker);
+    }
+
+    {
+        // A scheduler that was Shutdown() may be started again:
+        boost::mutex::scoped_lock lock(scheduler_mutex);
+        m_bShutdown = false;
+    }
+
+    for( uint32 i = 0; i < m_WorkerCount; i++ )
+        m_Workers[i]->pThread = new boost::thread(boost::bind(&LuaScheduler::_WorkerProcess, this, i));
+
+    m_bStarted = true;
+    std::cout << "LuaScheduler::Start(): Started " << m_WorkerCount << " worker threads." << std::endl;
+
+    return 1;
+}
+
+void LuaScheduler::Shutdown()
+{
+    if( !m_bStarted )
+        return;
+
+    {
+        boost::mutex::scoped_lock lock(scheduler_mutex);
+        m_bShutdown = true;
+    }
+    scheduler_condition.notify_all();
+
+    // Every worker may still be stealing from every other worker's queue until it has exited, so no Worker
+    // object may be deleted before all the threads have been joined:
+    for( uint32 i = 0; i < m_Workers.size(); i++ )
+        m_Workers[i]->pThread->join();
+
+    // No worker is left to pop from or steal from the readyQueues, and Schedule() no longer pushes to them:
+    for( uint32 i = 0; i < m_Workers.size(); i++ )
+    {
+        delete m_Workers[i]->pThread;
+        delete m_Workers[i];
+    }
+
+    boost::mutex::scoped_lock lock(scheduler_mutex);
+    m_Workers.clear();
+    for( TimedQueue::iterator it = m_TimedQueue.begin(); it != m_TimedQueue.end(); ++it )
+        it->second->m_bTimedQueued = false;
+    m_TimedQueue.clear();
+    for( uint32 i = 0; i < m_IdleQueue.size(); i++ )
+        m_IdleQueue[i]->m_bIdleQueued = false;
+    m_IdleQueue.clear();
+    m_ReadyCount = 0;
+    m_SleepingWorkers = 0;
+    _UpdateNextTimedWake();
+    m_bStarted = false;
+}
+
+void LuaScheduler::Schedule(boost::shared_ptr<LuaEnvironment> pLuaEnv)
+{
+    if( m_bShutdown.load() || m_Workers.empty() )
+        return;
+
+    _PushReady(m_NextWorker++ % m_WorkerCount, pLuaEnv);
+}
+
+void LuaScheduler::ScheduleAt(boost::shared_ptr<LuaEnvironment> pLuaEnv, boost::system_time wakeTime)
+{
+    {
+        boost::mutex::scoped_lock lock(scheduler_mutex);
+        if( m_bShutdown )
+            return;
+
+        // Every slice ending in a wait asks for a wakeup, so keep only the earliest one of each environment:
+        if( pLuaEnv->m_bTimedQueued )
+        {
+            if( pLuaEnv->m_TimedWakeTime <= wakeTime )
+                return;
+            _RemoveTimed(pLuaEnv.get());
+        }
+        pLuaEnv->m_bTimedQueued = true;
+        pLuaEnv->m_TimedWakeTime = wakeTime;
+        m_TimedQueue.insert(std::make_pair(wakeTime, pLuaEnv));
+        _UpdateNextTimedWake();
+    }
+
+    // An idle worker may be waiting for a later wake time than this one, so have it recompute its timeout:
+    scheduler_condition.notify_one();
+}
+
+
+void LuaScheduler::ScheduleIdleWork(boost::shared_ptr<LuaEnvironment> pLuaEnv)
+{
+    {
+        boost::mutex::scoped_lock lock(scheduler_mutex);
+        if( m_bShutdown )
+            return;
+        if( pLuaEnv->m_bIdleQueued )
+            return;
+        pLuaEnv->m_bIdleQueued = true;
+        m_IdleQueue.push_back(pLuaEnv);
+    }
+
+    scheduler_condition.notify_one();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Protected and Private Member Functions:
+
+void LuaScheduler::_WorkerProcess(uint32 workerIndex)
+{
+    while( true )
+    {
+        _WakeTimedEnvironments();
+
+        boost::shared_ptr<LuaEnvironment> pLuaEnv = _PopReady(workerIndex);
+        if( pLuaEnv.get() == NULL )
+        {
+            boost::shared_ptr<LuaEnvironment> pIdleEnv;
+            {
+                // Nothing ready anywhere, so collect garbage for an environment that asked for it, or else wait
+                // until something is scheduled or the next timed wakeup is due:
+                boost::mutex::scoped_lock lock(scheduler_mutex);
+                if( m_bShutdown )
+                    break;
+
+                if( !m_IdleQueue.empty() )
+                {
+                    if( m_ReadyCount.load() > 0 )
+                        continue;
+                    pIdleEnv = m_IdleQueue.front();
+                    pIdleEnv->m_bIdleQueued = false;
+                    m_IdleQueue.pop_front();
+                }
+                else
+                {
+                    // Counted as sleeping BEFORE m_ReadyCount is read: a _PushReady() raising it after that reads
+                    // m_SleepingWorkers afterwards, so it either is seen here or sees us and notifies under the lock:
+                    m_SleepingWorkers++;
+                    if( m_ReadyCount.load() == 0 )
+                    {
+                        if( m_TimedQueue.empty() )
+                            scheduler_condition.wait(lock);
+                        else
+                            scheduler_condition.timed_wait(lock, m_TimedQueue.begin()->first);
+                    }
+                    m_SleepingWorkers--;
+                }
+            }
+
+            // One budget at a time, so that a slice becoming ready is not kept waiting for long:
+            if( (pIdleEnv.get() != NULL) && pIdleEnv->RunIdleGarbageCollection() )
+                ScheduleIdleWork(pIdleEnv);
+            continue;
+        }
+
+        boost::system_time wakeTime;
+        switch( pLuaEnv->RunScheduledSlice(wakeTime) )
+        {
+            case LuaEnvironment::SLICE_REQUEUE:
+                // The environment was sent another command while its slice ran, keep it on this worker:
+                _PushReady(workerIndex, pLuaEnv);
+                break;
+
+            case LuaEnvironment::SLICE_WAIT:
+                ScheduleAt(pLuaEnv, wakeTime);
+                if( pLuaEnv->HasIdleGarbageCollection() )
+                    ScheduleIdleWork(pLuaEnv);
+                break;
+
+            case LuaEnvironment::SLICE_IDLE:
+                if( pLuaEnv->HasIdleGarbageCollection() )
+                    ScheduleIdleWork(pLuaEnv);
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+boost::shared_ptr<LuaEnvironment> LuaScheduler::_PopReady(uint32 workerIndex)
+{
+    boost::shared_ptr<LuaEnvironment> pLuaEnv;
+
+    // Take from the front of our own queue first, then steal from the back of the other workers' queues:
+    for( uint32 i = 0; (i < m_WorkerCount) && (pLuaEnv.get() == NULL); i++ )
+    {
+        Worker * pWorker = m_Workers[(workerIndex + i) % m_WorkerCount];
+        boost::mutex::scoped_lock lock(pWorker->queue_mutex);
+        if( pWorker->readyQueue.empty() )
+            continue;
+
+        if( i == 0 )
+        {
+            pLuaEnv = pWorker->readyQueue.front();
+            pWorker->readyQueue.pop_front();
+        }
+        else
+        {
+            pLuaEnv = pWorker->readyQueue.back();
+            pWorker->readyQueue.pop_back();
+        }
+    }
+
+    if( pLuaEnv.get() != NULL )
+        m_ReadyCount--;
+
+    return pLuaEnv;
+}
+
+void LuaScheduler::_PushReady(uint32 workerIndex, boost::shared_ptr<LuaEnvironment> pLuaEnv)
+{
+    // m_ReadyCount is raised before the push so that a _PopReady() taking the entry can never take it below zero:
+    m_ReadyCount++;
+    {
+        Worker * pWorker = m_Workers[workerIndex];
+        boost::mutex::scoped_lock queueLock(pWorker->queue_mutex);
+        pWorker->readyQueue.push_back(pLuaEnv);
+    }
+
+    // Only the sleep/wake path takes scheduler_mutex; a worker counted as sleeping has either seen the new count
+    // or is waiting on the condition by the time the lock is ours:
+    if( m_SleepingWorkers.load() > 0 )
+    {
+        {
+            boost::mutex::scoped_lock lock(scheduler_mutex);
+        }
+        scheduler_condition.notify_one();
+    }
+}
+
+void LuaScheduler::_WakeTimedEnvironments()
+{
+    std::vector< boost::shared_ptr<LuaEnvironment> > dueEnvironments;
+
+    boost::system_time const now = boost::get_system_time();
+    if( (now - m_EpochTime).total_microseconds() < m_NextTimedWake.load() )
+        return;
+
+    {
+        boost::mutex::scoped_lock lock(scheduler_mutex);
+        while( (!m_TimedQueue.empty()) && (m_TimedQueue.begin()->first <= now) )
+        {
+            dueEnvironments.push_back(m_TimedQueue.begin()->second);
+            dueEnvironments.back()->m_bTimedQueued = false;
+            m_TimedQueue.erase(m_TimedQueue.begin());
+        }
+        _UpdateNextTimedWake();
+    }
+
+    // The environments decide for themselves whether they need a slice, which must be done
+    // without holding scheduler_mutex since they call back into Schedule():
+    for( uint32 i = 0; i < dueEnvironments.size(); i++ )
+        dueEnvironments[i]->ScheduledWakeup();
+}
+
+void LuaScheduler::_RemoveTimed(LuaEnvironment * pLuaEnv)
+{
+    // Called with scheduler_mutex held, for an environment in m_TimedQueue:
+    std::pair<TimedQueue::iterator, TimedQueue::iterator> range = m_TimedQueue.equal_range(pLuaEnv->m_TimedWakeTime);
+    for( TimedQueue::iterator it = range.first; it != range.second; ++it )
+    {
+        if( it->second.get() == pLuaEnv )
+        {
+            m_TimedQueue.erase(it);
+            break;
+        }
+    }
+    pLuaEnv->m_bTimedQueued = false;
+}
+
+void LuaScheduler::_UpdateNextTimedWake()
+{
+    // Called with scheduler_mutex held:
+    if( m_TimedQueue.empty() )
+        m_NextTimedWake = boost::integer_traits<boost::int64_t>::const_max;
+    else
+        m_NextTimedWake = (m_TimedQueue.begin()->first - m_EpochTime).total_microseconds();
+}
@@ -0,0 +1,105 @@
+
+#include <deque>
+#include <map>
+#include <vector>
+#include "EVEmu_Types.h"
+#include "../common/boost/boost/thread/thread.hpp"
+#include "../common/boost/boost/thread/mutex.hpp"
+#include "../common/boost/boost/thread/locks.hpp"
+#include "../common/boost/boost/thread/condition_variable.hpp"
+#include "../common/boost/boost/shared_ptr.hpp"
+#include "../common/boost/boost/atomic.hpp"
+
+#pragma once
+
+#ifndef LUASCHEDULER_H
+#define LUASCHEDULER_H
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// USE Cases:
+//
+// Sharing a fixed pool of OS threads between many LuaThread objects:
+// ------------------------------------------------------------------
+// 1) Create ONE LuaScheduler object for the whole server, passing in the number of worker threads
+//    to create, or 0 to create one worker per hardware thread reported by boost::thread.
+// 2) Call LuaScheduler::Start() to create the worker threads.
+// 3) Create each LuaThread with 'useThreading' set to 'true' and pass in the pointer to the LuaScheduler.
+//    Instead of starting its own boost::thread, the LuaThread will then hand its LuaEnvironment to the
+//    scheduler, and the environment's state machine will be run one slice at a time by whichever worker
+//    thread picks it up.  No OS thread is tied up by a LuaEnvironment that is waiting for a command.
+// 4) Destroy all LuaThread objects using the scheduler BEFORE calling LuaScheduler::Shutdown() or
+//    destroying the LuaScheduler object.
+//
+// Each worker owns a queue of LuaEnvironment objects ready to run.  A worker takes work from the front
+// of its own queue, and when that is empty it steals from the back of the other workers' queues, so that
+// a burst of commands sent to scripts queued on one worker is spread across the whole pool.
+//
+// A LuaEnvironment set to collect its garbage in idle time (see LuaEnvironment::SetIdleGarbageCollection()) is
+// added to the scheduler's idle queue after each of its slices.  A worker that finds no slice ready to run takes
+// the first LuaEnvironment from the idle queue and runs its garbage collector for one budget, putting it back at
+// the end of the queue until its collection cycle completes, before it goes to sleep.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+class LuaEnvironment;
+
+class LuaScheduler
+{
+    public:
+        LuaScheduler(uint32 workerCount = 0);
+        ~LuaScheduler();
+
+        int32 Start();
+        void Shutdown();
+        uint32 GetWorkerCount() { return m_WorkerCount; }
+
+        // Called by LuaEnvironment to have its next slice run by a worker thread.  The scheduler keeps
+        // a reference to the environment until the slice has run, so the owner may release it at any time:
+        void Schedule(boost::shared_ptr<LuaEnvironment> pLuaEnv);
+        void ScheduleAt(boost::shared_ptr<LuaEnvironment> pLuaEnv, boost::system_time wakeTime);
+
+        // Has the garbage of the environment collected by a worker thread with nothing else to do:
+        void ScheduleIdleWork(boost::shared_ptr<LuaEnvironment> pLuaEnv);
+
+    protected:
+        struct Worker
+        {
+            boost::mutex queue_mutex;
+            std::deque< boost::shared_ptr<LuaEnvironment> > readyQueue;
+            boost::thread * pThread;
+        };
+
+        void _WorkerProcess(uint32 workerIndex);
+        boost::shared_ptr<LuaEnvironment> _PopReady(uint32 workerIndex);
+        void _PushReady(uint32 workerIndex, boost::shared_ptr<LuaEnvironment> pLuaEnv);
+        void _WakeTimedEnvironments();
+        void _RemoveTimed(LuaEnvironment * pLuaEnv);
+        void _UpdateNextTimedWake();
+
+        uint32 m_WorkerCount;
+        boost::atomic<uint32> m_NextWorker;
+        bool m_bStarted;
+        std::vector<Worker *> m_Workers;
+
+        // Protects m_TimedQueue, m_IdleQueue and m_bShutdown, and is the mutex idle workers wait on:
+        boost::mutex scheduler_mutex;
+        boost::condition_variable scheduler_condition;
+
+        // Kept without scheduler_mutex, so that running a slice only ever locks the queues it pushes to and pops
+        // from; m_ReadyCount is never less than the number of entries in the readyQueues, and m_SleepingWorkers
+        // counts the workers waiting on scheduler_condition, which _PushReady() must wake:
+        boost::atomic<uint32> m_ReadyCount;
+        boost::atomic<uint32> m_SleepingWorkers;
+
+        // The first wake time in m_TimedQueue, in microseconds since m_EpochTime, so that workers only lock
+        // scheduler_mutex to wake the timed environments once one is due:
+        boost::system_time m_EpochTime;
+        boost::atomic<boost::int64_t> m_NextTimedWake;
+        // At most one entry per environment, see LuaEnvironment::m_bTimedQueued:
+        typedef std::multimap< boost::system_time, boost::shared_ptr<LuaEnvironment> > TimedQueue;
+        TimedQueue m_TimedQueue;
+        std::deque< boost::shared_ptr<LuaEnvironment> > m_IdleQueue;
+        boost::atomic<bool> m_bShutdown;        // Only set with scheduler_mutex held, read without it by Schedule()
+};
+
+#endif
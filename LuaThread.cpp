@@ -2,18 +2,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <fstream>
 #include "LuaThread.h"
+#include "LuaScheduler.h"
+#include "LuaLogWriter.h"
 
-LuaThread::LuaThread(std::string threadName, std::string scriptPath, std::string logFilePath, bool useThreading, bool scriptRepeat)
+// Deleter for shared pointers to objects owned by someone else:
+struct NullDeleter
+{
+    void operator()(void const *) const {}
+};
+
+LuaThread::LuaThread(std::string threadName, std::string scriptPath, std::string logFilePath, bool useThreading, bool scriptRepeat, LuaScheduler * pScheduler, LuaLogWriter * pLogWriter)
 {
     m_ThreadName = threadName;
     m_ScriptPath = scriptPath;
     m_LogFilePath = logFilePath;
     m_UseThreading = useThreading;
     m_pLogFile = NULL;
+    m_pLogWriter = pLogWriter;
+    m_LogId = LUALOGWRITER_INVALID_LOG;
+    m_ScriptId = LUALOG_NO_SCRIPT_ID;
+    m_LogLevel.store(int(LUALOG_TRACE));
     m_bLogFileUnavailable = false;
     m_MyScriptAccessCode = (rand() % 0xFFFF) + ((rand() % 0xFFFF) * 0x00010000);
 	m_scriptRepeat = scriptRepeat;
+    m_pScheduler = pScheduler;
+    m_pCompletionQueue = NULL;
+    m_pContextPool = NULL;
+    m_ScriptRunCount = 0;
+    m_MemoryLimitBytes = 0;
+    m_GCPausePercent = LUAI_GCPAUSE;
+    m_GCStepMultiplierPercent = LUAI_GCMUL;
+    m_bGenerationalGC = false;
+    m_IdleGCBudgetMicroSeconds = 0;
+    m_ProfilerInstructionsPerSample = 0;
+    m_bScriptExecutionComplete = false;
+    m_bScriptStarted = false;
 
     // Create LuaEnvironment object directly in this thread only if NOT using threading:
     if( !(m_UseThreading) )
@@ -31,10 +56,20 @@ LuaThread::LuaThread(std::string threadName, std::string scriptPath, std::string
     std::string logFile = m_LogFilePath;
     logFile += "/";
     logFile += m_ThreadName;
-    logFile += ".log";
-    m_pLogFile = fopen(logFile.c_str(), "w");
-    if( m_pLogFile == NULL )
-        m_bLogFileUnavailable = true;
+    if( m_pLogWriter != NULL )
+    {
+        logFile += m_pLogWriter->GetFileExtension();
+        m_LogId = m_pLogWriter->OpenLog(logFile, m_ThreadName);
+        if( m_LogId == LUALOGWRITER_INVALID_LOG )
+            m_bLogFileUnavailable = true;
+    }
+    else
+    {
+        logFile += ".log";
+        m_pLogFile = fopen(logFile.c_str(), "w");
+        if( m_pLogFile == NULL )
+            m_bLogFileUnavailable = true;
+    }
 
     _LogMessage("-------------------->>> LUA THREAD LOGGING INITIATED <<<--------------------");
     _LogMessage(m_ThreadName);
@@ -43,33 +78,82 @@ LuaThread::LuaThread(std::string threadName, std::string scriptPath, std::string
 
 LuaThread::~LuaThread()
 {
-    if( m_UseThreading )
+    if( m_UseThreading && (m_pScheduler != NULL) )
     {
-        // Destroy the LuaEnvironment thread:
-
-        //boost::this_thread::sleep(boost::posix_time::seconds(5));
-        m_pThread->~thread();
-
-        //delete m_pThread.get();
+        // Make sure no LuaScheduler worker touches the LuaEnvironment, or calls back to us, ever again:
+        if( m_pLuaEnvironment.get() != NULL )
+        {
+            m_pLuaEnvironment->TerminateThread(m_MyScriptAccessCode);
+            m_pLuaEnvironment->DetachScheduler();
+        }
+    }
+    else if( m_UseThreading )
+    {
+        // Terminate the LuaEnvironment thread and wait for it to end, since it owns the LuaEnvironment
+        // object and calls back to us:
+        if( m_pThread.get() != NULL )
+        {
+            if( m_pLuaEnvironment.get() != NULL )
+                m_pLuaEnvironment->TerminateThread(m_MyScriptAccessCode);
+            m_pThread->join();
+        }
+        m_pLuaEnvironment.reset();
     }
 
     //m_pLuaEnvironment->~LuaEnvironment();
 
-    if( m_pLogFile != NULL )
+    // Without threading the LuaEnvironment logs to us until it is destroyed, so that must happen before the log is closed:
+    m_pLuaEnvironment.reset();
+
+    if( !m_bLogFileUnavailable )
     {
-        // Close the log file that is currently open:
-        std::string logFileLine;
+        // Close the log file that is currently open, the LuaLogWriter closes it once it has written the messages queued before:
         _LogMessage("LuaThread: LOGGING SHUTTING DOWN");
-        fputs( logFileLine.c_str(), m_pLogFile );
-        fclose(m_pLogFile);
-		delete m_pLogFile;
+        if( m_pLogWriter != NULL )
+            m_pLogWriter->CloseLog(m_LogId);
+        else
+            fclose(m_pLogFile);
+        m_bLogFileUnavailable = true;
     }
 }
 
+LuaEnvironment * LuaThread::GetLuaEnv()
+{
+    return m_pLuaEnvironment.get();
+}
+
 int32 LuaThread::ExecuteScript(std::string scriptName)
 {
+    m_ScriptName = scriptName;
+    if( m_pLogWriter != NULL )
+        m_ScriptId = m_pLogWriter->InternScript(m_ScriptName);
+
+    // Hand a new LuaEnvironment object to the LuaScheduler's worker threads:
+    if( m_UseThreading && (m_pScheduler != NULL) )
+    {
+        m_pLuaEnvironment = boost::shared_ptr<LuaEnvironment>(new LuaEnvironment(m_ThreadName,m_ScriptPath,true));
+        m_pLuaEnvironment->SetThreadOwner(this);
+        m_pLuaEnvironment->SetScriptAccessCode(0,m_MyScriptAccessCode);
+        m_pLuaEnvironment->SetSleepInterval(5000);
+        m_pLuaEnvironment->SetContextPool(m_pContextPool);
+        m_pLuaEnvironment->SetMemoryLimit(m_MemoryLimitBytes);
+        m_pLuaEnvironment->SetGarbageCollectorTuning(m_GCPausePercent,m_GCStepMultiplierPercent);
+        m_pLuaEnvironment->SetGenerationalGarbageCollection(m_bGenerationalGC);
+        m_pLuaEnvironment->SetIdleGarbageCollection(m_IdleGCBudgetMicroSeconds);
+        m_pLuaEnvironment->SetProfiling(m_ProfilerInstructionsPerSample);
+
+        if( m_pLuaEnvironment->InitializeLuaEnvironment() <= 0 )
+            return 0;
+        if( m_pLuaEnvironment->ScheduleScript(m_pScheduler,scriptName,m_MyScriptAccessCode) <= 0 )
+            return 0;
+
+		_LogMessage("LuaThread: SUCCESS - LuaEnvironment handed to LuaScheduler!");
+        _SetScriptStartedFlag();
+
+		m_pLuaEnvironment->RunScriptProcess(m_MyScriptAccessCode,m_scriptRepeat);
+    }
     // Create a new thread into which the LuaEnvironment object is inserted and executed:
-    if( m_UseThreading )
+    else if( m_UseThreading )
     {
         // 1. Create instance of LuaEnvironment
         // 2. Create boost::thread and pass in copy of LuaEnvironment instance and functor parameters
@@ -78,13 +162,19 @@ int32 LuaThread::ExecuteScript(std::string scriptName)
 
         LuaEnvironment tempLuaEnv(m_ThreadName,m_ScriptPath,true);
 		tempLuaEnv.SetSleepInterval(5000);
+		tempLuaEnv.SetContextPool(m_pContextPool);
+		tempLuaEnv.SetMemoryLimit(m_MemoryLimitBytes);
+		tempLuaEnv.SetGarbageCollectorTuning(m_GCPausePercent,m_GCStepMultiplierPercent);
+		tempLuaEnv.SetGenerationalGarbageCollection(m_bGenerationalGC);
+		tempLuaEnv.SetIdleGarbageCollection(m_IdleGCBudgetMicroSeconds);
+		tempLuaEnv.SetProfiling(m_ProfilerInstructionsPerSample);
         m_pThread = boost::shared_ptr<boost::thread>(new boost::thread(tempLuaEnv, this, scriptName, m_MyScriptAccessCode));
 
         if( m_pThread == NULL )
             return 0;
         
         // Wait for newly created thread to take pointer to us, call
-        while( m_pLuaEnvironment == NULL );
+        WaitUntilStarted();
 
 		_LogMessage("LuaThread: SUCCESS - LuaEnvironment Thread called back with valid call pointer!");
 
@@ -96,6 +186,7 @@ int32 LuaThread::ExecuteScript(std::string scriptName)
         // Not using threading, so directly call ExecuteScript() with the script name:
         if (m_pLuaEnvironment->InitializeLuaEnvironment() <= 0)
             return 0;
+        _SetScriptStartedFlag();
         return m_pLuaEnvironment->ExecuteScript(scriptName,m_MyScriptAccessCode);
     }
 
@@ -114,7 +205,164 @@ int32 LuaThread::StopScript()
 
 bool LuaThread::HasScriptExecutedOnce()
 {
-	return m_bScriptExecutionComplete;
+	return _GetScriptCompleteFlag();
+}
+
+void LuaThread::SetCompletionQueue(LuaCompletionQueue * pCompletionQueue)
+{
+	m_pCompletionQueue = pCompletionQueue;
+}
+
+void LuaThread::SetContextPool(LuaContextPool * pContextPool)
+{
+	m_pContextPool = pContextPool;
+
+	// Without threading the LuaEnvironment already exists, but only takes its interpreter in ExecuteScript():
+	if( m_pLuaEnvironment.get() != NULL )
+		m_pLuaEnvironment->SetContextPool(m_pContextPool);
+}
+
+bool LuaThread::WaitUntilStarted(uint32 timeoutMilliSeconds)
+{
+	return _WaitForFlag(m_bScriptStarted, timeoutMilliSeconds);
+}
+
+bool LuaThread::WaitForCompletion(uint32 timeoutMilliSeconds)
+{
+	return _WaitForFlag(m_bScriptExecutionComplete, timeoutMilliSeconds);
+}
+
+int32 LuaThread::SignalScriptEvent(std::string eventName)
+{
+	return m_pLuaEnvironment->SignalScriptEvent(eventName,m_MyScriptAccessCode);
+}
+
+int32 LuaThread::SetMemoryLimit(uint32 maxBytes)
+{
+	m_MemoryLimitBytes = maxBytes;
+
+	// The LuaEnvironment already exists when not using threading, or once the script has been started:
+	if( m_pLuaEnvironment.get() != NULL )
+		return m_pLuaEnvironment->SetMemoryLimit(m_MemoryLimitBytes);
+	return 1;
+}
+
+int32 LuaThread::GetMemoryStatistics(Lua::LuaContext::MemoryStatistics & statistics)
+{
+	if( (m_pLuaEnvironment.get() == NULL) || (m_pLuaEnvironment->GetLua() == NULL) )
+	{
+		memset(&statistics, 0, sizeof(statistics));
+		return 0;
+	}
+
+	statistics = m_pLuaEnvironment->GetLua()->getMemoryStatistics();
+	return 1;
+}
+
+uint32 LuaThread::GetMemoryUsage()
+{
+	Lua::LuaContext::MemoryStatistics statistics;
+	GetMemoryStatistics(statistics);
+	return uint32(statistics.bytesInUse);
+}
+
+uint32 LuaThread::GetPeakMemoryUsage()
+{
+	Lua::LuaContext::MemoryStatistics statistics;
+	GetMemoryStatistics(statistics);
+	return uint32(statistics.peakBytesInUse);
+}
+
+uint32 LuaThread::GetGCCycleCount()
+{
+	Lua::LuaContext::MemoryStatistics statistics;
+	GetMemoryStatistics(statistics);
+	return uint32(statistics.gcCycles);
+}
+
+int32 LuaThread::SetGarbageCollectorTuning(int pausePercent, int stepMultiplierPercent)
+{
+	m_GCPausePercent = pausePercent;
+	m_GCStepMultiplierPercent = stepMultiplierPercent;
+
+	if( m_pLuaEnvironment.get() != NULL )
+		return m_pLuaEnvironment->SetGarbageCollectorTuning(m_GCPausePercent,m_GCStepMultiplierPercent);
+	return 1;
+}
+
+int32 LuaThread::SetGenerationalGarbageCollection(bool bEnabled)
+{
+	m_bGenerationalGC = bEnabled;
+
+	if( m_pLuaEnvironment.get() != NULL )
+		return m_pLuaEnvironment->SetGenerationalGarbageCollection(m_bGenerationalGC);
+	return 1;
+}
+
+int32 LuaThread::SetIdleGarbageCollection(uint32 budgetMicroSeconds)
+{
+	m_IdleGCBudgetMicroSeconds = budgetMicroSeconds;
+
+	// Without threading the LuaEnvironment already exists, but is only initialized by ExecuteScript():
+	if( m_pLuaEnvironment.get() != NULL )
+		return m_pLuaEnvironment->SetIdleGarbageCollection(m_IdleGCBudgetMicroSeconds);
+	return 1;
+}
+
+bool LuaThread::RunIdleGarbageCollection()
+{
+	// With threading, the thread running the LuaEnvironment already does this whenever it is idle:
+	if( m_UseThreading || (m_pLuaEnvironment.get() == NULL) )
+		return false;
+	return m_pLuaEnvironment->RunIdleGarbageCollection();
+}
+
+int32 LuaThread::SetProfiling(uint32 instructionsPerSample)
+{
+	m_ProfilerInstructionsPerSample = instructionsPerSample;
+
+	// The LuaEnvironment already exists when not using threading, or once the script has been started:
+	if( m_pLuaEnvironment.get() != NULL )
+		return m_pLuaEnvironment->SetProfiling(m_ProfilerInstructionsPerSample);
+	return 1;
+}
+
+int32 LuaThread::GetProfile(Lua::LuaContext::Profile & profile)
+{
+	if( (m_pLuaEnvironment.get() == NULL) || (m_pLuaEnvironment->GetLua() == NULL) )
+	{
+		profile = Lua::LuaContext::Profile();
+		return 0;
+	}
+
+	profile = m_pLuaEnvironment->GetLua()->getProfile();
+	return 1;
+}
+
+int32 LuaThread::WriteProfile(std::string fileName)
+{
+	Lua::LuaContext::Profile profile;
+	if( GetProfile(profile) <= 0 )
+		return 0;
+
+	if( fileName.empty() )
+		fileName = m_LogFilePath + "/" + m_ThreadName;
+
+	std::ofstream flatFile((fileName + ".profile").c_str(), std::ofstream::out | std::ofstream::trunc);
+	if( flatFile.fail() )
+		return 0;
+	flatFile << "Profile of script '" << m_ScriptName << "' (" << m_ThreadName << "): " << profile.samples << " samples";
+	if( profile.instructionsPerSample != 0 )
+		flatFile << ", one every " << profile.instructionsPerSample << " instructions";
+	flatFile << std::endl << std::endl;
+	profile.writeFlatProfile(flatFile);
+
+	std::ofstream stacksFile((fileName + ".folded").c_str(), std::ofstream::out | std::ofstream::trunc);
+	if( stacksFile.fail() )
+		return 0;
+	profile.writeCollapsedStacks(stacksFile);
+
+	return (flatFile.good() && stacksFile.good()) ? 1 : 0;
 }
 
 int32 LuaThread::KillScript()
@@ -131,7 +379,10 @@ int32 LuaThread::PingScript()
 
 bool LuaThread::DoesLuaVariableExist(std::string varName)
 {
-	return m_pLuaEnvironment->GetLua()->doesVariableExist(varName);
+	if( _GetLua() == NULL )
+		return false;
+
+	return _GetLua()->doesVariableExist(varName);
 }
 
 std::string LuaThread::GetString(std::string varName)
@@ -191,10 +442,160 @@ int32 LuaThread::SetBool(std::string varName, bool boolVal)
 		return -1;
 }
 
-int32 LuaThread::Script_ExecutionComplete(uint32 accessCode)
+int32 LuaThread::QueueSetDouble(std::string varName, double doubleVal)
+{
+	return m_pLuaEnvironment->QueueSetDouble(varName, doubleVal, m_MyScriptAccessCode);
+}
+
+int32 LuaThread::QueueSetBool(std::string varName, bool boolVal)
+{
+	return m_pLuaEnvironment->QueueSetBool(varName, boolVal, m_MyScriptAccessCode);
+}
+
+int32 LuaThread::QueueSetString(std::string varName, std::string strVal)
+{
+	return m_pLuaEnvironment->QueueSetString(varName, strVal, m_MyScriptAccessCode);
+}
+
+int32 LuaThread::QueueCallFunction(std::string functionName)
+{
+	return m_pLuaEnvironment->QueueCallFunction(functionName, m_MyScriptAccessCode);
+}
+
+int32 LuaThread::GetVariables(std::vector<Lua::LuaContext::BatchVariable> & variables)
+{
+	if( _GetLua() == NULL )
+	{
+		for( uint32 i = 0; i < variables.size(); i++ )
+			variables[i].exists = false;
+		return 0;
+	}
+
+	_GetLua()->readVariables(variables);
+
+	int32 existingCount = 0;
+	for( uint32 i = 0; i < variables.size(); i++ )
+		if( variables[i].exists )
+			existingCount++;
+	return existingCount;
+}
+
+int32 LuaThread::SetVariables(std::vector<Lua::LuaContext::BatchVariable> & variables)
+{
+	if( _GetLua() == NULL )
+	{
+		for( uint32 i = 0; i < variables.size(); i++ )
+			variables[i].exists = false;
+		return 0;
+	}
+
+	_GetLua()->writeVariables(variables, true);
+
+	int32 existingCount = 0;
+	for( uint32 i = 0; i < variables.size(); i++ )
+		if( variables[i].exists )
+			existingCount++;
+	return existingCount;
+}
+
+Lua::LuaContext::VariablePath LuaThread::CompileVariablePath(std::string varName)
+{
+	if( _GetLua() == NULL )
+		return Lua::LuaContext::VariablePath();		// Not valid, see VariablePath::isValid()
+
+	return _GetLua()->compileVariablePath(varName);
+}
+
+void LuaThread::ReleaseVariablePath(Lua::LuaContext::VariablePath & varPath)
+{
+	if( _GetLua() != NULL )
+		_GetLua()->releaseVariablePath(varPath);
+}
+
+bool LuaThread::DoesLuaVariableExist(const Lua::LuaContext::VariablePath & varPath)
+{
+	if( _GetLua() == NULL )
+		return false;
+
+	return _GetLua()->doesVariableExist(varPath);
+}
+
+std::string LuaThread::GetString(const Lua::LuaContext::VariablePath & varPath)
+{
+	if( DoesLuaVariableExist(varPath) )
+		return m_pLuaEnvironment->GetLua()->readVariable<std::string>(varPath);
+	else
+		return "variable does not exist!";
+}
+
+double LuaThread::GetDouble(const Lua::LuaContext::VariablePath & varPath)
+{
+	if( DoesLuaVariableExist(varPath) )
+	    return m_pLuaEnvironment->GetLua()->readVariable<double>(varPath);
+	else
+		return -1.0;
+}
+
+bool LuaThread::GetBool(const Lua::LuaContext::VariablePath & varPath)
+{
+	if( DoesLuaVariableExist(varPath) )
+	    return m_pLuaEnvironment->GetLua()->readVariable<bool>(varPath);
+	else
+		return false;
+}
+
+int32 LuaThread::SetString(const Lua::LuaContext::VariablePath & varPath, std::string strVal)
+{
+	if( DoesLuaVariableExist(varPath) )
+	{
+		m_pLuaEnvironment->GetLua()->writeVariable(varPath, std::string(strVal));
+		return 0;
+	}
+	else
+		return -1;
+}
+
+int32 LuaThread::SetDouble(const Lua::LuaContext::VariablePath & varPath, double doubleVal)
+{
+	if( DoesLuaVariableExist(varPath) )
+	{
+		m_pLuaEnvironment->GetLua()->writeVariable(varPath, double(doubleVal));
+	    return 0;
+	}
+	else
+		return -1;
+}
+
+int32 LuaThread::SetBool(const Lua::LuaContext::VariablePath & varPath, bool boolVal)
+{
+	if( DoesLuaVariableExist(varPath) )
+	{
+		m_pLuaEnvironment->GetLua()->writeVariable(varPath, bool(boolVal));
+	    return 0;
+	}
+	else
+		return -1;
+}
+
+int32 LuaThread::Script_ExecutionComplete(uint32 accessCode, uint32 durationMicroSeconds, std::string errorMessage)
 {
     if( accessCode == m_MyScriptAccessCode )
 	{
+        m_ScriptRunCount++;
+        m_Metrics.RecordRun(durationMicroSeconds, !(errorMessage.empty()));
+        if( m_pCompletionQueue != NULL )
+        {
+            LuaCompletionEvent completionEvent;
+            completionEvent.pLuaThread = this;
+            completionEvent.threadName = m_ThreadName;
+            completionEvent.scriptName = m_ScriptName;
+            completionEvent.runCount = m_ScriptRunCount;
+            completionEvent.durationMicroSeconds = durationMicroSeconds;
+            completionEvent.bError = !(errorMessage.empty());
+            completionEvent.errorMessage = errorMessage;
+            m_pCompletionQueue->Post(completionEvent);
+        }
+
         _SetScriptCompleteFlag();
         if( !m_UseThreading )
             // Threading not being used, so on script execution complete, decide whether to send Stop() command to LuaEnvironment:
@@ -218,6 +619,18 @@ int32 LuaThread::Script_LogMessage(std::string logMessage, uint32 accessCode)
     return 1;
 }
 
+int32 LuaThread::Script_LogMessage(LuaLogLevels level, const char * format, const LuaLogArgs & args, uint32 accessCode)
+{
+    if( accessCode == m_MyScriptAccessCode )
+    {
+        _LogMessage(level, format, args);
+    }
+    else
+        return -1;
+
+    return 1;
+}
+
 int32 LuaThread::Script_SetOwnedLuaEnvironment(LuaEnvironment * luaenv, uint32 accessCode)
 {
     if( luaenv == NULL )
@@ -227,8 +640,14 @@ int32 LuaThread::Script_SetOwnedLuaEnvironment(LuaEnvironment * luaenv, uint32 a
 	}
 
 	_LogMessage("LuaThread: SUCCESS - LuaEnvironment callback pointer set!");
-    m_pLuaEnvironment = boost::shared_ptr<LuaEnvironment>(luaenv);
-    
+
+    // The LuaEnvironment object lives inside the boost::thread, which destroys it, so it must not be deleted through m_pLuaEnvironment:
+    {
+        boost::mutex::scoped_lock lock(script_complete_mutex);
+        m_pLuaEnvironment = boost::shared_ptr<LuaEnvironment>(luaenv, NullDeleter());
+    }
+    _SetScriptStartedFlag();
+
     return 1;
 }
 
@@ -236,14 +655,71 @@ int32 LuaThread::Script_SetOwnedLuaEnvironment(LuaEnvironment * luaenv, uint32 a
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Protected and Private Member Functions:
 
+Lua::LuaContext * LuaThread::_GetLua()
+{
+	// There is no interpreter before ExecuteScript(), nor when it could not be created:
+	if( m_pLuaEnvironment.get() == NULL )
+		return NULL;
+
+	return m_pLuaEnvironment->GetLua();
+}
+
+bool LuaThread::_WaitForFlag(bool & flag, uint32 timeoutMilliSeconds)
+{
+    boost::mutex::scoped_lock lock(script_complete_mutex);
+
+    if( timeoutMilliSeconds == LUATHREAD_WAIT_FOREVER )
+    {
+        while( !flag )
+            script_state_condition.wait(lock);
+        return true;
+    }
+
+    boost::system_time const timeout = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMilliSeconds);
+    while( !flag )
+        if( !script_state_condition.timed_wait(lock, timeout) )
+            return flag;
+
+    return true;
+}
+
 void LuaThread::_LogMessage(std::string logMessage)
 {
+    if( m_bLogFileUnavailable )
+        return;
+
+    // Queue the message for the LuaLogWriter's thread, which stamps it with the current time:
+    if( m_pLogWriter != NULL )
+    {
+        m_pLogWriter->Write(m_LogId, logMessage);
+        return;
+    }
+
     // print to log file using 'logMessage' string
+    char timestamp[LUALOGWRITER_TIMESTAMP_SIZE];
+    LuaLogWriter::FormatTimestamp(boost::get_system_time(), timestamp);
 	boost::mutex::scoped_lock lock(script_log_output_mutex);
     std::string logFileLine;
-    logFileLine = "[2012-04-30] [HH:MM:SS] ";
+    logFileLine = timestamp;
     logFileLine += logMessage;
     logFileLine += "\n";
     fputs( logFileLine.c_str(), m_pLogFile );
     fflush( m_pLogFile );
 }
+
+void LuaThread::_LogMessage(LuaLogLevels level, const char * format, const LuaLogArgs & args)
+{
+    if( m_bLogFileUnavailable )
+        return;
+
+    // The LuaLogWriter's thread formats the message, or never does when it writes a binary log:
+    if( m_pLogWriter != NULL )
+    {
+        m_pLogWriter->Write(m_LogId, level, m_ScriptId, format, args);
+        return;
+    }
+
+    std::string logMessage = LuaLogWriter::GetLevelTag(level);
+    LuaLogArgs::Render(format, args.GetPacked().data(), args.GetPacked().size(), logMessage);
+    _LogMessage(logMessage);
+}
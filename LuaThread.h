@@ -1,11 +1,18 @@
 
+#ifdef _WIN32
 #include "StdAfx.h"
+#endif
 #include "EVEmu_Types.h"
+#include "LuaCompletionQueue.h"
+#include "LuaLogWriter.h"
+#include "LuaMetrics.h"
 
-#include "..\common\boost\boost\thread\thread.hpp"
-#include "..\common\boost\boost\thread\mutex.hpp"
-#include "..\common\boost\boost\thread\locks.hpp"
-#include "..\common\boost\boost\type_traits.hpp"
+#include "../common/boost/boost/thread/thread.hpp"
+#include "../common/boost/boost/thread/mutex.hpp"
+#include "../common/boost/boost/thread/locks.hpp"
+#include "../common/boost/boost/thread/condition_variable.hpp"
+#include "../common/boost/boost/type_traits.hpp"
+#include "../common/boost/boost/atomic.hpp"
 
 #pragma once
 #include "LuaEnvironment.h"
@@ -33,17 +40,27 @@
 
 
 class LuaEnvironment;
+class LuaScheduler;
+class LuaContextPool;
+
+#define LUATHREAD_WAIT_FOREVER      0xFFFFFFFF      // Timeout for WaitUntilStarted() and WaitForCompletion() that never expires
+#define LUATHREAD_PROFILER_INTERVAL 10000           // Instructions between the profiler's samples suited to a live server
 
 // This class is an owner of a single Lua interpreter instance.
 // It either creates one directly in the same process/thread as
 // this class instance, or when 'useThreading' is set to 'true',
 // it creates a new boost::thread which contains the lua interpreter
-// instance.
+// instance.  When 'useThreading' is set to 'true' and a LuaScheduler
+// is given, no thread is created, the lua interpreter instance is
+// run by the LuaScheduler's pool of worker threads instead.
+// When a LuaLogWriter is given, the log file is written by the
+// LuaLogWriter's thread, otherwise every message is written to the
+// file by the thread logging it.
 
 class LuaThread
 {
     public:
-        LuaThread(std::string threadName, std::string scriptPath, std::string logFilePath, bool useThreading = false, bool scriptRepeat = false);
+        LuaThread(std::string threadName, std::string scriptPath, std::string logFilePath, bool useThreading = false, bool scriptRepeat = false, LuaScheduler * pScheduler = NULL, LuaLogWriter * pLogWriter = NULL);
         ~LuaThread();
 
         LuaEnvironment * GetLuaEnv();
@@ -53,6 +70,53 @@ class LuaThread
 		int32 ResumeScript();
 		int32 StopScript();
 		bool HasScriptExecutedOnce();
+		void SetCompletionQueue(LuaCompletionQueue * pCompletionQueue);   // Call BEFORE ExecuteScript(), see LuaCompletionQueue.h
+		void SetContextPool(LuaContextPool * pContextPool);               // Call BEFORE ExecuteScript(), see LuaContextPool.h
+
+        // Script Management - Handshakes:
+        // (these block the calling thread without using any CPU time until the LuaEnvironment has been created, its lua
+        // interpreter initialized and its script handed to it, or until the script has completed at least one run; they return false if the timeout, in milliseconds,
+        // expired first)
+        bool WaitUntilStarted(uint32 timeoutMilliSeconds = LUATHREAD_WAIT_FOREVER);
+        bool WaitForCompletion(uint32 timeoutMilliSeconds = LUATHREAD_WAIT_FOREVER);
+		int32 SignalScriptEvent(std::string eventName);		// Resumes script instances suspended in waitEvent(eventName)
+
+        // Memory Management:
+        // (SetMemoryLimit() may be called before or after ExecuteScript(), a script going over the limit ends with a
+        // "not enough memory" error; the Get...() functions return 0 until the lua interpreter has been created)
+        int32 SetMemoryLimit(uint32 maxBytes);     // 0 means no limit, which is the default
+        int32 GetMemoryStatistics(Lua::LuaContext::MemoryStatistics & statistics);
+        uint32 GetMemoryUsage();
+        uint32 GetPeakMemoryUsage();
+        uint32 GetGCCycleCount();
+
+        // Garbage Collection:
+        // (see the note on garbage collection in LuaEnvironment.h; SetIdleGarbageCollection() must be called BEFORE
+        // ExecuteScript(), and without threading the idle time is given by calling RunIdleGarbageCollection())
+        int32 SetGarbageCollectorTuning(int pausePercent, int stepMultiplierPercent);
+        int32 SetGenerationalGarbageCollection(bool bEnabled);         // false (incremental) is the default
+        int32 SetIdleGarbageCollection(uint32 budgetMicroSeconds);     // 0 collects while the script runs, which is the default
+        bool RunIdleGarbageCollection();
+
+        // Metrics:
+        // (see LuaMetrics.h; LuaThreadMetrics::GetTotals() adds up the metrics of every LuaThread)
+        void GetMetricsSnapshot(LuaMetricsSnapshot & snapshot) { m_Metrics.GetSnapshot(snapshot); }
+        LuaThreadMetrics * GetMetrics() { return &m_Metrics; }
+
+        // Profiling:
+        // (see the note on profiling in LuaEnvironment.h; SetProfiling() may be called before or after ExecuteScript(),
+        // and the profile is kept once the profiler is stopped; WriteProfile() writes the flat profile to
+        // 'fileName'.profile and the collapsed stacks to 'fileName'.folded, by default in the log directory under the
+        // thread's name, it returns 0 when there is nothing to write or a file could not be written)
+        int32 SetProfiling(uint32 instructionsPerSample = LUATHREAD_PROFILER_INTERVAL);   // 0 stops the profiler
+        int32 GetProfile(Lua::LuaContext::Profile & profile);
+        int32 WriteProfile(std::string fileName = "");
+
+        // Logging:
+        // (the LuaEnvironment's diagnostics below this level are not logged, on top of those compiled out below
+        // LUALOG_MIN_LEVEL; the default LUALOG_TRACE logs every one compiled in)
+        void SetLogLevel(LuaLogLevels minimumLevel) { m_LogLevel.store(int(minimumLevel), boost::memory_order_relaxed); }
+        LuaLogLevels GetLogLevel() { return LuaLogLevels(m_LogLevel.load(boost::memory_order_relaxed)); }
 
         // Script Management - Threading Enabled Use Only!
         int32 KillScript();		// Only used for threaded scripts
@@ -67,21 +131,74 @@ class LuaThread
         int32 SetDouble(std::string varName, double doubleVal);
         int32 SetBool(std::string varName, bool boolVal);
 
+        // Accessing Lua Internals - Queued Commands:
+        // (these return right away without waiting for the lua interpreter, the variable is written or the function
+        // called by the script's thread before it next runs the script; names are limited to LUA_COMMAND_MAX_NAME_LENGTH)
+        int32 QueueSetDouble(std::string varName, double doubleVal);
+        int32 QueueSetBool(std::string varName, bool boolVal);
+        int32 QueueSetString(std::string varName, std::string strVal);
+        int32 QueueCallFunction(std::string functionName);
+
+        // Accessing Lua Internals - Batches:
+        // (reads or writes all the variables under a single lock of the lua interpreter instead of two per variable,
+        // each entry's 'exists' flag is set like DoesLuaVariableExist(); SetVariables() only writes variables that exist,
+        // like the Set...() functions; both return the number of variables that exist)
+        int32 GetVariables(std::vector<Lua::LuaContext::BatchVariable> & variables);
+        int32 SetVariables(std::vector<Lua::LuaContext::BatchVariable> & variables);
+
+        // Accessing Lua Internals - Compiled Variable Names:
+        // (for variables accessed every tick; compile the name once after ExecuteScript() and release it before the
+        // LuaThread is destroyed, the accessors below then skip splitting and interning the name on every call)
+        Lua::LuaContext::VariablePath CompileVariablePath(std::string varName);
+        void ReleaseVariablePath(Lua::LuaContext::VariablePath & varPath);
+		bool DoesLuaVariableExist(const Lua::LuaContext::VariablePath & varPath);
+        std::string GetString(const Lua::LuaContext::VariablePath & varPath);
+        double GetDouble(const Lua::LuaContext::VariablePath & varPath);
+        bool GetBool(const Lua::LuaContext::VariablePath & varPath);
+        int32 SetString(const Lua::LuaContext::VariablePath & varPath, std::string strVal);
+        int32 SetDouble(const Lua::LuaContext::VariablePath & varPath, double doubleVal);
+        int32 SetBool(const Lua::LuaContext::VariablePath & varPath, bool boolVal);
+
         // Thread-initiated calls to us:
         // (DO NOT USE THESE FROM ANY CLASS OR FUNCTION OTHER THAN LuaEnvironment)
-        int32 Script_ExecutionComplete(uint32 accessCode = 0);
+        int32 Script_ExecutionComplete(uint32 accessCode = 0, uint32 durationMicroSeconds = 0, std::string errorMessage = "");
         int32 Script_LogMessage(std::string logMessage, uint32 accessCode = 0);
+        int32 Script_LogMessage(LuaLogLevels level, const char * format, const LuaLogArgs & args, uint32 accessCode = 0);   // See LuaLogWriter.h
         int32 Script_SetOwnedLuaEnvironment(LuaEnvironment * luaenv, uint32 accessCode = 0);
 
     protected:
         void _LogMessage(std::string logMessage);
+        void _LogMessage(LuaLogLevels level, const char * format, const LuaLogArgs & args);
+
+        bool _WaitForFlag(bool & flag, uint32 timeoutMilliSeconds);
+
+        // The interpreter of the script, NULL before ExecuteScript() or before the LuaEnvironment's thread has created it:
+        Lua::LuaContext * _GetLua();
 
         // Mutex-protected Flag Modifier Functions:
-        bool _GetScriptCompleteFlag() { return m_bScriptExecutionComplete; };
+        bool _GetScriptCompleteFlag()
+        {
+        	boost::mutex::scoped_lock lock(script_complete_mutex);
+            return m_bScriptExecutionComplete;
+        }
+
 		uint32 _SetScriptCompleteFlag()
 		{
-        	boost::mutex::scoped_lock lock(script_complete_mutex);
-		    m_bScriptExecutionComplete = true;
+			{
+	        	boost::mutex::scoped_lock lock(script_complete_mutex);
+			    m_bScriptExecutionComplete = true;
+			}
+			script_state_condition.notify_all();
+			return 1;
+		}
+
+		uint32 _SetScriptStartedFlag()
+		{
+			{
+	        	boost::mutex::scoped_lock lock(script_complete_mutex);
+			    m_bScriptStarted = true;
+			}
+			script_state_condition.notify_all();
 			return 1;
 		}
 
@@ -96,22 +213,39 @@ class LuaThread
 		std::string m_ScriptPath;
         std::string m_ScriptName;
         std::string m_LogFilePath;
-        FILE * m_pLogFile;
+        FILE * m_pLogFile;                  // Only used without a LuaLogWriter
+        LuaLogWriter * m_pLogWriter;
+        uint32 m_LogId;                     // Our log file's id in m_pLogWriter
+        uint32 m_ScriptId;                  // m_ScriptName's id in m_pLogWriter
+        boost::atomic<int> m_LogLevel;      // A LuaLogLevels, read by the LuaEnvironment's thread
         bool m_UseThreading;
         uint32 m_MyScriptAccessCode;
         bool m_bLogFileUnavailable;
 		bool m_scriptRepeat;
+        LuaScheduler * m_pScheduler;
+        LuaCompletionQueue * m_pCompletionQueue;
+        LuaContextPool * m_pContextPool;
+        uint32 m_ScriptRunCount;            // Only modified by the thread running the script
+        uint32 m_MemoryLimitBytes;          // Given to every LuaEnvironment created by ExecuteScript()
+        int m_GCPausePercent;               // Same
+        int m_GCStepMultiplierPercent;      // Same
+        bool m_bGenerationalGC;             // Same
+        uint32 m_IdleGCBudgetMicroSeconds;  // Same
+        uint32 m_ProfilerInstructionsPerSample; // Same
+        LuaThreadMetrics m_Metrics;
 
         boost::shared_ptr<LuaEnvironment> m_pLuaEnvironment;
         boost::shared_ptr<boost::thread> m_pThread;
 
 		// Thread Mutexes and Mutex-protected Flags:
-		boost::mutex script_complete_mutex;
-        boost::mutex script_log_output_mutex;
+		boost::mutex script_complete_mutex;                 // Also protects m_bScriptStarted and m_pLuaEnvironment being set by the thread
+		boost::condition_variable script_state_condition;   // Notified when m_bScriptStarted or m_bScriptExecutionComplete is set
+        boost::mutex script_log_output_mutex;              // Only used without a LuaLogWriter
 
 		// DO NOT Modify these directly, use their modifier functions even inside this class!
         // DO NOT Reference these directly either, use their Get() functions even inside this class!
 		bool m_bScriptExecutionComplete;
+		bool m_bScriptStarted;
 };
 
 #endif
@@ -0,0 +1,549 @@
+// LuaBenchmark.cpp : Benchmarks of the LuaContext marshalling and of the LuaThread dispatch.
+//
+// Built by the LuaThreadBenchmark project, or on Linux from the LuaThread directory (with boost in ../common/boost,
+// like for the Windows build) by compiling every lua/src/*.c file except lua.c and luac.c with
+// 'gcc -O2 -DLUA_GCTIMING -c', as the projects do, so lua times its garbage collection for the metrics, then:
+//
+//   g++ -std=c++11 -O2 -I../common/boost -o luathread_benchmark benchmark/LuaBenchmark.cpp LuaCommandRing.cpp
+//       LuaCompletionQueue.cpp LuaContextPool.cpp LuaEnvironment.cpp LuaLogWriter.cpp LuaMetrics.cpp
+//       LuaScheduler.cpp LuaThread.cpp luawrapper/LuaAllocator.cpp luawrapper/LuaContext.cpp lua/src/*.o
+//       -lboost_thread -lboost_system -lpthread
+//
+// Usage: luathread_benchmark [-o resultFile] [-d workDirectory] [-t maxLuaThreads] [-m minSampleMilliSeconds]
+//                            [-s sampleCount] [-v] [benchmarkName ...]
+//
+// Every benchmark is run with enough iterations for one sample to take at least the minimum sample time, then
+// sampled 'sampleCount' times.  The results are written as CSV, one line per benchmark variant, to the result file
+// or to stdout:
+//
+//   benchmark,variant,iterations,ns_per_op_min,ns_per_op_median,ops_per_second
+//
+// The scripts and the LuaThread logs are written under the work directory, ./luathread_benchmark_files by default.
+//
+// The LuaEnvironment diagnostics written to std::cout are switched off while the benchmarks run, since writing to
+// the console would take most of the time measured, unless -v is given.  Progress is written to stderr.  Only the
+// benchmarks whose name contains one of the given names are run, all of them if none is given.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#include "../LuaThread.h"
+#include "../LuaScheduler.h"
+#include "../LuaContextPool.h"
+#include "../LuaCompletionQueue.h"
+
+struct BenchmarkResult
+{
+    std::string benchmark;
+    std::string variant;
+    uint32 iterations;
+    double nsPerOpMin;
+    double nsPerOpMedian;
+};
+
+static FILE * g_pResultFile = stdout;
+static std::vector<std::string> g_BenchmarkFilters;
+static std::string g_WorkPath = "./luathread_benchmark_files";    // Must not be the name of the executable
+static std::string g_ScriptPath;
+static std::string g_LogPath;
+static uint32 g_MaxLuaThreads = 0;
+static uint32 g_MinSampleMicroSeconds = 100000;
+static uint32 g_SampleCount = 5;
+
+static void MakeDirectory(const std::string & path)
+{
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+static bool IsBenchmarkSelected(const std::string & benchmark)
+{
+    if( g_BenchmarkFilters.empty() )
+        return true;
+
+    for( uint32 i = 0; i < g_BenchmarkFilters.size(); i++ )
+        if( benchmark.find(g_BenchmarkFilters[i]) != std::string::npos )
+            return true;
+
+    return false;
+}
+
+static bool WriteScript(const std::string & scriptName, const std::string & source)
+{
+    std::ofstream scriptStream((g_ScriptPath + "/" + scriptName).c_str(), std::ofstream::out | std::ofstream::trunc);
+    scriptStream << source;
+    return !(scriptStream.fail());
+}
+
+static void ReportResult(const BenchmarkResult & result)
+{
+    double opsPerSecond = (result.nsPerOpMedian > 0.0) ? (1000000000.0 / result.nsPerOpMedian) : 0.0;
+    fprintf(g_pResultFile, "%s,%s,%lu,%.1f,%.1f,%.1f\n", result.benchmark.c_str(), result.variant.c_str(),
+        (unsigned long)result.iterations, result.nsPerOpMin, result.nsPerOpMedian, opsPerSecond);
+    fflush(g_pResultFile);
+
+    fprintf(stderr, "  %-18s %-24s %12.1f ns/op\n", result.benchmark.c_str(), result.variant.c_str(), result.nsPerOpMedian);
+}
+
+// Times 'body', which is called with the number of operations to run.  The count is doubled until one call takes
+// at least the minimum sample time, then that many operations are timed 'g_SampleCount' times:
+template<typename Body>
+static void Measure(const std::string & benchmark, const std::string & variant, Body body)
+{
+    uint32 iterations = 1;
+    uint32 elapsedMicroSeconds = 0;
+    while( true )
+    {
+        boost::system_time const startTime = boost::get_system_time();
+        body(iterations);
+        elapsedMicroSeconds = (uint32)((boost::get_system_time() - startTime).total_microseconds());
+        if( (elapsedMicroSeconds >= g_MinSampleMicroSeconds) || (iterations >= 0x40000000) )
+            break;
+
+        // Jump close to the target right away once the count is large enough for the time to mean something:
+        if( elapsedMicroSeconds >= 1000 )
+        {
+            double scale = (1.2 * g_MinSampleMicroSeconds) / elapsedMicroSeconds;
+            iterations = (uint32)(std::min(iterations * scale, 1073741824.0));
+        }
+        else
+            iterations *= 2;
+    }
+
+    std::vector<double> nsPerOp;
+    for( uint32 i = 0; i < g_SampleCount; i++ )
+    {
+        boost::system_time const startTime = boost::get_system_time();
+        body(iterations);
+        elapsedMicroSeconds = (uint32)((boost::get_system_time() - startTime).total_microseconds());
+        nsPerOp.push_back((elapsedMicroSeconds * 1000.0) / iterations);
+    }
+    std::sort(nsPerOp.begin(), nsPerOp.end());
+
+    BenchmarkResult result;
+    result.benchmark = benchmark;
+    result.variant = variant;
+    result.iterations = iterations;
+    result.nsPerOpMin = nsPerOp.front();
+    result.nsPerOpMedian = nsPerOp[nsPerOp.size() / 2];
+    ReportResult(result);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// LuaContext Marshalling:
+
+static void BenchmarkReadVariable()
+{
+    Lua::LuaContext lua;
+    lua.executeCode("number = 42.5 text = 'the quick brown fox' npc = { target = { distance = 1200.0 } }");
+
+    const std::string numberName = "number";
+    const std::string textName = "text";
+    const std::string nestedName = "npc.target.distance";
+    Lua::LuaContext::VariablePath nestedPath = lua.compileVariablePath(nestedName);
+    double sum = 0.0;
+    size_t length = 0;
+
+    Measure("read_variable", "number", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+            sum += lua.readVariable<double>(numberName);
+    });
+    Measure("read_variable", "string", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+            length += lua.readVariable<std::string>(textName).size();
+    });
+    Measure("read_variable", "nested_number", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+            sum += lua.readVariable<double>(nestedName);
+    });
+    Measure("read_variable", "compiled_path_number", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+            sum += lua.readVariable<double>(nestedPath);
+    });
+
+    lua.releaseVariablePath(nestedPath);
+    if( (sum < 0.0) || (length == 0) )
+        fprintf(stderr, "read_variable: unexpected values read\n");
+}
+
+static void BenchmarkWriteVariable()
+{
+    Lua::LuaContext lua;
+    lua.executeCode("number = 0 text = '' npc = { target = { distance = 0 } }");
+
+    const std::string numberName = "number";
+    const std::string textName = "text";
+    const std::string nestedName = "npc.target.distance";
+    const std::string textValue = "the quick brown fox";
+    Lua::LuaContext::VariablePath nestedPath = lua.compileVariablePath(nestedName);
+
+    Measure("write_variable", "number", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+            lua.writeVariable(numberName, double(i));
+    });
+    Measure("write_variable", "string", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+            lua.writeVariable(textName, textValue);
+    });
+    Measure("write_variable", "nested_number", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+            lua.writeVariable(nestedName, double(i));
+    });
+    Measure("write_variable", "compiled_path_number", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+            lua.writeVariable(nestedPath, double(i));
+    });
+
+    lua.releaseVariablePath(nestedPath);
+}
+
+static double CallLuaFunctionWithArgs(Lua::LuaContext & lua, const std::string & functionName, uint32 argCount)
+{
+    double a = 1.0;
+    switch( argCount )
+    {
+        case 0:  return lua.callLuaFunction<double>(functionName);
+        case 1:  return lua.callLuaFunction<double>(functionName, a);
+        case 2:  return lua.callLuaFunction<double>(functionName, a, a);
+        case 3:  return lua.callLuaFunction<double>(functionName, a, a, a);
+        case 4:  return lua.callLuaFunction<double>(functionName, a, a, a, a);
+        case 5:  return lua.callLuaFunction<double>(functionName, a, a, a, a, a);
+        case 6:  return lua.callLuaFunction<double>(functionName, a, a, a, a, a, a);
+        case 7:  return lua.callLuaFunction<double>(functionName, a, a, a, a, a, a, a);
+        case 8:  return lua.callLuaFunction<double>(functionName, a, a, a, a, a, a, a, a);
+        default: return lua.callLuaFunction<double>(functionName, a, a, a, a, a, a, a, a, a);
+    }
+}
+
+static void BenchmarkCallLuaFunction()
+{
+    Lua::LuaContext lua;
+    lua.executeCode("function count(...) return select('#', ...) end");
+
+    const std::string functionName = "count";
+    for( uint32 argCount = 0; argCount <= 9; argCount++ )
+    {
+        double sum = 0.0;
+        std::ostringstream variant;
+        variant << "args" << argCount;
+        Measure("call_lua_function", variant.str(), [&](uint32 iterations) {
+            for( uint32 i = 0; i < iterations; i++ )
+                sum += CallLuaFunctionWithArgs(lua, functionName, argCount);
+        });
+
+        if( sum == 0.0 && argCount > 0 )
+            fprintf(stderr, "call_lua_function: the arguments did not reach the function\n");
+    }
+}
+
+static void BenchmarkCppCallback()
+{
+    Lua::LuaContext lua;
+    double sum = 0.0;
+
+    // The time of one call is taken from a loop run by the script, the lua_function variant gives the cost of the same
+    // loop calling a Lua function instead, for comparison:
+    lua.writeVariable("callback0", std::function<void ()>([&]() { sum += 1.0; }));
+    lua.writeVariable("callback1", std::function<double (double)>([&](double x) { sum += x; return x; }));
+    lua.writeVariable("callback3", std::function<double (double, double, double)>([&](double x, double y, double z) { sum += x; return x + y + z; }));
+    lua.executeCode(
+        "function luaFunction1(x) return x end\n"
+        "function runCallback0(n) local f = callback0 for i = 1, n do f() end end\n"
+        "function runCallback1(n) local f = callback1 for i = 1, n do f(i) end end\n"
+        "function runCallback3(n) local f = callback3 for i = 1, n do f(i, i, i) end end\n"
+        "function runLuaFunction1(n) local f = luaFunction1 for i = 1, n do f(i) end end\n");
+
+    const char * variants[][2] = {
+        { "args0", "runCallback0" },
+        { "args1", "runCallback1" },
+        { "args3", "runCallback3" },
+        { "lua_function_args1", "runLuaFunction1" }
+    };
+    for( uint32 i = 0; i < sizeof(variants) / sizeof(variants[0]); i++ )
+    {
+        const std::string functionName = variants[i][1];
+        Measure("cpp_callback", variants[i][0], [&](uint32 iterations) {
+            lua.callLuaFunction<void>(functionName, double(iterations));
+        });
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// LuaThread Dispatch:
+
+static const char * g_SpawnScript = "spawn.lua";
+static const char * g_RepeatScript = "repeat.lua";
+static const char * g_WorkScript = "work.lua";
+
+static bool WriteBenchmarkScripts()
+{
+    if( !WriteScript(g_SpawnScript,
+        "state = 'idle'\n"
+        "function onTick(dt) if state == 'idle' then state = 'patrol' end end\n"
+        "onTick(0)\n") )
+        return false;
+    if( !WriteScript(g_RepeatScript,
+        "runs = (runs or 0) + 1\n") )
+        return false;
+    if( !WriteScript(g_WorkScript,
+        "local sum = 0\n"
+        "for i = 1, 20000 do sum = sum + i % 7 end\n"
+        "result = sum\n") )
+        return false;
+    return true;
+}
+
+static void BenchmarkScriptSpawn()
+{
+    LuaContextPool contextPool;
+    LuaScheduler scheduler(1);
+    scheduler.Start();
+
+    // Created and destroyed around every run of the script, like an NPC spawned for a single decision:
+    Measure("script_spawn", "luathread", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+        {
+            LuaThread luaThread("BENCH_SPAWN", g_ScriptPath, g_LogPath);
+            luaThread.ExecuteScript(g_SpawnScript);
+        }
+    });
+    Measure("script_spawn", "luathread_pooled", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+        {
+            LuaThread luaThread("BENCH_SPAWN_POOLED", g_ScriptPath, g_LogPath);
+            luaThread.SetContextPool(&contextPool);
+            luaThread.ExecuteScript(g_SpawnScript);
+        }
+    });
+    Measure("script_spawn", "luathread_scheduled", [&](uint32 iterations) {
+        for( uint32 i = 0; i < iterations; i++ )
+        {
+            LuaThread luaThread("BENCH_SPAWN_SCHEDULED", g_ScriptPath, g_LogPath, true, false, &scheduler);
+            luaThread.ExecuteScript(g_SpawnScript);
+            luaThread.WaitForCompletion();
+        }
+    });
+
+    scheduler.Shutdown();
+}
+
+// Runs the script of every LuaThread once more 'runCount' times in total, starting the next run of a LuaThread as soon
+// as its completion has been posted.  Every LuaThread must have completed its previous run:
+static void DriveScriptRuns(std::vector<LuaThread *> & luaThreads, LuaCompletionQueue & completionQueue, uint32 runCount)
+{
+    std::vector<LuaCompletionEvent> events;
+    uint32 startedCount = 0;
+    uint32 completedCount = 0;
+
+    for( uint32 i = 0; (i < luaThreads.size()) && (startedCount < runCount); i++, startedCount++ )
+        luaThreads[i]->ResumeScript();
+
+    while( completedCount < runCount )
+    {
+        if( completionQueue.Drain(events) == 0 )
+        {
+            boost::this_thread::yield();
+            continue;
+        }
+
+        for( uint32 i = 0; i < events.size(); i++ )
+        {
+            completedCount++;
+            if( startedCount < runCount )
+            {
+                events[i].pLuaThread->ResumeScript();
+                startedCount++;
+            }
+        }
+    }
+}
+
+// Starts the script of every LuaThread and waits until all of them have completed their first run:
+static void StartLuaThreads(std::vector<LuaThread *> & luaThreads, LuaCompletionQueue & completionQueue, const char * scriptName)
+{
+    for( uint32 i = 0; i < luaThreads.size(); i++ )
+    {
+        luaThreads[i]->SetCompletionQueue(&completionQueue);
+        luaThreads[i]->ExecuteScript(scriptName);
+    }
+
+    std::vector<LuaCompletionEvent> events;
+    uint32 completedCount = 0;
+    while( completedCount < luaThreads.size() )
+    {
+        completedCount += completionQueue.Drain(events);
+        boost::this_thread::yield();
+    }
+}
+
+static void DeleteLuaThreads(std::vector<LuaThread *> & luaThreads)
+{
+    for( uint32 i = 0; i < luaThreads.size(); i++ )
+        delete luaThreads[i];
+    luaThreads.clear();
+}
+
+static void BenchmarkRepeatRun()
+{
+    // From sending the command for another run to receiving its completion, on each kind of threading:
+    {
+        LuaCompletionQueue completionQueue;
+        std::vector<LuaThread *> luaThreads;
+        luaThreads.push_back(new LuaThread("BENCH_REPEAT_THREAD", g_ScriptPath, g_LogPath, true, false));
+        StartLuaThreads(luaThreads, completionQueue, g_RepeatScript);
+        Measure("repeat_run", "dedicated_thread", [&](uint32 iterations) {
+            DriveScriptRuns(luaThreads, completionQueue, iterations);
+        });
+        DeleteLuaThreads(luaThreads);
+    }
+
+    {
+        LuaScheduler scheduler(1);
+        scheduler.Start();
+        LuaCompletionQueue completionQueue;
+        std::vector<LuaThread *> luaThreads;
+        luaThreads.push_back(new LuaThread("BENCH_REPEAT_SCHEDULED", g_ScriptPath, g_LogPath, true, false, &scheduler));
+        StartLuaThreads(luaThreads, completionQueue, g_RepeatScript);
+        Measure("repeat_run", "scheduled", [&](uint32 iterations) {
+            DriveScriptRuns(luaThreads, completionQueue, iterations);
+        });
+        DeleteLuaThreads(luaThreads);
+        scheduler.Shutdown();
+    }
+}
+
+static void BenchmarkThreadScaling()
+{
+    LuaScheduler scheduler;
+    scheduler.Start();
+
+    uint32 maxLuaThreads = g_MaxLuaThreads;
+    if( maxLuaThreads == 0 )
+        maxLuaThreads = 2 * scheduler.GetWorkerCount();
+
+    // The time per op is wall clock time per completed run over all the LuaThreads, so ops_per_second is the
+    // throughput of the whole scheduler for that many LuaThreads:
+    for( uint32 threadCount = 1; threadCount <= maxLuaThreads; threadCount *= 2 )
+    {
+        LuaCompletionQueue completionQueue;
+        std::vector<LuaThread *> luaThreads;
+        for( uint32 i = 0; i < threadCount; i++ )
+        {
+            std::ostringstream threadName;
+            threadName << "BENCH_SCALING_" << i;
+            luaThreads.push_back(new LuaThread(threadName.str(), g_ScriptPath, g_LogPath, true, false, &scheduler));
+        }
+        StartLuaThreads(luaThreads, completionQueue, g_WorkScript);
+
+        std::ostringstream variant;
+        variant << "luathreads" << threadCount;
+        Measure("thread_scaling", variant.str(), [&](uint32 iterations) {
+            DriveScriptRuns(luaThreads, completionQueue, iterations);
+        });
+        DeleteLuaThreads(luaThreads);
+
+        if( (threadCount < maxLuaThreads) && (threadCount * 2 > maxLuaThreads) )
+            threadCount = maxLuaThreads / 2;        // Always end with the maximum count
+    }
+
+    scheduler.Shutdown();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void PrintUsage()
+{
+    fprintf(stderr, "Usage: luathread_benchmark [-o resultFile] [-d workDirectory] [-t maxLuaThreads] [-m minSampleMilliSeconds]\n"
+                    "                            [-s sampleCount] [-v] [benchmarkName ...]\n"
+                    "Benchmarks: read_variable write_variable call_lua_function cpp_callback script_spawn repeat_run thread_scaling\n");
+}
+
+int main(int argc, char * argv[])
+{
+    bool bVerbose = false;
+    for( int i = 1; i < argc; i++ )
+    {
+        std::string argument = argv[i];
+        bool bHasValue = (i + 1 < argc);
+        if( (argument == "-o") && bHasValue )
+        {
+            g_pResultFile = fopen(argv[++i], "w");
+            if( g_pResultFile == NULL )
+            {
+                fprintf(stderr, "Cannot open result file '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if( (argument == "-d") && bHasValue )
+            g_WorkPath = argv[++i];
+        else if( (argument == "-t") && bHasValue )
+            g_MaxLuaThreads = (uint32)atoi(argv[++i]);
+        else if( (argument == "-m") && bHasValue )
+            g_MinSampleMicroSeconds = 1000 * (uint32)atoi(argv[++i]);
+        else if( (argument == "-s") && bHasValue )
+            g_SampleCount = std::max(1, atoi(argv[++i]));
+        else if( argument == "-v" )
+            bVerbose = true;
+        else if( argument[0] == '-' )
+        {
+            PrintUsage();
+            return 1;
+        }
+        else
+            g_BenchmarkFilters.push_back(argument);
+    }
+
+    g_ScriptPath = g_WorkPath + "/scripts";
+    g_LogPath = g_WorkPath + "/log";
+    MakeDirectory(g_WorkPath);
+    MakeDirectory(g_ScriptPath);
+    MakeDirectory(g_LogPath);
+    if( !WriteBenchmarkScripts() )
+    {
+        fprintf(stderr, "Cannot write the benchmark scripts to %s\n", g_ScriptPath.c_str());
+        return 1;
+    }
+
+    if( !bVerbose )
+        std::cout.setstate(std::ios_base::badbit);
+
+    fprintf(stderr, "LuaThread benchmarks, %u hardware threads\n", boost::thread::hardware_concurrency());
+    fprintf(g_pResultFile, "benchmark,variant,iterations,ns_per_op_min,ns_per_op_median,ops_per_second\n");
+
+    if( IsBenchmarkSelected("read_variable") )
+        BenchmarkReadVariable();
+    if( IsBenchmarkSelected("write_variable") )
+        BenchmarkWriteVariable();
+    if( IsBenchmarkSelected("call_lua_function") )
+        BenchmarkCallLuaFunction();
+    if( IsBenchmarkSelected("cpp_callback") )
+        BenchmarkCppCallback();
+    if( IsBenchmarkSelected("script_spawn") )
+        BenchmarkScriptSpawn();
+    if( IsBenchmarkSelected("repeat_run") )
+        BenchmarkRepeatRun();
+    if( IsBenchmarkSelected("thread_scaling") )
+        BenchmarkThreadScaling();
+
+    if( g_pResultFile != stdout )
+        fclose(g_pResultFile);
+
+    return 0;
+}
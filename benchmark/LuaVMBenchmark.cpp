@@ -0,0 +1,409 @@
+// LuaVMBenchmark.cpp : Benchmarks of the Lua virtual machine, its tables and its garbage collector.
+//
+// Runs the scripts of lua/test and a set of workloads like the scripts of the server (NPC state machines, combat log
+// strings, vector math, inventory tables, event handlers) directly on a lua_State, with the same allocator LuaContext
+// gives to its states.  Use it to judge changes to lvm.c, ltable.c, lgc.c and the rest of lua/src.
+//
+// Built by the LuaVMBenchmark project, which compiles lua/src with LUA_GCTIMING defined so that the time spent
+// collecting garbage is measured (see luaconf.h).  On Linux, from the LuaThread directory with boost in
+// ../common/boost, compile every lua/src/*.c file except lua.c and luac.c with "gcc -O2 -DLUA_GCTIMING -c", then:
+//
+//   g++ -std=c++11 -O2 -DLUA_GCTIMING -I../common/boost -o luavm_benchmark benchmark/LuaVMBenchmark.cpp
+//       luawrapper/LuaAllocator.cpp lua/src/*.o -lboost_thread -lboost_system -lpthread
+//
+// Usage: luavm_benchmark [-o resultFile] [-l luaTestDirectory] [-m minSampleMilliSeconds] [-s sampleCount]
+//                        [-g] [workloadName ...]
+//
+// One op is one run of a lua/test script, each run with globals of its own, or one call of the run() function of a
+// workload, whose state carries over from one call to the next like a script called every tick.  Every workload gets
+// a new lua_State, is run with enough ops for one sample to take at least the minimum sample time, then sampled
+// 'sampleCount' times.  -g puts the collector in generational mode.  The results are written as CSV, one line per
+// workload, to the result file or to stdout:
+//
+//   workload,iterations,ns_per_op_min,ns_per_op_median,allocations_per_op,gc_ns_per_op,gc_percent,peak_kbytes
+//
+// allocations_per_op counts the blocks allocated by lua, gc_ns_per_op and gc_percent the time spent in the collector
+// (0 when lua/src was built without LUA_GCTIMING), peak_kbytes the most memory in use at any time.  Only the workloads
+// whose name contains one of the given names are run, all of them if none is given.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../../common/boost/boost/thread/thread_time.hpp"
+#include "../luawrapper/LuaAllocator.h"
+#include "../EVEmu_Types.h"
+
+extern "C" {
+#include "../lua/src/lua.h"
+#include "../lua/src/lualib.h"
+#include "../lua/src/lauxlib.h"
+}
+
+struct VMWorkload
+{
+    const char * name;
+    const char * testScript;        // File of lua/test run as a whole for every op, or NULL
+    const char * source;            // Otherwise code defining run(), and optionally setup() called once first
+};
+
+// Workloads modelled on the NPC scripts run by LuaThread:
+static const char * g_AIStateMachineSource =
+    "local npcs = {}\n"
+    "local states = {}\n"
+    "function setup()\n"
+    "  for i = 1, 200 do\n"
+    "    npcs[i] = { id = i, state = 'idle', x = i * 10.0, y = 0.0, hp = 100, timer = 0, target = nil, memory = {} }\n"
+    "  end\n"
+    "end\n"
+    "states.idle = function(npc, dt)\n"
+    "  npc.timer = npc.timer + dt\n"
+    "  if npc.timer > 0.5 then npc.timer = 0 npc.state = 'patrol' end\n"
+    "end\n"
+    "states.patrol = function(npc, dt)\n"
+    "  npc.x = npc.x + dt * 50\n"
+    "  if npc.x % 100 < 5 then npc.state = 'chase' npc.target = { x = npc.x + 40, y = npc.y + 30 } end\n"
+    "end\n"
+    "states.chase = function(npc, dt)\n"
+    "  local t = npc.target\n"
+    "  local dx, dy = t.x - npc.x, t.y - npc.y\n"
+    "  local distance = math.sqrt(dx * dx + dy * dy)\n"
+    "  if distance < 10 then npc.state = 'attack' return end\n"
+    "  npc.x = npc.x + dx / distance * dt * 100\n"
+    "  npc.y = npc.y + dy / distance * dt * 100\n"
+    "end\n"
+    "states.attack = function(npc, dt)\n"
+    "  local memory = npc.memory\n"
+    "  memory[#memory + 1] = { target = npc.target, damage = npc.id % 7 + 1 }\n"
+    "  if #memory > 8 then table.remove(memory, 1) end\n"
+    "  npc.hp = npc.hp - 3\n"
+    "  if npc.hp < 30 then npc.state = 'flee' elseif #memory % 4 == 0 then npc.state = 'idle' npc.target = nil end\n"
+    "end\n"
+    "states.flee = function(npc, dt)\n"
+    "  npc.x, npc.y = npc.x - dt * 80, npc.y - dt * 80\n"
+    "  npc.hp = npc.hp + 5\n"
+    "  if npc.hp >= 100 then npc.state = 'idle' npc.target = nil end\n"
+    "end\n"
+    "function run()\n"
+    "  for i = 1, #npcs do\n"
+    "    local npc = npcs[i]\n"
+    "    states[npc.state](npc, 0.1)\n"
+    "  end\n"
+    "end\n";
+
+static const char * g_StringBuildingSource =
+    "local names = { 'Guristas Pithi', 'Sansha Slave', 'Blood Raider', 'Serpentis Scout',\n"
+    "                'Angel Cartel', 'Rogue Drone', 'Mordus Legion', 'Drifter' }\n"
+    "local tick = 0\n"
+    "function run()\n"
+    "  local lines = {}\n"
+    "  tick = tick + 1\n"
+    "  for i = 1, 50 do\n"
+    "    lines[i] = string.format('[%08.2f] %s hits %s for %d damage (%s)', tick + i * 0.25, names[i % 8 + 1],\n"
+    "      names[(i + 3) % 8 + 1], i * 7 % 100, (i % 5 == 0) and 'critical' or 'normal')\n"
+    "  end\n"
+    "  local text = table.concat(lines, '\\n')\n"
+    "  local key = ''\n"
+    "  for i = 1, 20 do key = key .. names[(tick + i) % 8 + 1]:sub(1, 3):upper() .. i end\n"
+    "  local criticals = select(2, text:gsub('critical', 'CRIT'))\n"
+    "  return #key + criticals\n"
+    "end\n";
+
+static const char * g_MathLoopsSource =
+    "local positions = {}\n"
+    "function setup()\n"
+    "  for i = 1, 1000 do positions[i] = { x = i * 1.5, y = i * 0.5, z = -i } end\n"
+    "end\n"
+    "function run()\n"
+    "  local sin, cos, sqrt, floor = math.sin, math.cos, math.sqrt, math.floor\n"
+    "  local angle = 0.01\n"
+    "  local nearest, nearestDistance = 0, math.huge\n"
+    "  for i = 1, #positions do\n"
+    "    local p = positions[i]\n"
+    "    local x, y = p.x * cos(angle) - p.y * sin(angle), p.x * sin(angle) + p.y * cos(angle)\n"
+    "    p.x, p.y = x, y\n"
+    "    local distance = sqrt(x * x + y * y + p.z * p.z)\n"
+    "    if distance < nearestDistance then nearest, nearestDistance = i, distance end\n"
+    "    p.z = floor(p.z * 0.5 + distance * 0.001)\n"
+    "  end\n"
+    "  return nearest\n"
+    "end\n";
+
+static const char * g_TableChurnSource =
+    "local kinds = { 'ammo', 'module', 'ore', 'salvage', 'blueprint' }\n"
+    "function run()\n"
+    "  local cargo = {}\n"
+    "  for i = 1, 100 do\n"
+    "    cargo[#cargo + 1] = { kind = kinds[i % 5 + 1], quantity = i * 3 % 17 + 1, value = (i * 7919) % 1000 }\n"
+    "  end\n"
+    "  table.sort(cargo, function(a, b) return a.value > b.value end)\n"
+    "  local byKind = {}\n"
+    "  for i = 1, #cargo do\n"
+    "    local item = cargo[i]\n"
+    "    local stack = byKind[item.kind]\n"
+    "    if stack == nil then stack = {} byKind[item.kind] = stack end\n"
+    "    stack[#stack + 1] = item\n"
+    "  end\n"
+    "  while #cargo > 50 do table.remove(cargo) end\n"
+    "  return #cargo\n"
+    "end\n";
+
+static const char * g_EventHandlersSource =
+    "local handlers = {}\n"
+    "local function on(eventName, handler)\n"
+    "  local list = handlers[eventName]\n"
+    "  if list == nil then list = {} handlers[eventName] = list end\n"
+    "  list[#list + 1] = handler\n"
+    "end\n"
+    "local function fire(eventName, ...)\n"
+    "  local list = handlers[eventName]\n"
+    "  if list == nil then return end\n"
+    "  for i = 1, #list do list[i](...) end\n"
+    "end\n"
+    "function run()\n"
+    "  handlers = {}\n"
+    "  local damageTaken, kills = 0, 0\n"
+    "  for i = 1, 20 do\n"
+    "    local threshold = i * 5\n"
+    "    on('damage', function(amount) damageTaken = damageTaken + amount end)\n"
+    "    on('damage', function(amount) if amount > threshold then kills = kills + 1 end end)\n"
+    "    on('tick', function() damageTaken = damageTaken * 0.99 end)\n"
+    "  end\n"
+    "  for i = 1, 10 do fire('damage', i * 10) fire('tick') end\n"
+    "  return kills\n"
+    "end\n";
+
+static const VMWorkload g_Workloads[] = {
+    { "test_bisect",        "bisect.lua",       NULL },
+    { "test_cf",            "cf.lua",           NULL },
+    { "test_factorial",     "factorial.lua",    NULL },
+    { "test_fib",           "fib.lua",          NULL },
+    { "test_fibfor",        "fibfor.lua",       NULL },
+    { "test_life",          "life.lua",         NULL },
+    { "test_sieve",         "sieve.lua",        NULL },
+    { "test_sort",          "sort.lua",         NULL },
+    { "ai_state_machine",   NULL,               g_AIStateMachineSource },
+    { "string_building",    NULL,               g_StringBuildingSource },
+    { "math_loops",         NULL,               g_MathLoopsSource },
+    { "table_churn",        NULL,               g_TableChurnSource },
+    { "event_handlers",     NULL,               g_EventHandlersSource }
+};
+
+static FILE * g_pResultFile = stdout;
+static std::vector<std::string> g_WorkloadFilters;
+static std::string g_LuaTestPath = "./lua/test";
+static uint32 g_MinSampleMicroSeconds = 100000;
+static uint32 g_SampleCount = 5;
+static bool g_bGenerationalGC = false;
+
+static bool IsWorkloadSelected(const std::string & workload)
+{
+    if( g_WorkloadFilters.empty() )
+        return true;
+
+    for( uint32 i = 0; i < g_WorkloadFilters.size(); i++ )
+        if( workload.find(g_WorkloadFilters[i]) != std::string::npos )
+            return true;
+
+    return false;
+}
+
+// The scripts of lua/test write what they compute, which is thrown away here:
+static int DiscardOutput(lua_State * /*L*/)
+{
+    return 0;
+}
+
+// Loads the workload and leaves on the stack the function to call for one op.  For a script of lua/test that is
+// a function setting up a table of globals of its own and running the script with it:
+static bool LoadWorkload(lua_State * L, const VMWorkload & workload)
+{
+    lua_pushcfunction(L, &DiscardOutput);
+    lua_setglobal(L, "print");
+    lua_getglobal(L, "io");
+    lua_pushcfunction(L, &DiscardOutput);
+    lua_setfield(L, -2, "write");
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_setglobal(L, "arg");
+
+    if( workload.testScript != NULL )
+    {
+        std::string scriptFile = g_LuaTestPath + "/" + workload.testScript;
+        if( luaL_loadfile(L, scriptFile.c_str()) != 0 )
+        {
+            fprintf(stderr, "%s: %s\n", workload.name, lua_tostring(L, -1));
+            return false;
+        }
+        lua_setglobal(L, "_testScript");
+
+        if( luaL_dostring(L,
+                "local script = _testScript\n"
+                "local globalsMeta = { __index = _G }\n"
+                "_testScript = nil\n"
+                "return function() setfenv(script, setmetatable({}, globalsMeta)) script() end\n") != 0 )
+        {
+            fprintf(stderr, "%s: %s\n", workload.name, lua_tostring(L, -1));
+            return false;
+        }
+        return true;
+    }
+
+    if( luaL_dostring(L, workload.source) != 0 )
+    {
+        fprintf(stderr, "%s: %s\n", workload.name, lua_tostring(L, -1));
+        return false;
+    }
+
+    lua_getglobal(L, "setup");
+    if( lua_isfunction(L, -1) && (lua_pcall(L, 0, 0, 0) != 0) )
+    {
+        fprintf(stderr, "%s: setup() failed: %s\n", workload.name, lua_tostring(L, -1));
+        return false;
+    }
+    lua_settop(L, 0);
+
+    lua_getglobal(L, "run");
+    return true;
+}
+
+// Calls the function on the top of the stack 'iterations' times:
+static bool RunOps(lua_State * L, const char * workloadName, uint32 iterations)
+{
+    for( uint32 i = 0; i < iterations; i++ )
+    {
+        lua_pushvalue(L, -1);
+        if( lua_pcall(L, 0, 0, 0) != 0 )
+        {
+            fprintf(stderr, "%s: %s\n", workloadName, lua_tostring(L, -1));
+            lua_pop(L, 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void RunWorkload(const VMWorkload & workload)
+{
+    Lua::LuaAllocator allocator;
+    lua_State * L = lua_newstate(&Lua::LuaAllocator::allocate, &allocator);
+    if( L == NULL )
+    {
+        fprintf(stderr, "%s: cannot create the lua_State\n", workload.name);
+        return;
+    }
+    luaL_openlibs(L);
+    if( g_bGenerationalGC )
+        lua_gc(L, LUA_GCGEN, 0);
+
+    if( !LoadWorkload(L, workload) )
+    {
+        lua_close(L);
+        return;
+    }
+
+    // Doubles the op count until one sample takes at least the minimum sample time:
+    uint32 iterations = 1;
+    while( true )
+    {
+        boost::system_time const startTime = boost::get_system_time();
+        if( !RunOps(L, workload.name, iterations) )
+        {
+            lua_close(L);
+            return;
+        }
+        uint32 elapsedMicroSeconds = (uint32)((boost::get_system_time() - startTime).total_microseconds());
+        if( (elapsedMicroSeconds >= g_MinSampleMicroSeconds) || (iterations >= 0x40000000) )
+            break;
+        iterations *= 2;
+    }
+
+    allocator.resetPeak();
+    size_t const startAllocations = allocator.totalAllocations();
+    int const startGCMicroSeconds = lua_gc(L, LUA_GCTIME, 0);
+    double totalMicroSeconds = 0.0;
+    std::vector<double> nsPerOp;
+    for( uint32 i = 0; i < g_SampleCount; i++ )
+    {
+        boost::system_time const startTime = boost::get_system_time();
+        RunOps(L, workload.name, iterations);
+        double elapsedMicroSeconds = (double)((boost::get_system_time() - startTime).total_microseconds());
+        totalMicroSeconds += elapsedMicroSeconds;
+        nsPerOp.push_back((elapsedMicroSeconds * 1000.0) / iterations);
+    }
+    std::sort(nsPerOp.begin(), nsPerOp.end());
+
+    double const totalOps = (double)iterations * g_SampleCount;
+    double const allocationsPerOp = (allocator.totalAllocations() - startAllocations) / totalOps;
+    double const gcMicroSeconds = (double)(lua_gc(L, LUA_GCTIME, 0) - startGCMicroSeconds);
+    double const gcNsPerOp = (gcMicroSeconds * 1000.0) / totalOps;
+    double const gcPercent = (totalMicroSeconds > 0.0) ? (100.0 * gcMicroSeconds / totalMicroSeconds) : 0.0;
+    double const peakKBytes = allocator.peakBytesInUse() / 1024.0;
+    double const nsPerOpMedian = nsPerOp[nsPerOp.size() / 2];
+
+    fprintf(g_pResultFile, "%s,%lu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", workload.name, (unsigned long)iterations,
+        nsPerOp.front(), nsPerOpMedian, allocationsPerOp, gcNsPerOp, gcPercent, peakKBytes);
+    fflush(g_pResultFile);
+    fprintf(stderr, "  %-18s %14.1f ns/op %10.1f allocs/op %6.1f%% GC\n", workload.name, nsPerOpMedian, allocationsPerOp, gcPercent);
+
+    lua_close(L);
+}
+
+static void PrintUsage()
+{
+    fprintf(stderr, "Usage: luavm_benchmark [-o resultFile] [-l luaTestDirectory] [-m minSampleMilliSeconds] [-s sampleCount]\n"
+                    "                       [-g] [workloadName ...]\n"
+                    "Workloads:");
+    for( uint32 i = 0; i < sizeof(g_Workloads) / sizeof(g_Workloads[0]); i++ )
+        fprintf(stderr, " %s", g_Workloads[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char * argv[])
+{
+    for( int i = 1; i < argc; i++ )
+    {
+        std::string argument = argv[i];
+        bool bHasValue = (i + 1 < argc);
+        if( (argument == "-o") && bHasValue )
+        {
+            g_pResultFile = fopen(argv[++i], "w");
+            if( g_pResultFile == NULL )
+            {
+                fprintf(stderr, "Cannot open result file '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if( (argument == "-l") && bHasValue )
+            g_LuaTestPath = argv[++i];
+        else if( (argument == "-m") && bHasValue )
+            g_MinSampleMicroSeconds = 1000 * (uint32)atoi(argv[++i]);
+        else if( (argument == "-s") && bHasValue )
+            g_SampleCount = std::max(1, atoi(argv[++i]));
+        else if( argument == "-g" )
+            g_bGenerationalGC = true;
+        else if( argument[0] == '-' )
+        {
+            PrintUsage();
+            return 1;
+        }
+        else
+            g_WorkloadFilters.push_back(argument);
+    }
+
+#if !defined(LUA_GCTIMING)
+    fprintf(stderr, "lua/src was not built with LUA_GCTIMING, the time spent collecting garbage is not measured\n");
+#endif
+    fprintf(stderr, "Lua VM benchmarks, %s garbage collector\n", g_bGenerationalGC ? "generational" : "incremental");
+    fprintf(g_pResultFile, "workload,iterations,ns_per_op_min,ns_per_op_median,allocations_per_op,gc_ns_per_op,gc_percent,peak_kbytes\n");
+
+    for( uint32 i = 0; i < sizeof(g_Workloads) / sizeof(g_Workloads[0]); i++ )
+        if( IsWorkloadSelected(g_Workloads[i].name) )
+            RunWorkload(g_Workloads[i]);
+
+    if( g_pResultFile != stdout )
+        fclose(g_pResultFile);
+
+    return 0;
+}
@@ -0,0 +1,203 @@
+// LuaLogDecoder.cpp : Renders the binary log files written by LuaLogWriter as text.
+//
+// A LuaLogWriter created with LUALOG_FORMAT_BINARY writes each LuaThread's log as records holding the time stamp,
+// thread id, script id, level, format string id and arguments of every message, see LuaLogWriter.h for the layout.
+// This tool turns such a file back into the lines a LUALOG_FORMAT_TEXT writer would have written.
+//
+// Built by the LuaLogDecoder project.  On Linux, from the LuaThread directory with boost in ../common/boost:
+//
+//   g++ -std=c++11 -O2 -I../common/boost -o lualog_decoder logdecoder/LuaLogDecoder.cpp LuaLogWriter.cpp
+//       -lboost_thread -lboost_system -lpthread
+//
+// Usage: lualog_decoder [-o outputFile] [-l minimumLevel] [-v] logFile ...
+//
+// The lines of every log file are written, one file after the other, to the output file or to stdout.  -l leaves
+// out the messages below the level, one of trace, debug, info, warning or error.  -v adds the thread name and the
+// script name of each message after its time stamp.
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <iterator>
+#include "../LuaLogWriter.h"
+
+static FILE * g_pOutputFile = stdout;
+static LuaLogLevels g_MinimumLevel = LUALOG_TRACE;
+static bool g_bVerbose = false;
+
+static void PrintUsage()
+{
+    fprintf(stderr, "Usage: lualog_decoder [-o outputFile] [-l trace|debug|info|warning|error] [-v] logFile ...\n");
+}
+
+static uint32 GetUInt32(const char * bytes)
+{
+    uint32 value = 0;
+    for( uint32 i = 0; i < 4; i++ )
+        value |= uint32((unsigned char)bytes[i]) << (8 * i);
+    return value;
+}
+
+static boost::uint64_t GetUInt64(const char * bytes)
+{
+    boost::uint64_t value = 0;
+    for( uint32 i = 0; i < 8; i++ )
+        value |= boost::uint64_t((unsigned char)bytes[i]) << (8 * i);
+    return value;
+}
+
+static bool ParseLevel(const std::string & name, LuaLogLevels & level)
+{
+    static const char * s_LevelNames[] = { "trace", "debug", "info", "warning", "error" };
+    for( uint32 i = 0; i < sizeof(s_LevelNames) / sizeof(s_LevelNames[0]); i++ )
+        if( name == s_LevelNames[i] )
+        {
+            level = LuaLogLevels(i);
+            return true;
+        }
+    return false;
+}
+
+// Returns the number of messages decoded, or -1 if the file is not a binary log:
+static int32 DecodeLog(const char * logFileName)
+{
+    std::ifstream logStream(logFileName, std::ifstream::in | std::ifstream::binary);
+    if( logStream.fail() )
+    {
+        fprintf(stderr, "Cannot open log file '%s'\n", logFileName);
+        return -1;
+    }
+    std::string bytes((std::istreambuf_iterator<char>(logStream)), std::istreambuf_iterator<char>());
+
+    if( (bytes.size() < LUALOG_BINARY_MAGIC_SIZE) || (memcmp(bytes.data(), LUALOG_BINARY_MAGIC, LUALOG_BINARY_MAGIC_SIZE) != 0) )
+    {
+        fprintf(stderr, "'%s' is not a binary log of this version\n", logFileName);
+        return -1;
+    }
+
+    std::map<uint32, std::string> threadNames;
+    std::map<uint32, std::string> scriptNames;
+    std::map<uint32, std::string> formats;
+    formats[LUALOG_TEXT_FORMAT_ID] = "%s";
+
+    boost::posix_time::ptime const epoch(boost::gregorian::date(1970, 1, 1));
+    std::string line;
+    int32 messageCount = 0;
+    size_t position = LUALOG_BINARY_MAGIC_SIZE;
+
+    // A record cut short is what a server stopped while writing its log leaves behind, so that ends the file quietly:
+    while( (bytes.size() - position) >= 5 )
+    {
+        char recordType = bytes[position];
+        uint32 length = GetUInt32(bytes.data() + position + 1);
+        if( (bytes.size() - position - 5) < length )
+            break;
+        const char * record = bytes.data() + position + 5;
+        position += 5 + length;
+
+        if( ((recordType == LUALOG_RECORD_THREAD) || (recordType == LUALOG_RECORD_SCRIPT) || (recordType == LUALOG_RECORD_FORMAT)) && (length >= 4) )
+        {
+            std::string name(record + 4, length - 4);
+            if( recordType == LUALOG_RECORD_THREAD )
+                threadNames[GetUInt32(record)] = name;
+            else if( recordType == LUALOG_RECORD_SCRIPT )
+                scriptNames[GetUInt32(record)] = name;
+            else
+                formats[GetUInt32(record)] = name;
+            continue;
+        }
+
+        // Records of unknown types are skipped, so that later versions may add some:
+        if( (recordType != LUALOG_RECORD_MESSAGE) || (length < 22) )
+            continue;
+
+        boost::uint64_t microSeconds = GetUInt64(record);
+        uint32 threadId = GetUInt32(record + 8);
+        uint32 scriptId = GetUInt32(record + 12);
+        LuaLogLevels level = LuaLogLevels((unsigned char)record[16]);
+        uint32 formatId = GetUInt32(record + 17);
+        if( level < g_MinimumLevel )
+            continue;
+
+        char timestamp[LUALOGWRITER_TIMESTAMP_SIZE];
+        LuaLogWriter::FormatTimestamp(epoch + boost::posix_time::microseconds(microSeconds), timestamp);
+        line = timestamp;
+        if( g_bVerbose )
+        {
+            line += "[" + threadNames[threadId] + "] ";
+            if( scriptId != LUALOG_NO_SCRIPT_ID )
+                line += "[" + scriptNames[scriptId] + "] ";
+        }
+        line += LuaLogWriter::GetLevelTag(level);
+
+        std::map<uint32, std::string>::iterator format = formats.find(formatId);
+        if( format == formats.end() )
+            line += "(unknown format)";
+        else if( !LuaLogArgs::Render(format->second.c_str(), record + 22, length - 22, line) )
+            line += " (damaged arguments)";
+
+        fprintf(g_pOutputFile, "%s\n", line.c_str());
+        messageCount++;
+    }
+
+    if( position != bytes.size() )
+        fprintf(stderr, "'%s' ends with a partly written record\n", logFileName);
+
+    return messageCount;
+}
+
+int main(int argc, char * argv[])
+{
+    std::vector<std::string> logFiles;
+
+    for( int i = 1; i < argc; i++ )
+    {
+        std::string argument = argv[i];
+        bool bHasValue = (i + 1 < argc);
+        if( (argument == "-o") && bHasValue )
+        {
+            g_pOutputFile = fopen(argv[++i], "w");
+            if( g_pOutputFile == NULL )
+            {
+                fprintf(stderr, "Cannot open output file '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if( (argument == "-l") && bHasValue )
+        {
+            if( !ParseLevel(argv[++i], g_MinimumLevel) )
+            {
+                PrintUsage();
+                return 1;
+            }
+        }
+        else if( argument == "-v" )
+            g_bVerbose = true;
+        else if( argument[0] == '-' )
+        {
+            PrintUsage();
+            return 1;
+        }
+        else
+            logFiles.push_back(argument);
+    }
+
+    if( logFiles.empty() )
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    int result = 0;
+    for( uint32 i = 0; i < logFiles.size(); i++ )
+        if( DecodeLog(logFiles[i].c_str()) < 0 )
+            result = 1;
+
+    if( g_pOutputFile != stdout )
+        fclose(g_pOutputFile);
+
+    return result;
+}
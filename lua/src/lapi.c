@@ -866,12 +866,56 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
   lua_lock(L);
   if (!chunkname) chunkname = "?";
   luaZ_init(L, &z, reader, data);
-  status = luaD_protectedparser(L, &z, chunkname);
+  status = luaD_protectedparser(L, &z, chunkname, NULL);
   lua_unlock(L);
   return status;
 }
 
 
+static const char *getshared (lua_State *L, void *ud, size_t *size) {
+  lua_SharedChunk **sc = cast(lua_SharedChunk **, ud);
+  const char *dump;
+  UNUSED(L);
+  if (*sc == NULL) return NULL;
+  dump = (*sc)->dump;
+  *size = (*sc)->sizedump;
+  *sc = NULL;  /* the whole dump is read at once */
+  return dump;
+}
+
+
+LUA_API lua_SharedChunk *lua_newsharedchunk (lua_State *L) {
+  lua_SharedChunk *sc = NULL;
+  TValue *o;
+  lua_lock(L);
+  api_checknelems(L, 1);
+  o = L->top - 1;
+  if (isLfunction(o))
+    sc = luaU_newshared(L, clvalue(o)->l.p);
+  lua_unlock(L);
+  return sc;
+}
+
+
+LUA_API int lua_loadshared (lua_State *L, lua_SharedChunk *sc,
+                            const char *chunkname) {
+  ZIO z;
+  int status;
+  lua_SharedChunk *reader = sc;
+  lua_lock(L);
+  if (!chunkname) chunkname = "?";
+  luaZ_init(L, &z, getshared, &reader);
+  status = luaD_protectedparser(L, &z, chunkname, sc);
+  lua_unlock(L);
+  return status;
+}
+
+
+LUA_API void lua_releaseshared (lua_SharedChunk *sc) {
+  luaU_releaseshared(sc);
+}
+
+
 LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data) {
   int status;
   TValue *o;
@@ -948,6 +992,31 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       g->gcstepmul = data;
       break;
     }
+    case LUA_GCGEN: {
+      res = (g->gckind == KGC_GEN);
+      luaC_changemode(L, KGC_GEN);
+      break;
+    }
+    case LUA_GCINC: {
+      res = (g->gckind == KGC_GEN);
+      luaC_changemode(L, KGC_NORMAL);
+      break;
+    }
+    case LUA_GCTIME: {
+      /* in microseconds, modulo 2^31 so that it never overflows (take
+         differences modulo 2^31); always 0 without LUA_GCTIMING */
+      res = cast_int(fmod(g->gctime / 1000, 2147483648.0));
+      break;
+    }
+    case LUA_GCTIMED: {
+      /* 1 if LUA_GCTIME is measured, 0 if it is always 0 */
+#if defined(LUA_GCTIMING)
+      res = 1;
+#else
+      res = 0;
+#endif
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -22,11 +22,22 @@
 #include "ltable.h"
 #include "ltm.h"
 
+#if defined(LUA_GCTIMING)
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#endif
+
+
 
 #define GCSTEPSIZE	1024u
 #define GCSWEEPMAX	40
 #define GCSWEEPCOST	10
 #define GCFINALIZECOST	100
+#define GCMINYOUNG	(64*GCSTEPSIZE)
 
 
 #define maskmarks	cast_byte(~(bitmask(BLACKBIT)|WHITEBITS))
@@ -56,7 +67,49 @@
 		reallymarkobject(g, obj2gco(t)); }
 
 
-#define setthreshold(g)  (g->GCthreshold = (g->estimate/100) * g->gcpause)
+/*
+** in generational mode, the pause is the memory in use plus how much the
+** young objects may take, as a percentage of it, before the next minor
+** collection; they always get at least GCMINYOUNG bytes, since a pause of
+** 100 or less would start a minor collection at every allocation check
+*/
+static void setthreshold (global_State *g) {
+  if (g->gckind == KGC_GEN) {
+    lu_mem young = (g->gcpause > 100) ?
+                   (g->estimate/100) * (g->gcpause - 100) : 0;
+    g->GCthreshold = g->estimate + ((young > GCMINYOUNG) ? young : GCMINYOUNG);
+  }
+  else
+    g->GCthreshold = (g->estimate/100) * g->gcpause;
+}
+
+
+/*
+** time spent collecting (see LUA_GCTIMING)
+*/
+#if defined(LUA_GCTIMING)
+
+static lua_Number gcclock (void) {  /* in nanoseconds */
+#if defined(_WIN32)
+  LARGE_INTEGER count, frequency;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&frequency);
+  return (lua_Number)count.QuadPart * 1e9 / (lua_Number)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (lua_Number)now.tv_sec * 1e9 + (lua_Number)now.tv_nsec;
+#endif
+}
+
+#define gctimed(g,work)	{ lua_Number start_ = gcclock(); work; \
+                          (g)->gctime += gcclock() - start_; }
+
+#else
+
+#define gctimed(g,work)	{ work; }
+
+#endif
 
 
 static void removeentry (Node *n) {
@@ -129,8 +182,11 @@ size_t luaC_separateudata (lua_State *L, int all) {
   global_State *g = G(L);
   size_t deadmem = 0;
   GCObject **p = &g->mainthread->next;
+  GCObject *old = all ? NULL : g->oldudata;  /* old userdata are marked */
   GCObject *curr;
-  while ((curr = *p) != NULL) {
+  if (all)  /* (lua_close) old userdata may go too: sweep them all */
+    g->oldudata = g->newoldudata = NULL;
+  while ((curr = *p) != old) {
     if (!(iswhite(curr) || all) || isfinalized(gco2u(curr)))
       p = &curr->gch.next;  /* don't bother with them */
     else if (fasttm(L, gco2u(curr)->metatable, TM_GC) == NULL) {
@@ -413,7 +469,8 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
       sweepwholelist(L, &gco2th(curr)->openupval);
     if ((curr->gch.marked ^ WHITEBITS) & deadmask) {  /* not dead? */
       lua_assert(!isdead(g, curr) || testbit(curr->gch.marked, FIXEDBIT));
-      makewhite(g, curr);  /* make it white (for next cycle) */
+      if (g->gckind != KGC_GEN)  /* survivors of a generational cycle stay */
+        makewhite(g, curr);  /* make it white (for next cycle) */
       p = &curr->gch.next;
     }
     else {  /* must erase `curr' */
@@ -428,6 +485,36 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
 }
 
 
+/*
+** sweep of a minor collection: only the young objects, in front of `old',
+** are swept, and those that survive keep their mark.  `*newold' is the
+** first object linked before the atomic phase; when it is freed, the
+** next one takes its place, so that it ends up as the first survivor,
+** which is where the next minor sweep will stop.  Objects linked since
+** the atomic phase are white and stay young.
+*/
+static GCObject **sweepyoung (lua_State *L, GCObject **p, GCObject *old,
+                              GCObject **newold, lu_mem count) {
+  GCObject *curr;
+  global_State *g = G(L);
+  int deadmask = otherwhite(g);
+  while ((curr = *p) != old && count-- > 0) {
+    if (curr->gch.tt == LUA_TTHREAD)  /* sweep open upvalues of each thread */
+      sweepwholelist(L, &gco2th(curr)->openupval);
+    if ((curr->gch.marked ^ WHITEBITS) & deadmask)  /* not dead? */
+      p = &curr->gch.next;
+    else {  /* must erase `curr' */
+      lua_assert(isdead(g, curr));
+      *p = curr->gch.next;
+      if (curr == *newold)
+        *newold = curr->gch.next;
+      freeobj(L, curr);
+    }
+  }
+  return p;
+}
+
+
 static void checkSizes (lua_State *L) {
   global_State *g = G(L);
   /* check size of string hash */
@@ -454,7 +541,10 @@ static void GCTM (lua_State *L) {
     g->tmudata->gch.next = udata->uv.next;
   udata->uv.next = g->mainthread->next;  /* return it to `root' list */
   g->mainthread->next = o;
-  makewhite(g, o);
+  /* in generational mode it stays marked until a major collection, since
+     lua_close also finalizes userdata that old objects refer to */
+  if (g->gckind != KGC_GEN)
+    makewhite(g, o);
   tm = fasttm(L, udata->uv.metatable, TM_GC);
   if (tm != NULL) {
     lu_byte oldah = L->allowhook;
@@ -550,6 +640,18 @@ static void atomic (lua_State *L) {
   g->sweepgc = &g->rootgc;
   g->gcstate = GCSsweepstring;
   g->estimate = g->totalbytes - udsize;  /* first estimate */
+  if (g->oldgc != NULL) {  /* minor collection? */
+    GCObject *o;
+    /* old threads are not in the part of `rootgc' that gets swept, but
+       they are all in `grayagain' (see generationalstep) */
+    for (o = g->grayagain; o != NULL; o = gco2th(o)->gclist) {
+      lua_assert(o->gch.tt == LUA_TTHREAD);
+      sweepwholelist(L, &gco2th(o)->openupval);
+    }
+    g->newoldgc = g->rootgc;
+    g->newoldudata = g->mainthread->next;
+    g->gcstate = GCSsweep;  /* strings are left to major collections */
+  }
 }
 
 
@@ -558,7 +660,12 @@ static l_mem singlestep (lua_State *L) {
   /*lua_checkmemory(L);*/
   switch (g->gcstate) {
     case GCSpause: {
-      markroot(L);  /* start a new collection */
+      if (g->gckind == KGC_GEN) {  /* minor collection? */
+        lua_assert(g->oldgc != NULL);
+        g->gcstate = GCSpropagate;  /* old objects stay marked: no markroot */
+      }
+      else
+        markroot(L);  /* start a new collection */
       return 0;
     }
     case GCSpropagate: {
@@ -580,9 +687,37 @@ static l_mem singlestep (lua_State *L) {
     }
     case GCSsweep: {
       lu_mem old = g->totalbytes;
-      g->sweepgc = sweeplist(L, g->sweepgc, GCSWEEPMAX);
-      if (*g->sweepgc == NULL) {  /* nothing more to sweep? */
+      if (g->oldgc != NULL) {  /* minor collection? */
+        g->sweepgc = sweepyoung(L, g->sweepgc, g->oldgc, &g->newoldgc,
+                                GCSWEEPMAX);
+        if (*g->sweepgc == g->oldgc) {  /* no more young objects? */
+          g->oldgc = g->newoldgc;
+          g->sweepgc = &g->mainthread->next;
+          g->gcstate = GCSsweepudata;
+        }
+      }
+      else {
+        g->sweepgc = sweeplist(L, g->sweepgc, GCSWEEPMAX);
+        if (*g->sweepgc == NULL) {  /* nothing more to sweep? */
+          checkSizes(L);
+          if (g->gckind == KGC_GEN) {  /* major collection: all are old */
+            g->oldgc = g->rootgc;
+            g->oldudata = g->mainthread->next;
+          }
+          g->gcstate = GCSfinalize;  /* end sweep phase */
+        }
+      }
+      lua_assert(old >= g->totalbytes);
+      g->estimate -= old - g->totalbytes;
+      return GCSWEEPMAX*GCSWEEPCOST;
+    }
+    case GCSsweepudata: {  /* young userdata of a minor collection */
+      lu_mem old = g->totalbytes;
+      g->sweepgc = sweepyoung(L, g->sweepgc, g->oldudata, &g->newoldudata,
+                              GCSWEEPMAX);
+      if (*g->sweepgc == g->oldudata) {  /* no more young userdata? */
         checkSizes(L);
+        g->oldudata = g->newoldudata;
         g->gcstate = GCSfinalize;  /* end sweep phase */
       }
       lua_assert(old >= g->totalbytes);
@@ -607,7 +742,7 @@ static l_mem singlestep (lua_State *L) {
 }
 
 
-void luaC_step (lua_State *L) {
+static void incrementalstep (lua_State *L) {
   global_State *g = G(L);
   l_mem lim = (GCSTEPSIZE/100) * g->gcstepmul;
   if (lim == 0)
@@ -633,12 +768,49 @@ void luaC_step (lua_State *L) {
 }
 
 
-void luaC_fullgc (lua_State *L) {
+/*
+** Generational mode.  Objects that survive a collection keep their mark
+** (they become `old') instead of being turned back to white, and a
+** collection starts without markroot, so that the write barriers keep
+** working exactly like during an incremental mark: a new (white) object
+** stored into an old (black) one gets marked or the old object is put in
+** `grayagain'.  Threads and weak tables stay gray and in their lists
+** from one collection to the next, since stacks have no barriers and
+** weak tables must be cleared.  A minor collection is then the end of
+** that mark phase: it traverses only the objects reached from the
+** barriers, threads and weak tables, which are the young objects still
+** in use, and sweeps away the young ones that were not reached.  New
+** objects are linked at the head of `rootgc' and new userdata after
+** `mainthread', so the young objects are those in front of `oldgc' and
+** `oldudata', where the sweep stops (see sweepyoung).  The string table
+** is not swept: dead young strings wait for the next major collection.
+** A minor collection is done in steps, like an incremental cycle.  Old
+** objects that become garbage are only collected by a major collection,
+** a full collection done at once when the memory still in use grows too
+** much (see LUAI_GCMAJOR).
+*/
+static void fullgc (lua_State *L);
+
+static void generationalstep (lua_State *L) {
   global_State *g = G(L);
-  if (g->gcstate <= GCSpropagate) {
+  if (g->gcstate == GCSpause &&  /* between two collections? */
+      g->estimate > (g->gcmajorbase / 100) * LUAI_GCMAJOR)
+    fullgc(L);  /* old generation grew too much: major collection */
+  else
+    incrementalstep(L);  /* (part of) a minor collection */
+}
+
+
+static void fullgc (lua_State *L) {
+  global_State *g = G(L);
+  lu_byte kind = g->gckind;
+  /* in generational mode, all objects must be swept whatever the state */
+  if (g->gcstate <= GCSpropagate || g->oldgc != NULL) {
     /* reset sweep marks to sweep all elements (returning them to white) */
     g->sweepstrgc = 0;
     g->sweepgc = &g->rootgc;
+    g->oldgc = NULL;
+    g->oldudata = NULL;
     /* reset other collector lists */
     g->gray = NULL;
     g->grayagain = NULL;
@@ -646,26 +818,53 @@ void luaC_fullgc (lua_State *L) {
     g->gcstate = GCSsweepstring;
   }
   lua_assert(g->gcstate != GCSpause && g->gcstate != GCSpropagate);
-  /* finish any pending sweep phase */
+  /* finish any pending sweep phase, which must also turn old objects white */
+  g->gckind = KGC_NORMAL;
   while (g->gcstate != GCSfinalize) {
     lua_assert(g->gcstate == GCSsweepstring || g->gcstate == GCSsweep);
     singlestep(L);
   }
+  g->gckind = kind;
   markroot(L);
   while (g->gcstate != GCSpause) {
     singlestep(L);
   }
+  if (g->gckind == KGC_GEN)  /* everything left is now old */
+    g->gcmajorbase = g->estimate;
   setthreshold(g);
 }
 
 
+void luaC_step (lua_State *L) {
+  global_State *g = G(L);
+  gctimed(g, if (g->gckind == KGC_GEN) generationalstep(L);
+             else incrementalstep(L));
+}
+
+
+void luaC_fullgc (lua_State *L) {
+  gctimed(G(L), fullgc(L));
+}
+
+
+void luaC_changemode (lua_State *L, int mode) {
+  global_State *g = G(L);
+  if (mode == g->gckind) return;  /* nothing to change */
+  /* both ways, a full collection leaves the objects marked as the new
+     mode expects them: all old (marked) or all white */
+  g->gckind = cast_byte(mode);
+  gctimed(g, fullgc(L));
+}
+
+
 void luaC_barrierf (lua_State *L, GCObject *o, GCObject *v) {
   global_State *g = G(L);
   lua_assert(isblack(o) && iswhite(v) && !isdead(g, v) && !isdead(g, o));
-  lua_assert(g->gcstate != GCSfinalize && g->gcstate != GCSpause);
+  lua_assert(g->gckind == KGC_GEN ||
+             (g->gcstate != GCSfinalize && g->gcstate != GCSpause));
   lua_assert(ttype(&o->gch) != LUA_TTABLE);
-  /* must keep invariant? */
-  if (g->gcstate == GCSpropagate)
+  /* must keep invariant? (always, in generational mode) */
+  if (g->gcstate == GCSpropagate || g->gckind == KGC_GEN)
     reallymarkobject(g, v);  /* restore invariant */
   else  /* don't mind */
     makewhite(g, o);  /* mark as white just to avoid other barriers */
@@ -676,7 +875,8 @@ void luaC_barrierback (lua_State *L, Table *t) {
   global_State *g = G(L);
   GCObject *o = obj2gco(t);
   lua_assert(isblack(o) && !isdead(g, o));
-  lua_assert(g->gcstate != GCSfinalize && g->gcstate != GCSpause);
+  lua_assert(g->gckind == KGC_GEN ||
+             (g->gcstate != GCSfinalize && g->gcstate != GCSpause));
   black2gray(o);  /* make table gray (again) */
   t->gclist = g->grayagain;
   g->grayagain = o;
@@ -698,7 +898,7 @@ void luaC_linkupval (lua_State *L, UpVal *uv) {
   o->gch.next = g->rootgc;  /* link upvalue into `rootgc' list */
   g->rootgc = o;
   if (isgray(o)) { 
-    if (g->gcstate == GCSpropagate) {
+    if (g->gcstate == GCSpropagate || g->gckind == KGC_GEN) {
       gray2black(o);  /* closed upvalues need barrier */
       luaC_barrier(L, uv, uv->v);
     }
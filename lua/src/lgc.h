@@ -18,7 +18,15 @@
 #define GCSpropagate	1
 #define GCSsweepstring	2
 #define GCSsweep	3
-#define GCSfinalize	4
+#define GCSsweepudata	4	/* minor collections (KGC_GEN) only */
+#define GCSfinalize	5
+
+
+/*
+** Kinds of collection (see `gckind' in global_State)
+*/
+#define KGC_NORMAL	0
+#define KGC_GEN		1	/* generational: minor collections of young objects */
 
 
 /*
@@ -101,6 +109,7 @@ LUAI_FUNC void luaC_callGCTM (lua_State *L);
 LUAI_FUNC void luaC_freeall (lua_State *L);
 LUAI_FUNC void luaC_step (lua_State *L);
 LUAI_FUNC void luaC_fullgc (lua_State *L);
+LUAI_FUNC void luaC_changemode (lua_State *L, int mode);
 LUAI_FUNC void luaC_link (lua_State *L, GCObject *o, lu_byte tt);
 LUAI_FUNC void luaC_linkupval (lua_State *L, UpVal *uv);
 LUAI_FUNC void luaC_barrierf (lua_State *L, GCObject *o, GCObject *v);
@@ -237,6 +237,7 @@ typedef struct Proto {
   struct LocVar *locvars;  /* information about local variables */
   TString **upvalues;  /* upvalue names */
   TString  *source;
+  struct lua_SharedChunk *shared;  /* owner of `code' and `lineinfo', if any */
   int sizeupvalues;
   int sizek;  /* size of `k' */
   int sizecode;
@@ -167,9 +167,14 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   luaZ_initbuffer(L, &g->buff);
   g->panic = NULL;
   g->gcstate = GCSpause;
+  g->gckind = KGC_NORMAL;
   g->rootgc = obj2gco(L);
   g->sweepstrgc = 0;
   g->sweepgc = &g->rootgc;
+  g->oldgc = NULL;
+  g->oldudata = NULL;
+  g->newoldgc = NULL;
+  g->newoldudata = NULL;
   g->gray = NULL;
   g->grayagain = NULL;
   g->weak = NULL;
@@ -178,6 +183,8 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
   g->gcdept = 0;
+  g->gcmajorbase = 0;
+  g->gctime = 0;
   for (i=0; i<NUM_TAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != 0) {
     /* memory allocation error: free partial state */
@@ -71,9 +71,14 @@ typedef struct global_State {
   void *ud;         /* auxiliary data to `frealloc' */
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
+  lu_byte gckind;  /* kind of GC running (KGC_NORMAL or KGC_GEN) */
   int sweepstrgc;  /* position of sweep in `strt' */
   GCObject *rootgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* position of sweep in `rootgc' */
+  GCObject *oldgc;  /* first old object in `rootgc' (KGC_GEN) */
+  GCObject *oldudata;  /* first old userdata after `mainthread' (KGC_GEN) */
+  GCObject *newoldgc;  /* `oldgc' once the current minor sweep is done */
+  GCObject *newoldudata;  /* `oldudata' once the current minor sweep is done */
   GCObject *gray;  /* list of gray objects */
   GCObject *grayagain;  /* list of objects to be traversed atomically */
   GCObject *weak;  /* list of weak tables (to be cleared) */
@@ -83,6 +88,8 @@ typedef struct global_State {
   lu_mem totalbytes;  /* number of bytes currently allocated */
   lu_mem estimate;  /* an estimate of number of bytes actually in use */
   lu_mem gcdept;  /* how much GC is `behind schedule' */
+  lu_mem gcmajorbase;  /* `estimate' after the last major collection (KGC_GEN) */
+  lua_Number gctime;  /* nanoseconds spent collecting (LUA_GCTIMING) */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC `granularity' */
   lua_CFunction panic;  /* to be called in unprotected errors */
@@ -207,6 +207,19 @@ LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data);
 
 
+/*
+** shared chunks: a function compiled once and loaded in any number of
+** states (even in different threads), which all use the same copy of
+** its instructions and line information
+*/
+typedef struct lua_SharedChunk lua_SharedChunk;
+
+LUA_API lua_SharedChunk *(lua_newsharedchunk) (lua_State *L);
+LUA_API int   (lua_loadshared) (lua_State *L, lua_SharedChunk *sc,
+                                              const char *chunkname);
+LUA_API void  (lua_releaseshared) (lua_SharedChunk *sc);
+
+
 /*
 ** coroutine functions
 */
@@ -226,6 +239,10 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCSTEP		5
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
+#define LUA_GCGEN		8
+#define LUA_GCINC		9
+#define LUA_GCTIME		10
+#define LUA_GCTIMED		11
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
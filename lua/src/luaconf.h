@@ -313,6 +313,26 @@
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 
 
+/*
+@@ LUAI_GCMAJOR defines, in generational mode, how much the memory still in
+@* use after a minor collection may grow, as a percentage of what it was
+@* after the last major collection, before a major collection is done.
+** CHANGE it if you want major collections to happen more or less often.
+*/
+#define LUAI_GCMAJOR	200 /* major collection when old generation doubles */
+
+
+/*
+@@ LUA_GCTIMING makes the collector add up the time it spends working,
+@* which lua_gc(L, LUA_GCTIME, 0) then returns; lua_gc(L, LUA_GCTIMED, 0)
+@* tells whether it is defined.
+** CHANGE it (define it) if you want to measure the collector, as the
+** benchmarks do. It is off by default because it reads the clock twice
+** for every collector step.
+*/
+/* #define LUA_GCTIMING */
+
+
 
 /*
 @@ LUA_COMPAT_GETN controls compatibility with old getn behavior.
@@ -728,6 +748,30 @@ union luai_Cast { double l_d; long l_l; };
 #define luai_userstateyield(L,n)	((void)L)
 
 
+/*
+@@ luai_refcount is the type of the reference count of shared chunks.
+@@ luai_refincr/luai_refdecr increment/decrement it and return the new
+@* value.
+** CHANGE them if your compiler has no atomic operations.  Without
+** them, a shared chunk (see lua_newsharedchunk) may only be used by
+** states that all run in the same OS thread.
+*/
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define luai_refcount		long
+#define luai_refincr(r)		_InterlockedIncrement(&(r))
+#define luai_refdecr(r)		_InterlockedDecrement(&(r))
+#elif defined(__GNUC__)
+#define luai_refcount		long
+#define luai_refincr(r)		__sync_add_and_fetch(&(r), 1)
+#define luai_refdecr(r)		__sync_sub_and_fetch(&(r), 1)
+#else
+#define luai_refcount		long
+#define luai_refincr(r)		(++(r))
+#define luai_refdecr(r)		(--(r))
+#endif
+
+
 /*
 @@ LUA_INTFRMLEN is the length modifier for integer conversions
 @* in 'string.format'.
@@ -4,6 +4,7 @@
 ** See Copyright Notice in lua.h
 */
 
+#include <stdlib.h>
 #include <string.h>
 
 #define lundump_c
@@ -25,6 +26,8 @@ typedef struct {
  ZIO* Z;
  Mbuffer* b;
  const char* name;
+ lua_SharedChunk* shared;		/* where the code is, or NULL */
+ int nextproto;				/* index in shared->protos of next function */
 } LoadState;
 
 #ifdef LUAC_TRUST_BINARIES
@@ -51,6 +54,17 @@ static void LoadBlock(LoadState* S, void* b, size_t size)
  IF (r!=0, "unexpected end");
 }
 
+static void SkipBlock(LoadState* S, size_t size)
+{
+ char b[256];
+ while (size>0)
+ {
+  size_t n=(size<sizeof(b)) ? size : sizeof(b);
+  LoadBlock(S,b,n);
+  size-=n;
+ }
+}
+
 static int LoadChar(LoadState* S)
 {
  char x;
@@ -87,9 +101,19 @@ static TString* LoadString(LoadState* S)
  }
 }
 
-static void LoadCode(LoadState* S, Proto* f)
+static void LoadCode(LoadState* S, Proto* f, const SharedProto* sp)
 {
  int n=LoadInt(S);
+ if (sp!=NULL)
+ {
+  IF (n!=sp->sizecode, "bad shared code");
+  SkipBlock(S,n*sizeof(Instruction));
+  f->code=sp->code;
+  f->sizecode=n;
+  f->shared=S->shared;
+  luai_refincr(S->shared->refs);
+  return;
+ }
  f->code=luaM_newvector(S->L,n,Instruction);
  f->sizecode=n;
  LoadVector(S,f->code,n,sizeof(Instruction));
@@ -134,13 +158,22 @@ static void LoadConstants(LoadState* S, Proto* f)
  for (i=0; i<n; i++) f->p[i]=LoadFunction(S,f->source);
 }
 
-static void LoadDebug(LoadState* S, Proto* f)
+static void LoadDebug(LoadState* S, Proto* f, const SharedProto* sp)
 {
  int i,n;
  n=LoadInt(S);
- f->lineinfo=luaM_newvector(S->L,n,int);
+ if (sp!=NULL)
+ {
+  IF (n!=sp->sizelineinfo, "bad shared code");
+  SkipBlock(S,n*sizeof(int));
+  f->lineinfo=sp->lineinfo;
+ }
+ else
+ {
+  f->lineinfo=luaM_newvector(S->L,n,int);
+  LoadVector(S,f->lineinfo,n,sizeof(int));
+ }
  f->sizelineinfo=n;
- LoadVector(S,f->lineinfo,n,sizeof(int));
  n=LoadInt(S);
  f->locvars=luaM_newvector(S->L,n,LocVar);
  f->sizelocvars=n;
@@ -161,7 +194,13 @@ static void LoadDebug(LoadState* S, Proto* f)
 static Proto* LoadFunction(LoadState* S, TString* p)
 {
  Proto* f;
+ const SharedProto* sp=NULL;
  if (++S->L->nCcalls > LUAI_MAXCCALLS) error(S,"code too deep");
+ if (S->shared!=NULL)
+ {
+  IF (S->nextproto>=S->shared->nprotos, "bad shared code");
+  sp=&S->shared->protos[S->nextproto++];
+ }
  f=luaF_newproto(S->L);
  setptvalue2s(S->L,S->L->top,f); incr_top(S->L);
  f->source=LoadString(S); if (f->source==NULL) f->source=p;
@@ -171,10 +210,11 @@ static Proto* LoadFunction(LoadState* S, TString* p)
  f->numparams=LoadByte(S);
  f->is_vararg=LoadByte(S);
  f->maxstacksize=LoadByte(S);
- LoadCode(S,f);
+ LoadCode(S,f,sp);
  LoadConstants(S,f);
- LoadDebug(S,f);
- IF (!luaG_checkcode(f), "bad code");
+ LoadDebug(S,f,sp);
+ /* shared code was checked when the chunk was loaded the first time */
+ IF (sp==NULL && !luaG_checkcode(f), "bad code");
  S->L->top--;
  S->L->nCcalls--;
  return f;
@@ -192,7 +232,7 @@ static void LoadHeader(LoadState* S)
 /*
 ** load precompiled chunk
 */
-Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
+Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name, lua_SharedChunk* shared)
 {
  LoadState S;
  if (*name=='@' || *name=='=')
@@ -204,10 +244,83 @@ Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
  S.L=L;
  S.Z=Z;
  S.b=buff;
+ S.shared=shared;
+ S.nextproto=0;
  LoadHeader(&S);
  return LoadFunction(&S,luaS_newliteral(L,"=?"));
 }
 
+static void CountProtos(const Proto* f, int* n, size_t* size)
+{
+ int i;
+ (*n)++;
+ *size+=f->sizecode*sizeof(Instruction)+f->sizelineinfo*sizeof(int);
+ for (i=0; i<f->sizep; i++) CountProtos(f->p[i],n,size);
+}
+
+static void CopyProtos(const Proto* f, SharedProto** sp, char** b)
+{
+ int i;
+ SharedProto* s=(*sp)++;
+ s->sizecode=f->sizecode;
+ s->code=(Instruction*)*b;
+ memcpy(s->code,f->code,f->sizecode*sizeof(Instruction));
+ *b+=f->sizecode*sizeof(Instruction);
+ s->sizelineinfo=f->sizelineinfo;
+ s->lineinfo=(int*)*b;
+ memcpy(s->lineinfo,f->lineinfo,f->sizelineinfo*sizeof(int));
+ *b+=f->sizelineinfo*sizeof(int);
+ /* same order as LoadFunction: a function, then the ones inside it */
+ for (i=0; i<f->sizep; i++) CopyProtos(f->p[i],sp,b);
+}
+
+static int CountWriter(lua_State* L, const void* p, size_t size, void* u)
+{
+ UNUSED(L); UNUSED(p);
+ *(size_t*)u+=size;
+ return 0;
+}
+
+static int CopyWriter(lua_State* L, const void* p, size_t size, void* u)
+{
+ UNUSED(L);
+ memcpy(*(char**)u,p,size);
+ *(char**)u+=size;
+ return 0;
+}
+
+/*
+** make a shared chunk of a function and the ones inside it
+*/
+lua_SharedChunk* luaU_newshared (lua_State* L, const Proto* f)
+{
+ lua_SharedChunk* sc;
+ SharedProto* sp;
+ char* b;
+ int nprotos=0;
+ size_t sizecode=0,sizedump=0;
+ CountProtos(f,&nprotos,&sizecode);
+ luaU_dump(L,f,CountWriter,&sizedump,0);
+ /* Instructions and ints need no more alignment than SharedProto */
+ sc=(lua_SharedChunk*)malloc(sizeof(lua_SharedChunk)+nprotos*sizeof(SharedProto)+sizecode+sizedump);
+ if (sc==NULL) return NULL;
+ sc->refs=1;
+ sc->nprotos=nprotos;
+ sc->protos=(SharedProto*)(sc+1);
+ sp=sc->protos;
+ b=(char*)(sc->protos+nprotos);
+ CopyProtos(f,&sp,&b);
+ sc->sizedump=sizedump;
+ sc->dump=b;
+ luaU_dump(L,f,CopyWriter,&b,0);
+ return sc;
+}
+
+void luaU_releaseshared (lua_SharedChunk* sc)
+{
+ if (luai_refdecr(sc->refs)==0) free(sc);
+}
+
 /*
 * make header
 */
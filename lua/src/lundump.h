@@ -10,8 +10,37 @@
 #include "lobject.h"
 #include "lzio.h"
 
-/* load one chunk; from lundump.c */
-LUAI_FUNC Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name);
+/*
+** code and line information of one function of a shared chunk
+*/
+typedef struct SharedProto {
+ Instruction* code;
+ int* lineinfo;
+ int sizecode;
+ int sizelineinfo;
+} SharedProto;
+
+/*
+** a chunk shared by several states: each state loads its own Protos from
+** `dump' (constants, nested functions, debug names), but their `code' and
+** `lineinfo' point into `protos', which is never written to.  The chunk
+** lives in a single block from malloc, since it outlives the state that
+** made it and is freed by whichever state or thread releases it last.
+*/
+struct lua_SharedChunk {
+ volatile luai_refcount refs;		/* the handle plus every Proto using it */
+ int nprotos;
+ SharedProto* protos;			/* in the order luaU_undump loads them */
+ size_t sizedump;
+ const char* dump;			/* the chunk, as written by luaU_dump */
+};
+
+/* load one chunk, sharing the code of `shared' if not NULL; from lundump.c */
+LUAI_FUNC Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name, lua_SharedChunk* shared);
+
+/* make and release shared chunks; from lundump.c */
+LUAI_FUNC lua_SharedChunk* luaU_newshared (lua_State* L, const Proto* f);
+LUAI_FUNC void luaU_releaseshared (lua_SharedChunk* sc);
 
 /* make header; from lundump.c */
 LUAI_FUNC void luaU_header (char* h);
@@ -0,0 +1,179 @@
+/*
+Copyright (c) 2010, Pierre KRIEGER
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "LuaAllocator.h"
+#include <cstdlib>
+#include <cstring>
+#include "../../common/boost/boost/thread/tss.hpp"
+
+#if defined(_MSC_VER)
+#	define LUA_ALLOCATOR_THREAD_LOCAL		__declspec(thread)
+#else
+#	define LUA_ALLOCATOR_THREAD_LOCAL		__thread
+#endif
+
+namespace {
+	// the free lists of one thread ; the first bytes of a free block store the pointer to the next one
+	struct ThreadCache {
+		enum { maxBlocksPerClass = 256 };		// above this, freed blocks go back to the heap instead of being kept
+
+		void*		freeLists[Lua::LuaAllocator::sizeClasses];
+		size_t		freeCounts[Lua::LuaAllocator::sizeClasses];
+
+		ThreadCache() {
+			for (size_t i = 0; i < Lua::LuaAllocator::sizeClasses; ++i) {
+				freeLists[i] = nullptr;
+				freeCounts[i] = 0;
+			}
+		}
+
+		~ThreadCache();
+	};
+
+	// the pointer is what the allocator uses since compiler-supported thread locals are much faster to read,
+	//   and the thread_specific_ptr owns the same cache so that it is destroyed when its thread exits
+	LUA_ALLOCATOR_THREAD_LOCAL ThreadCache*		currentThreadCache = nullptr;
+	boost::thread_specific_ptr<ThreadCache>		threadCacheOwner;
+
+	ThreadCache::~ThreadCache() {
+		for (size_t i = 0; i < Lua::LuaAllocator::sizeClasses; ++i) {
+			while (freeLists[i] != nullptr) {
+				void* next = *(void**)freeLists[i];
+				std::free(freeLists[i]);
+				freeLists[i] = next;
+			}
+		}
+		if (currentThreadCache == this)
+			currentThreadCache = nullptr;
+	}
+
+	ThreadCache& getThreadCache() {
+		if (currentThreadCache == nullptr) {
+			currentThreadCache = new ThreadCache();
+			threadCacheOwner.reset(currentThreadCache);
+		}
+		return *currentThreadCache;
+	}
+
+	// "size" must be between 1 and maxPooledSize
+	size_t getSizeClass(size_t size) {
+		return (size - 1) / Lua::LuaAllocator::granularity;
+	}
+
+	void* allocateBlock(size_t size) {
+		if (size > Lua::LuaAllocator::maxPooledSize)
+			return std::malloc(size);
+
+		const size_t sizeClass = getSizeClass(size);
+		ThreadCache& cache = getThreadCache();
+		void* block = cache.freeLists[sizeClass];
+		if (block == nullptr)
+			return std::malloc((sizeClass + 1) * Lua::LuaAllocator::granularity);
+
+		cache.freeLists[sizeClass] = *(void**)block;
+		--cache.freeCounts[sizeClass];
+		return block;
+	}
+
+	// "size" is the size the block was allocated with, or any smaller size (the block is then only reused for smaller sizes)
+	void freeBlock(void* block, size_t size) {
+		if (size == 0 || size > Lua::LuaAllocator::maxPooledSize) {
+			std::free(block);
+			return;
+		}
+
+		const size_t sizeClass = getSizeClass(size);
+		ThreadCache& cache = getThreadCache();
+		if (cache.freeCounts[sizeClass] >= ThreadCache::maxBlocksPerClass) {
+			std::free(block);
+			return;
+		}
+
+		*(void**)block = cache.freeLists[sizeClass];
+		cache.freeLists[sizeClass] = block;
+		++cache.freeCounts[sizeClass];
+	}
+}
+
+void* Lua::LuaAllocator::allocate(void* ud, void* ptr, size_t osize, size_t nsize) {
+	LuaAllocator& me = *((LuaAllocator*)ud);
+
+	// freeing a block
+	if (nsize == 0) {
+		if (ptr != nullptr) {
+			freeBlock(ptr, osize);
+			me._bytesInUse -= osize;
+			--me._objectsInUse;
+		}
+		return nullptr;
+	}
+
+	// growing over the limit, osize is 0 when allocating a new block
+	if (me._limitEnforced && me._limit != 0 && nsize > osize && me._bytesInUse + (nsize - osize) > me._limit)
+		return nullptr;
+
+	// allocating a new block
+	if (ptr == nullptr) {
+		void* block = allocateBlock(nsize);
+		if (block == nullptr)
+			return nullptr;
+		me._bytesInUse += nsize;
+		if (me._bytesInUse > me._peakBytesInUse)
+			me._peakBytesInUse = me._bytesInUse;
+		++me._objectsInUse;
+		++me._totalAllocations;
+		me._totalBytesAllocated += nsize;
+		return block;
+	}
+
+	// resizing a block, which can be done in place when both sizes are in the same size class
+	void* block = nullptr;
+	if (osize > maxPooledSize && nsize > maxPooledSize)
+		block = std::realloc(ptr, nsize);
+	else if (osize <= maxPooledSize && nsize <= maxPooledSize && getSizeClass(osize) == getSizeClass(nsize))
+		block = ptr;
+	else if ((block = allocateBlock(nsize)) != nullptr) {
+		std::memcpy(block, ptr, (osize < nsize) ? osize : nsize);
+		freeBlock(ptr, osize);
+	}
+
+	if (block == nullptr) {
+		// lua assumes shrinking a block never fails, and the old block is large enough anyway
+		if (nsize > osize)
+			return nullptr;
+		block = ptr;
+	}
+
+	me._bytesInUse += nsize;
+	me._bytesInUse -= osize;
+	if (nsize > osize)
+		me._totalBytesAllocated += nsize - osize;
+	if (me._bytesInUse > me._peakBytesInUse)
+		me._peakBytesInUse = me._bytesInUse;
+	return block;
+}
@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2010, Pierre KRIEGER
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef INCLUDE_LUA_LUAALLOCATOR_H
+#define INCLUDE_LUA_LUAALLOCATOR_H
+
+#include <cstddef>
+
+namespace Lua {
+	/**	\brief Memory allocator of a single lua_State, given to lua_newstate by LuaContext
+		\details Small blocks are rounded up to a size class and recycled through free lists kept by each thread, so that
+				the many small objects of lua (strings, tables, node arrays, closures, upvalues...) rarely reach malloc, and
+				threads running different states don't contend on the heap. A block goes back to the lists of the thread
+				freeing it, so a state may move from one thread to another. Larger blocks go straight to realloc and free.
+				The counters are only modified by the thread currently running the state, like the state itself.
+
+				A limit can be put on the number of bytes in use. While it is enforced, an allocation that would go over it
+				fails, which lua turns into a "not enough memory" error (LUA_ERRMEM) inside the running script. LuaContext only
+				enforces it while lua code runs in protected mode, since an allocation failing outside of it would make lua panic.
+	*/
+	class LuaAllocator {
+	public:
+		enum {
+			granularity = 16,				// size classes are multiples of this (and at least the size of a pointer)
+			maxPooledSize = 256,			// blocks larger than this are not pooled
+			sizeClasses = maxPooledSize / granularity
+		};
+
+		LuaAllocator() : _bytesInUse(0), _peakBytesInUse(0), _objectsInUse(0), _totalAllocations(0), _totalBytesAllocated(0), _limit(0), _limitEnforced(false) {}
+
+		/// \brief The lua_Alloc function, "ud" must be a pointer to the LuaAllocator of the state
+		static void*		allocate(void* ud, void* ptr, size_t osize, size_t nsize);
+
+		/// \brief Returns the number of bytes lua is currently using (as requested, not rounded up to the size classes)
+		size_t				bytesInUse() const								{ return _bytesInUse; }
+		/// \brief Returns the highest value bytesInUse has reached since the state was created
+		size_t				peakBytesInUse() const							{ return _peakBytesInUse; }
+		/// \brief Starts measuring peakBytesInUse again from the current bytesInUse
+		void				resetPeak()										{ _peakBytesInUse = _bytesInUse; }
+		/// \brief Returns the number of blocks lua is currently using
+		size_t				objectsInUse() const							{ return _objectsInUse; }
+		/// \brief Returns the number of blocks allocated since the state was created
+		size_t				totalAllocations() const						{ return _totalAllocations; }
+		/// \brief Returns the number of bytes allocated since the state was created, counting what a block grows by when it is resized
+		unsigned long long	totalBytesAllocated() const						{ return _totalBytesAllocated; }
+
+		/// \brief Returns the maximum number of bytes lua may use, 0 meaning no limit
+		size_t				limit() const									{ return _limit; }
+		/// \brief Sets the maximum number of bytes lua may use, 0 meaning no limit
+		/// \details Lowering the limit below bytesInUse frees nothing, it only makes the next growing allocations fail
+		void				setLimit(size_t bytes)							{ _limit = bytes; }
+		/// \brief Turns the enforcement of the limit on or off and returns the previous state
+		bool				enforceLimit(bool enforce)						{ bool previous = _limitEnforced; _limitEnforced = enforce; return previous; }
+
+	private:
+		// forbidding copy, lua keeps a pointer to us
+		LuaAllocator(const LuaAllocator&);
+		LuaAllocator& operator=(const LuaAllocator&);
+
+		size_t				_bytesInUse;
+		size_t				_peakBytesInUse;
+		size_t				_objectsInUse;
+		size_t				_totalAllocations;
+		unsigned long long	_totalBytesAllocated;
+		size_t				_limit;
+		bool				_limitEnforced;
+	};
+}
+
+#endif
@@ -26,52 +26,801 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "LuaContext.h"
+#include <cstdio>
+#include <iterator>
+#include <iomanip>
+#include <set>
 
-Lua::LuaContext::LuaContext() {
-	_state = luaL_newstate();
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	include <Windows.h>
+#else
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#	include <time.h>
+#endif
+
+Lua::MappedFile::MappedFile(const std::string& fileName) : _open(false), _data(nullptr), _size(0), _mapping(nullptr) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		// nothing to map
+	} else if (fileSize.QuadPart == 0) {
+		_open = true;		// CreateFileMapping refuses empty files
+	} else {
+		// the mapping object keeps the file open, so the file handle can be closed right away
+		_mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (_mapping != NULL) {
+			_data = (const char*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+			_size = size_t(fileSize.QuadPart);
+			_open = (_data != nullptr);
+		}
+	}
+	CloseHandle(file);
+#else
+	int file = open(fileName.c_str(), O_RDONLY);
+	if (file < 0)
+		return;
+
+	struct stat fileInfo;
+	if (fstat(file, &fileInfo) != 0) {
+		// nothing to map
+	} else if (fileInfo.st_size == 0) {
+		_open = true;		// mmap refuses empty files
+	} else {
+		// the mapping stays valid after the file descriptor is closed
+		void* data = mmap(nullptr, size_t(fileInfo.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+		if (data != MAP_FAILED) {
+			_data = (const char*)data;
+			_size = size_t(fileInfo.st_size);
+			_open = true;
+		}
+	}
+	close(file);
+#endif
+}
+
+Lua::MappedFile::~MappedFile() {
+#ifdef _WIN32
+	if (_data != nullptr)		UnmapViewOfFile(_data);
+	if (_mapping != nullptr)	CloseHandle((HANDLE)_mapping);
+#else
+	if (_data != nullptr)		munmap((void*)_data, _size);
+#endif
+}
+
+// nanoseconds from an arbitrary point, to time the C++ functions called by lua
+static unsigned long long clockNanoSeconds() {
+#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (unsigned long long)(count.QuadPart / frequency.QuadPart) * 1000000000ULL
+		+ (unsigned long long)(count.QuadPart % frequency.QuadPart) * 1000000000ULL / (unsigned long long)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+#endif
+}
+
+// same as the panic function luaL_newstate installs
+static int panic(lua_State* l) {
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(l, -1));
+	return 0;
+}
+
+Lua::LuaContext::LuaContext() : _gcCycles(0), _closing(false), _gcMicroSeconds(0), _gcTimeRead(0), _gcStopped(false), _profiling(false), _profileInterval(0), _profileSamples(0), _snapshotBytes(0) {
+	// like luaL_newstate, but with our own allocator instead of realloc
+	_state = lua_newstate(&LuaAllocator::allocate, &_allocator);
+	if (_state == nullptr)
+		throw(std::bad_alloc());
+	lua_atpanic(_state, &panic);
 	luaL_openlibs(_state);
+
+	// the metatable shared by all the sentinels
+	luaL_newmetatable(_state, "_gcSentinel");
+	lua_pushcfunction(_state, &_gcSentinelFinalizer);
+	lua_setfield(_state, -2, "__gc");
+	lua_pop(_state, 1);
+	_createGCSentinel(_state, this);
+}
+
+void Lua::LuaContext::_createGCSentinel(lua_State* state, LuaContext* context) {
+	LuaContext** sentinel = (LuaContext**)lua_newuserdata(state, sizeof(LuaContext*));
+	*sentinel = context;
+	luaL_getmetatable(state, "_gcSentinel");
+	lua_setmetatable(state, -2);
+	lua_pop(state, 1);
+}
+
+int Lua::LuaContext::_gcSentinelFinalizer(lua_State* state) {
+	LuaContext* context = *(LuaContext**)lua_touserdata(state, 1);
+	if (context->_closing)
+		return 0;
+
+	// the next sentinel must not fail because of the memory limit, or there would be nothing left to count the cycles
+	++context->_gcCycles;
+	const bool limitEnforced = context->_allocator.enforceLimit(false);
+	_createGCSentinel(state, context);
+	context->_allocator.enforceLimit(limitEnforced);
+	return 0;
+}
+
+Lua::LuaContext::MemoryStatistics Lua::LuaContext::getMemoryStatistics() const {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	MemoryStatistics statistics;
+	statistics.bytesInUse = _allocator.bytesInUse();
+	statistics.peakBytesInUse = _allocator.peakBytesInUse();
+	statistics.objectsInUse = _allocator.objectsInUse();
+	statistics.totalAllocations = _allocator.totalAllocations();
+	statistics.memoryLimit = _allocator.limit();
+	statistics.gcCycles = _gcCycles;
+	statistics.totalBytesAllocated = _allocator.totalBytesAllocated();
+	statistics.gcMicroSeconds = _readGCMicroSeconds();
+	return statistics;
+}
+
+void Lua::LuaContext::getAllocationCounters(unsigned long long& totalBytesAllocated, unsigned long long& gcMicroSeconds) const {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+	totalBytesAllocated = _allocator.totalBytesAllocated();
+	gcMicroSeconds = _readGCMicroSeconds();
+}
+
+bool Lua::LuaContext::isGarbageCollectionTimed() const {
+	// a constant of the lua build, so the state doesn't need to be locked
+	return lua_gc(_state, LUA_GCTIMED, 0) != 0;
+}
+
+unsigned long long Lua::LuaContext::_readGCMicroSeconds() const {
+	const int gcTime = lua_gc(_state, LUA_GCTIME, 0);
+	_gcMicroSeconds += (unsigned int)(gcTime - _gcTimeRead) & 0x7FFFFFFF;
+	_gcTimeRead = gcTime;
+	return _gcMicroSeconds;
+}
+
+void Lua::LuaContext::setCallbackObserver(std::function<void (unsigned long long)> observer) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+	_callbackObserver = observer;
+}
+
+void Lua::LuaContext::setMemoryLimit(size_t bytes) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+	_allocator.setLimit(bytes);
+}
+
+int Lua::LuaContext::setGarbageCollectorPause(int percent) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+	return lua_gc(_state, LUA_GCSETPAUSE, percent);
+}
+
+int Lua::LuaContext::setGarbageCollectorStepMultiplier(int percent) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+	return lua_gc(_state, LUA_GCSETSTEPMUL, percent);
+}
+
+void Lua::LuaContext::stopGarbageCollector() {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+	_gcStopped = true;
+	lua_gc(_state, LUA_GCSTOP, 0);
+}
+
+void Lua::LuaContext::restartGarbageCollector() {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+	_gcStopped = false;
+	lua_gc(_state, LUA_GCRESTART, 0);
+}
+
+bool Lua::LuaContext::stepGarbageCollector() {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	// with a size of 0, lua_gc does a single step of luaC_step ; the step sets the threshold of the next one, which
+	//   would have the collector run while lua code runs again
+	const bool cycleCompleted = (lua_gc(_state, LUA_GCSTEP, 0) != 0);
+	if (_gcStopped)
+		lua_gc(_state, LUA_GCSTOP, 0);
+	return cycleCompleted;
+}
+
+bool Lua::LuaContext::setGenerationalGarbageCollector(bool enabled) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	// the full collection done by the switch restarts the collector, like collectgarbage() does
+	const bool wasGenerational = (lua_gc(_state, enabled ? LUA_GCGEN : LUA_GCINC, 0) != 0);
+	if (_gcStopped)
+		lua_gc(_state, LUA_GCSTOP, 0);
+	return wasGenerational;
+}
+
+// its address is the registry key of the context profiled
+static char profilerKey;
+
+// deeper stacks are cut, keeping the innermost functions, so that a runaway recursion doesn't make each sample slower
+static const size_t profilerMaxFrames = 64;
+
+void Lua::LuaContext::startProfiler(int instructionsPerSample) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+	if (instructionsPerSample <= 0)
+		instructionsPerSample = 1;
+
+	// set again each time, since resetToSnapshot removes it along with everything added to the registry since the snapshot
+	lua_pushlightuserdata(_state, &profilerKey);
+	lua_pushlightuserdata(_state, this);
+	lua_rawset(_state, LUA_REGISTRYINDEX);
+
+	// the coroutines created from now on get the hook from _state, the ones already there when they are next resumed
+	lua_sethook(_state, &_profilerHook, LUA_MASKCOUNT, instructionsPerSample);
+	_profiling = true;
+	_profileInterval = instructionsPerSample;
+}
+
+void Lua::LuaContext::stopProfiler() {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+	if (!_profiling)
+		return;
+	lua_sethook(_state, nullptr, 0, 0);
+	_profiling = false;
+	_profileInterval = 0;
+}
+
+Lua::LuaContext::Profile Lua::LuaContext::getProfile() const {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	Profile profile;
+	profile.samples = _profileSamples;
+	profile.instructionsPerSample = _profileInterval;
+	for (auto stack = _profileStacks.begin(); stack != _profileStacks.end(); ++stack) {
+		std::string name;
+		for (auto frame = stack->first.begin(); frame != stack->first.end(); ++frame) {
+			if (frame != stack->first.begin())
+				name += ';';
+			name += (*frame < _profileFrames.size()) ? _profileFrames[*frame].displayName : std::string("...");
+		}
+		profile.stacks[name] += stack->second;
+		if (stack->first.back() < _profileFrames.size())
+			profile.functions[_profileFrames[stack->first.back()].displayName] += stack->second;
+	}
+	for (auto line = _profileLines.begin(); line != _profileLines.end(); ++line) {
+		std::ostringstream name;
+		name << _profileFrames[line->first.first].shortSource << ":" << line->first.second;
+		profile.lines[name.str()] += line->second;
+	}
+	return profile;
+}
+
+void Lua::LuaContext::clearProfile() {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+	_clearProfile();
+}
+
+void Lua::LuaContext::_clearProfile() {
+	_profileSamples = 0;
+	_profileFrameIds.clear();
+	_profileFrames.clear();
+	_profileStacks.clear();
+	_profileLines.clear();
+}
+
+bool Lua::LuaContext::ProfileFrameKey::operator<(const ProfileFrameKey& other) const {
+	if (source != other.source)				return std::less<const char*>()(source, other.source);
+	if (name != other.name)					return std::less<const char*>()(name, other.name);
+	if (lineDefined != other.lineDefined)	return lineDefined < other.lineDefined;
+	return what < other.what;
+}
+
+void Lua::LuaContext::_syncProfilerHook(lua_State* thread) {
+	// only touches the hook of coroutines that disagree with the profiler, so a debug.sethook hook survives while it is stopped
+	if ((lua_gethook(thread) == &_profilerHook) == _profiling)
+		return;
+	if (_profiling)
+		lua_sethook(thread, &_profilerHook, LUA_MASKCOUNT, _profileInterval);
+	else
+		lua_sethook(thread, nullptr, 0, 0);
+}
+
+void Lua::LuaContext::_profilerHook(lua_State* state, lua_Debug*) {
+	// a lightuserdata key doesn't allocate anything, the memory limit and the collector are left alone
+	lua_pushlightuserdata(state, &profilerKey);
+	lua_rawget(state, LUA_REGISTRYINDEX);
+	LuaContext* context = (LuaContext*)lua_touserdata(state, -1);
+	lua_pop(state, 1);
+	if (context != nullptr && context->_profiling)
+		context->_takeProfileSample(state);
+}
+
+size_t Lua::LuaContext::_getProfileFrame(const lua_Debug& frame) {
+	ProfileFrameKey key;
+	key.source = frame.source;
+	key.name = frame.name;
+	key.lineDefined = frame.linedefined;
+	key.what = *frame.what;
+
+	auto found = _profileFrameIds.find(key);
+	if (found != _profileFrameIds.end()) {
+		const ProfileFrame& known = _profileFrames[found->second];
+		if (known.source == frame.source && known.name == ((frame.name != nullptr) ? frame.name : ""))
+			return found->second;
+	}
+
+	ProfileFrame newFrame;
+	newFrame.source = frame.source;
+	newFrame.name = (frame.name != nullptr) ? frame.name : "";
+	newFrame.shortSource = frame.short_src;
+	if (key.what == 'm')
+		newFrame.displayName = "main chunk";
+	else if (key.what == 't')
+		newFrame.displayName = "(tail call)";
+	else
+		newFrame.displayName = (frame.name != nullptr) ? frame.name : "?";
+	if (key.what == 'C') {
+		newFrame.displayName += " [C]";
+	} else if (key.what != 't') {
+		std::ostringstream location;
+		location << " (" << frame.short_src;
+		if (key.what != 'm')
+			location << ":" << frame.linedefined;
+		location << ")";
+		newFrame.displayName += location.str();
+	}
+	// ';' separates the functions of the collapsed stacks
+	std::replace(newFrame.displayName.begin(), newFrame.displayName.end(), ';', ':');
+
+	_profileFrames.push_back(newFrame);
+	_profileFrameIds[key] = _profileFrames.size() - 1;
+	return _profileFrames.size() - 1;
+}
+
+void Lua::LuaContext::_takeProfileSample(lua_State* state) {
+	// count hooks only run in lua functions, so the innermost frame is always one with a current line
+	lua_Debug frame;
+	int currentLine = 0;
+	_profileStack.clear();
+	while (lua_getstack(state, (int)_profileStack.size(), &frame) != 0) {
+		if (_profileStack.size() == profilerMaxFrames) {
+			_profileStack.push_back(size_t(-1));		// shown as "..."
+			break;
+		}
+		lua_getinfo(state, "Snl", &frame);
+		if (_profileStack.empty())
+			currentLine = frame.currentline;
+		_profileStack.push_back(_getProfileFrame(frame));
+	}
+	if (_profileStack.empty())
+		return;
+
+	++_profileSamples;
+	++_profileLines[std::make_pair(_profileStack.front(), currentLine)];
+	std::reverse(_profileStack.begin(), _profileStack.end());
+	++_profileStacks[_profileStack];
+}
+
+void Lua::LuaContext::Profile::writeFlatProfile(std::ostream& output) const {
+	if (samples == 0) {
+		output << "No samples" << std::endl;
+		return;
+	}
+
+	// a function is counted once per sample in its total, even when it appears several times in the stack
+	std::map<std::string, size_t> totals;
+	std::set<std::string> seen;
+	for (auto stack = stacks.begin(); stack != stacks.end(); ++stack) {
+		seen.clear();
+		size_t start = 0;
+		while (start <= stack->first.size()) {
+			size_t end = stack->first.find(';', start);
+			if (end == std::string::npos)
+				end = stack->first.size();
+			const std::string name = stack->first.substr(start, end - start);
+			if (seen.insert(name).second)
+				totals[name] += stack->second;
+			start = end + 1;
+		}
+	}
+
+	std::vector<std::pair<size_t, std::string>> sorted;
+	for (auto function = functions.begin(); function != functions.end(); ++function)
+		sorted.push_back(std::make_pair(function->second, function->first));
+	std::sort(sorted.begin(), sorted.end(), [](const std::pair<size_t, std::string>& a, const std::pair<size_t, std::string>& b) { return a.first > b.first; });
+
+	output << std::fixed << std::setprecision(2);
+	output << "   self%   total%    samples  function" << std::endl;
+	for (auto entry = sorted.begin(); entry != sorted.end(); ++entry)
+		output << std::setw(8) << (100.0 * entry->first / samples) << " " << std::setw(8) << (100.0 * totals[entry->second] / samples)
+			<< " " << std::setw(10) << entry->first << "  " << entry->second << std::endl;
+
+	sorted.clear();
+	for (auto line = lines.begin(); line != lines.end(); ++line)
+		sorted.push_back(std::make_pair(line->second, line->first));
+	std::sort(sorted.begin(), sorted.end(), [](const std::pair<size_t, std::string>& a, const std::pair<size_t, std::string>& b) { return a.first > b.first; });
+
+	output << std::endl << "   self%             samples  line" << std::endl;
+	for (auto entry = sorted.begin(); entry != sorted.end(); ++entry)
+		output << std::setw(8) << (100.0 * entry->first / samples) << "          " << std::setw(10) << entry->first << "  " << entry->second << std::endl;
+}
+
+void Lua::LuaContext::Profile::writeCollapsedStacks(std::ostream& output) const {
+	for (auto stack = stacks.begin(); stack != stacks.end(); ++stack)
+		output << stack->first << " " << stack->second << std::endl;
+}
+
+void Lua::LuaContext::takeSnapshot() {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	// the previous snapshot must not become part of the new one
+	lua_pushnil(_state);
+	lua_setfield(_state, LUA_REGISTRYINDEX, "_snapshot");
+
+	// "seen" keeps a table reachable in several ways (package.loaded is also _LOADED in the registry) from being recorded twice
+	lua_newtable(_state);
+	const int entries = lua_gettop(_state);
+	lua_newtable(_state);
+	const int seen = lua_gettop(_state);
+
+	lua_pushvalue(_state, LUA_GLOBALSINDEX);
+	_snapshotTable(_state, entries, seen, 2);
+	lua_pushvalue(_state, LUA_REGISTRYINDEX);
+	_snapshotTable(_state, entries, seen, 1);
+	lua_pushliteral(_state, "");
+	if (lua_getmetatable(_state, -1))
+		_snapshotTable(_state, entries, seen, 0);
+	lua_pop(_state, 2);
+
+	lua_setfield(_state, LUA_REGISTRYINDEX, "_snapshot");
+
+	// what is in use now is the reference resetToSnapshot compares the garbage left behind with
+	lua_gc(_state, LUA_GCCOLLECT, 0);
+	_snapshotBytes = _allocator.bytesInUse();
+}
+
+void Lua::LuaContext::_snapshotTable(lua_State* state, int entries, int seen, int depth) {
+	const int table = lua_gettop(state);
+	lua_pushvalue(state, table);
+	lua_rawget(state, seen);
+	const bool alreadySeen = !lua_isnil(state, -1);
+	lua_pop(state, 1);
+	if (alreadySeen) {
+		lua_pop(state, 1);
+		return;
+	}
+	lua_pushvalue(state, table);
+	lua_pushboolean(state, 1);
+	lua_rawset(state, seen);
+
+	// the entry is { table, copy, metatable, number of fields }
+	luaL_checkstack(state, 6, "snapshot too deep");
+	lua_createtable(state, 4, 0);
+	lua_pushvalue(state, table);
+	lua_rawseti(state, -2, 1);
+	lua_newtable(state);
+	int fields = 0;
+	lua_pushnil(state);
+	while (lua_next(state, table) != 0) {
+		lua_pushvalue(state, -2);
+		lua_insert(state, -2);
+		lua_rawset(state, -4);
+		++fields;
+	}
+	lua_rawseti(state, -2, 2);
+	if (lua_getmetatable(state, table))
+		lua_rawseti(state, -2, 3);
+	lua_pushinteger(state, fields);
+	lua_rawseti(state, -2, 4);
+	lua_rawseti(state, entries, (int)lua_objlen(state, entries) + 1);
+
+	if (depth > 0) {
+		lua_pushnil(state);
+		while (lua_next(state, table) != 0) {
+			if (lua_istable(state, -1))
+				_snapshotTable(state, entries, seen, depth - 1);
+			else
+				lua_pop(state, 1);
+		}
+	}
+	lua_pop(state, 1);
+}
+
+bool Lua::LuaContext::resetToSnapshot() {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	lua_settop(_state, 0);
+	lua_getfield(_state, LUA_REGISTRYINDEX, "_snapshot");
+	if (!lua_istable(_state, -1)) {
+		lua_pop(_state, 1);
+		return false;
+	}
+	const int snapshot = lua_gettop(_state);
+
+	// a hook set through the debug library would stay on otherwise, and the profile belongs to the code run before
+	lua_sethook(_state, nullptr, 0, 0);
+	_profiling = false;
+	_profileInterval = 0;
+	_clearProfile();
+	_callbackObserver = std::function<void (unsigned long long)>();
+
+	const int count = (int)lua_objlen(_state, snapshot);
+	for (int i = 1; i <= count; ++i) {
+		lua_rawgeti(_state, snapshot, i);
+		const int entry = lua_gettop(_state);
+		lua_rawgeti(_state, entry, 1);
+		const int table = lua_gettop(_state);
+		lua_rawgeti(_state, entry, 2);
+		const int copy = lua_gettop(_state);
+		lua_rawgeti(_state, entry, 4);
+		const int recordedFields = (int)lua_tointeger(_state, -1);
+		lua_pop(_state, 1);
+
+		// removes the fields added since the snapshot (which lua allows while traversing the table), and finds out
+		//   whether any other field changed ; most tables are left untouched by the scripts and need nothing more
+		int unchangedFields = 0;
+		lua_pushnil(_state);
+		while (lua_next(_state, table) != 0) {
+			lua_pushvalue(_state, -2);
+			lua_rawget(_state, copy);
+			if (lua_isnil(_state, -1)) {
+				lua_pop(_state, 2);
+				lua_pushvalue(_state, -1);
+				lua_pushnil(_state);
+				lua_rawset(_state, table);
+			} else {
+				if (lua_rawequal(_state, -1, -2))
+					++unchangedFields;
+				lua_pop(_state, 2);
+			}
+		}
+
+		// puts back the recorded values, once the traversal is over since this may grow the table
+		if (unchangedFields != recordedFields) {
+			lua_pushnil(_state);
+			while (lua_next(_state, copy) != 0) {
+				lua_pushvalue(_state, -2);
+				lua_insert(_state, -2);
+				lua_rawset(_state, table);
+			}
+		}
+
+		lua_rawgeti(_state, entry, 3);
+		lua_setmetatable(_state, table);
+		lua_settop(_state, snapshot);
+	}
+
+	// the registry was recorded before the snapshot was stored in it
+	lua_setfield(_state, LUA_REGISTRYINDEX, "_snapshot");
+
+	_allocator.setLimit(0);
+	_gcStopped = false;
+	if (lua_cpcall(_state, &_resetGarbageCollector, this) != 0) {
+		lua_pop(_state, 1);
+		return false;
+	}
+	_allocator.resetPeak();
+	_gcCycles = 0;
+	return true;
+}
+
+int Lua::LuaContext::_resetGarbageCollector(lua_State* state) {
+	LuaContext* context = (LuaContext*)lua_touserdata(state, 1);
+
+	// switching back to the incremental mode does a full collection when it was generational
+	lua_gc(state, LUA_GCINC, 0);
+	lua_gc(state, LUA_GCSETPAUSE, LUAI_GCPAUSE);
+	lua_gc(state, LUA_GCSETSTEPMUL, LUAI_GCMUL);
+
+	// a full collection costs about as much as creating a new state, so a little garbage is left to the incremental
+	//   collector, which collects it while the next code runs like it would have done for the code that left it
+	if (context->_allocator.bytesInUse() > context->_snapshotBytes * 2)
+		lua_gc(state, LUA_GCCOLLECT, 0);
+	else
+		lua_gc(state, LUA_GCRESTART, 0);
+	return 0;
 }
 
 void Lua::LuaContext::executeCode(std::istream& code) {
 	std::lock_guard<std::mutex> stateLock(_stateMutex);
 
+	// we call lua_load through _load, which pushes the loaded chunk as a function
+	auto loadReturnValue = _load(_state, code);
+
+	// now we have to check return value
+	if (loadReturnValue != 0) {
+		if (loadReturnValue == LUA_ERRMEM)			throw(std::bad_alloc());
+		else if (loadReturnValue == LUA_ERRSYNTAX)	;//throw(SyntaxErrorException(std::string(errorMsg)));	// Modified by Aknor Jaden to remove throw()-inflicted Unhandled Exceptions -_-
+
+	} else {
+		// calling the loaded function
+		_call<std::tuple<>>(std::tuple<>());
+	}
+}
+
+void Lua::LuaContext::executeCode(const char* code, size_t size) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	auto loadReturnValue = _load(_state, code, size, "chunk");
+
+	if (loadReturnValue != 0) {
+		if (loadReturnValue == LUA_ERRMEM)			throw(std::bad_alloc());
+	} else {
+		_call<std::tuple<>>(std::tuple<>());
+	}
+}
+
+bool Lua::LuaContext::executeFile(const std::string& fileName) {
+	MappedFile file(fileName);
+	if (!file.isOpen())
+		return false;
+
+	executeCode(file.data(), file.size());
+	return true;
+}
+
+int Lua::LuaContext::loadChunk(const char* code, size_t size, const char* chunkName, std::string* errorMessage) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	auto loadReturnValue = _load(_state, code, size, chunkName, errorMessage);
+	if (loadReturnValue != 0) {
+		if (loadReturnValue == LUA_ERRMEM)			throw(std::bad_alloc());
+		return LUA_NOREF;
+	}
+
+	return luaL_ref(_state, LUA_REGISTRYINDEX);
+}
+
+int Lua::LuaContext::loadChunkFromFile(const std::string& fileName, std::string* errorMessage) {
+	MappedFile file(fileName);
+	if (!file.isOpen()) {
+		if (errorMessage != nullptr)
+			*errorMessage = "cannot open " + fileName;
+		return LUA_NOREF;
+	}
+
+	// chunk names starting with '@' are shown by lua as file names in error messages
+	return loadChunk(file.data(), file.size(), ("@" + fileName).c_str(), errorMessage);
+}
+
+int Lua::LuaContext::loadChunk(std::istream& code, std::string* errorMessage) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	auto loadReturnValue = _load(_state, code, errorMessage);
+	if (loadReturnValue != 0) {
+		if (loadReturnValue == LUA_ERRMEM)			throw(std::bad_alloc());
+		return LUA_NOREF;
+	}
+
+	// the compiled function is kept in the registry until releaseChunk is called (luaL_ref pops it)
+	return luaL_ref(_state, LUA_REGISTRYINDEX);
+}
+
+bool Lua::LuaContext::dumpChunk(int chunk, std::ostream& output) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	// like Reader in _load, this structure provides the static function lua_dump requires
+	struct Writer {
+		// write function ; "data" must be an std::ostream
+		static int write(lua_State* l, const void* p, size_t size, void* data) {
+			assert(data != nullptr);
+			std::ostream& stream = *((std::ostream*)data);
+			stream.write((const char*)p, size);
+			return stream.good() ? 0 : 1;		// returning non-zero makes lua_dump stop
+		}
+	};
+
+	lua_rawgeti(_state, LUA_REGISTRYINDEX, chunk);
+	auto dumpReturnValue = lua_isfunction(_state, -1) ? lua_dump(_state, &Writer::write, &output) : 1;
+	lua_pop(_state, 1);
+
+	return dumpReturnValue == 0;
+}
+
+lua_SharedChunk* Lua::LuaContext::shareChunk(int chunk) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	lua_rawgeti(_state, LUA_REGISTRYINDEX, chunk);
+	lua_SharedChunk* sharedChunk = lua_isfunction(_state, -1) ? lua_newsharedchunk(_state) : nullptr;
+	lua_pop(_state, 1);
+	return sharedChunk;
+}
+
+int Lua::LuaContext::loadSharedChunk(lua_SharedChunk* sharedChunk, const char* chunkName) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	auto loadReturnValue = lua_loadshared(_state, sharedChunk, chunkName);
+	if (loadReturnValue != 0) {
+		lua_pop(_state, 1);
+		if (loadReturnValue == LUA_ERRMEM)			throw(std::bad_alloc());
+		return LUA_NOREF;
+	}
+
+	return luaL_ref(_state, LUA_REGISTRYINDEX);
+}
+
+int Lua::LuaContext::createCoroutine(int chunk) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	lua_State* thread = lua_newthread(_state);
+	lua_rawgeti(_state, LUA_REGISTRYINDEX, chunk);
+	if (!lua_isfunction(_state, -1)) {
+		lua_pop(_state, 2);
+		return LUA_NOREF;
+	}
+
+	// moving the compiled function from our stack to the coroutine's, the coroutine itself stays on our stack
+	lua_xmove(_state, thread, 1);
+	return luaL_ref(_state, LUA_REGISTRYINDEX);
+}
+
+int Lua::LuaContext::createCoroutine(std::istream& code) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	// lua_newthread pushes the new coroutine on our stack, and the chunk is loaded directly on the coroutine's stack
+	// so that the first lua_resume calls it
+	lua_State* thread = lua_newthread(_state);
+	auto loadReturnValue = _load(thread, code);
+	if (loadReturnValue != 0) {
+		lua_pop(_state, 1);
+		if (loadReturnValue == LUA_ERRMEM)			throw(std::bad_alloc());
+		return LUA_NOREF;
+	}
+
+	// the registry keeps the coroutine alive until destroyCoroutine is called (luaL_ref pops it)
+	return luaL_ref(_state, LUA_REGISTRYINDEX);
+}
+
+int Lua::LuaContext::_load(lua_State* state, std::istream& code, std::string* errorMessage) {
+	// the stream is read completely first, so that lua_load gets the whole code in one piece
+	//   instead of calling back for every few hundred bytes
+	std::string buffer((std::istreambuf_iterator<char>(code)), std::istreambuf_iterator<char>());
+	return _load(state, buffer.data(), buffer.size(), "chunk", errorMessage);
+}
+
+int Lua::LuaContext::_load(lua_State* state, const char* code, size_t size, const char* chunkName, std::string* errorMessage) {
 	// since the lua_load function requires a static function, we use this structure
-	// the Reader structure is at the same time an object storing an istream and a buffer,
-	//   and a static function provider
+	// the Reader structure is at the same time an object storing the code to load, and a static function provider
 	struct Reader {
-		Reader(std::istream& str) : stream(str) {}
-		std::istream&		stream;
-		char				buffer[512];
+		Reader(const char* c, size_t s) : code(c), size(s) {}
+		const char*			code;
+		size_t				size;
 
 		// read function ; "data" must be an instance of Reader
+		// the whole code is returned by the first call, and the second call tells lua_load there is nothing left
 		static const char* read(lua_State* l, void* data, size_t* size) {
 			assert(size != nullptr);
 			assert(data != nullptr);
 			Reader& me = *((Reader*)data);
-			if (me.stream.eof())	{ *size = 0; return nullptr; }
+			if (me.size == 0)		{ *size = 0; return nullptr; }
 
-			me.stream.read(me.buffer, sizeof(me.buffer));
-			*size = size_t(me.stream.gcount());		// gcount could return a value larger than a size_t, but its maximum is sizeof(me.buffer) so there's no problem
-			return me.buffer;
+			*size = me.size;
+			me.size = 0;
+			return me.code;
 		}
 	};
 
 	// we create an instance of Reader, and we call lua_load
-	std::unique_ptr<Reader> reader(new Reader(code));
-	auto loadReturnValue = lua_load(_state, &Reader::read, reader.get(), "chunk");
+	Reader reader(code, size);
+	auto loadReturnValue = lua_load(state, &Reader::read, &reader, chunkName);
 
-	// now we have to check return value
 	if (loadReturnValue != 0) {
 		// there was an error during loading, an error message was pushed on the stack
-		const char* errorMsg = lua_tostring(_state, -1);
-		lua_pop(_state, 1);
-		if (loadReturnValue == LUA_ERRMEM)			throw(std::bad_alloc());
-		else if (loadReturnValue == LUA_ERRSYNTAX)	;//throw(SyntaxErrorException(std::string(errorMsg)));	// Modified by Aknor Jaden to remove throw()-inflicted Unhandled Exceptions -_-
-
-	} else {
-		// calling the loaded function
-		_call<std::tuple<>>(std::tuple<>());
+		if (errorMessage != nullptr) {
+			const char* errorMsg = lua_tostring(state, -1);
+			*errorMessage = (errorMsg != nullptr) ? errorMsg : "unknown error";
+		}
+		lua_pop(state, 1);
 	}
+
+	return loadReturnValue;
+}
+
+lua_State* Lua::LuaContext::_getCoroutine(int coroutine) const {
+	lua_rawgeti(_state, LUA_REGISTRYINDEX, coroutine);
+	lua_State* thread = lua_tothread(_state, -1);		// returns NULL if the value is not a thread
+	lua_pop(_state, 1);
+	return thread;
 }
 
 void Lua::LuaContext::_getGlobal(const std::string& variableName) const {
@@ -101,6 +850,8 @@ void Lua::LuaContext::_getGlobal(const std::string& variableName) const {
 			if (!lua_istable(_state, -1)) {
 				lua_pop(_state, 1);
 				//throw(VariableDoesntExistException(variableName));	// Modified by Aknor Jaden to remove throw()-inflicted Unhandled Exceptions -_-
+				lua_pushnil(_state);		// since we don't throw, we push nil like for any other variable that doesn't exist
+				return;
 			}
 
 			// replacing the current table in the stack by its member
@@ -112,9 +863,11 @@ void Lua::LuaContext::_getGlobal(const std::string& variableName) const {
 		// lua will accept anything as variable name, but if the variable doesn't exist
 		//   it will simply push "nil" instead of a value
 		// so if we have a nil on the stack, the variable didn't exist and we throw
+		// since we don't throw, the nil is left on the stack for the caller to see (popping it would unbalance the stack)
 		if (lua_isnil(_state, -1)) {
-			lua_pop(_state, 1);
+			//lua_pop(_state, 1);
 			//throw(VariableDoesntExistException(variableName));	// Modified by Aknor Jaden to remove throw()-inflicted Unhandled Exceptions -_-
+			return;
 		}
 
 		// updating currentVar
@@ -122,6 +875,100 @@ void Lua::LuaContext::_getGlobal(const std::string& variableName) const {
 	} while (nextVar != variableName.end());
 }
 
+Lua::LuaContext::VariablePath Lua::LuaContext::compileVariablePath(const std::string& variableName) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	// variableName is split by dots '.' exactly like _getGlobal does, but only once
+	VariablePath path;
+	path._name = variableName;
+
+	auto nextVar = variableName.begin();
+	do {
+		auto currentVar = nextVar;
+		nextVar = std::find(currentVar, variableName.end(), '.');
+
+		// the interned string is kept alive by the registry until releaseVariablePath is called (luaL_ref pops it)
+		lua_pushlstring(_state, variableName.data() + (currentVar - variableName.begin()), nextVar - currentVar);
+		path._keys.push_back(luaL_ref(_state, LUA_REGISTRYINDEX));
+
+		if (nextVar != variableName.end())	++nextVar;
+	} while (nextVar != variableName.end());
+
+	return path;
+}
+
+void Lua::LuaContext::releaseVariablePath(VariablePath& variablePath) {
+	std::lock_guard<std::mutex> stateLock(_stateMutex);
+
+	for (auto i = variablePath._keys.begin(); i != variablePath._keys.end(); ++i)
+		luaL_unref(_state, LUA_REGISTRYINDEX, *i);
+	variablePath._keys.clear();
+}
+
+int Lua::LuaContext::_referenceFunction(const std::string& functionName) {
+	// the name is looked up through a compiled path since it pushes nil instead of unbalancing the stack when the variable doesn't exist
+	VariablePath path = compileVariablePath(functionName);
+
+	int reference = LUA_NOREF;
+	{
+		std::lock_guard<std::mutex> stateLock(_stateMutex);
+		_getGlobal(path);
+		if (lua_isfunction(_state, -1))		reference = luaL_ref(_state, LUA_REGISTRYINDEX);
+		else								lua_pop(_state, 1);
+	}
+
+	releaseVariablePath(path);
+	return reference;
+}
+
+void Lua::LuaContext::_getGlobal(const VariablePath& variable, size_t segments) const {
+	assert(segments >= 1 && segments <= variable._keys.size());
+
+	// the first part is a global variable, the key is pushed from the registry instead of by lua_getglobal
+	lua_rawgeti(_state, LUA_REGISTRYINDEX, variable._keys[0]);
+	lua_gettable(_state, LUA_GLOBALSINDEX);
+
+	for (size_t i = 1; i < segments; ++i) {
+		// if variable is "a.b" and "a" is not a table, the variable doesn't exist
+		if (!lua_istable(_state, -1)) {
+			lua_pop(_state, 1);
+			lua_pushnil(_state);
+			return;
+		}
+
+		// replacing the current table in the stack by its member
+		lua_rawgeti(_state, LUA_REGISTRYINDEX, variable._keys[i]);
+		lua_gettable(_state, -2);
+		lua_remove(_state, -2);
+	}
+}
+
+void Lua::LuaContext::_setGlobal(const VariablePath& variable) {
+	assert(lua_gettop(_state) >= 1);		// making sure there's something on the stack (ie. the value to set)
+	assert(variable.isValid());
+
+	const size_t segments = variable._keys.size();
+	if (segments == 1) {
+		// equivalent of lua_setglobal
+		lua_rawgeti(_state, LUA_REGISTRYINDEX, variable._keys[0]);		// value at -2, key at -1
+		lua_insert(_state, -2);												// key at -2, value at -1
+		lua_settable(_state, LUA_GLOBALSINDEX);								// stack empty
+		return;
+	}
+
+	// value at -2, table at -1
+	_getGlobal(variable, segments - 1);
+	if (!lua_istable(_state, -1)) {
+		lua_pop(_state, 2);
+		return;
+	}
+
+	lua_rawgeti(_state, LUA_REGISTRYINDEX, variable._keys[segments - 1]);		// value at -3, table at -2, key at -1
+	lua_pushvalue(_state, -3);													// value at -4, table at -3, key at -2, value at -1
+	lua_settable(_state, -3);													// value at -2, table at -1
+	lua_pop(_state, 2);															// stack empty
+}
+
 void Lua::LuaContext::_setGlobal(const std::string& variable) {
 	try {
 		assert(lua_gettop(_state) >= 1);		// making sure there's something on the stack (ie. the value to set)
@@ -138,8 +985,11 @@ void Lua::LuaContext::_setGlobal(const std::string& variable) {
 			// in the second case, we call _getGlobal on the table name
 			_getGlobal(tableName);
 			try {
-				if (!lua_istable(_state, -1))
-					;//throw(VariableDoesntExistException(variable));	// Modified by Aknor Jaden to remove throw()-inflicted Unhandled Exceptions -_-
+				if (!lua_istable(_state, -1)) {
+					//throw(VariableDoesntExistException(variable));	// Modified by Aknor Jaden to remove throw()-inflicted Unhandled Exceptions -_-
+					lua_pop(_state, 2);		// since we don't throw, the value is dropped (lua_settable on a non-table would raise an unprotected error)
+					return;
+				}
 
 				// now we have our value at -2 (was pushed before _setGlobal is called) and our table at -1
 				lua_pushstring(_state, variable.substr(lastDot + 1).c_str());		// value at -3, table at -2, key at -1
@@ -165,6 +1015,51 @@ bool Lua::LuaContext::isVariableArray(const std::string& variableName) const {
 	return answer;
 }
 
+void Lua::LuaContext::readVariables(std::vector<BatchVariable>& variables) const {
+	std::lock_guard<std::mutex> lock(_stateMutex);
+
+	for (auto i = variables.begin(); i != variables.end(); ++i) {
+		if (i->path != nullptr)		_getGlobal(*i->path);
+		else						_getGlobal(i->name);
+
+		i->exists = !lua_isnil(_state, -1);
+		switch (i->type) {
+			case BatchVariable::Number:		i->number = lua_tonumber(_state, -1);		break;
+			case BatchVariable::Boolean:	i->boolean = (lua_toboolean(_state, -1) != 0);	break;
+			case BatchVariable::String: {
+				size_t length = 0;
+				const char* string = lua_tolstring(_state, -1, &length);		// returns NULL if the value is neither a string nor a number
+				if (string != nullptr)		i->string.assign(string, length);
+				else						i->string.clear();
+				break;
+			}
+		}
+		lua_pop(_state, 1);
+	}
+}
+
+void Lua::LuaContext::writeVariables(std::vector<BatchVariable>& variables, bool onlyExisting) {
+	std::lock_guard<std::mutex> lock(_stateMutex);
+
+	for (auto i = variables.begin(); i != variables.end(); ++i) {
+		if (i->path != nullptr)		_getGlobal(*i->path);
+		else						_getGlobal(i->name);
+		i->exists = !lua_isnil(_state, -1);
+		lua_pop(_state, 1);
+
+		if (onlyExisting && !i->exists)
+			continue;
+
+		switch (i->type) {
+			case BatchVariable::Number:		lua_pushnumber(_state, i->number);									break;
+			case BatchVariable::Boolean:	lua_pushboolean(_state, i->boolean);								break;
+			case BatchVariable::String:		lua_pushlstring(_state, i->string.data(), i->string.size());		break;
+		}
+		if (i->path != nullptr)		_setGlobal(*i->path);
+		else						_setGlobal(i->name);
+	}
+}
+
 void Lua::LuaContext::writeArrayIntoVariable(const std::string& variableName) {
 	std::lock_guard<std::mutex> lock(_stateMutex);
 	lua_newtable(_state);
@@ -178,10 +1073,15 @@ int Lua::LuaContext::_push(std::function<int (lua_State*)> fn) {
 	// if we used lua's cfunctions system, we could not detect when the function is no longer in use, which could cause problems
 
 	// so we use userdata instead
-	// we will create a userdata which contains a copy of our std::function<int (lua_State*)>
+	// we will create a userdata which contains a copy of our std::function<int (lua_State*)>, followed by a pointer
+	//   to the context so that the call can be timed
 
 	// first we typedef the std::function so it's easier to use
 	typedef std::function<int (lua_State*)>	FunctionType;
+	struct FunctionData {
+		FunctionType	function;
+		LuaContext*		context;
+	};
 
 	// this is a structure providing static C-like functions that we can feed to lua
 	struct Callback {
@@ -190,20 +1090,27 @@ int Lua::LuaContext::_push(std::function<int (lua_State*)> fn) {
 		static int call(lua_State* lua) {
 			assert(lua_gettop(lua) >= 1);
 			assert(lua_isuserdata(lua, 1));
-			FunctionType* function = (FunctionType*)lua_touserdata(lua, 1);
-			assert(function);
-			assert(*function);
-			return (*function)(lua);
+			FunctionData* data = (FunctionData*)lua_touserdata(lua, 1);
+			assert(data);
+			assert(data->function);
+			if (!data->context->_callbackObserver)
+				return data->function(lua);
+
+			// a call ending with a lua error is not timed, since the error jumps over the end of this function
+			const unsigned long long start = clockNanoSeconds();
+			const int results = data->function(lua);
+			data->context->_callbackObserver(clockNanoSeconds() - start);
+			return results;
 		}
 
 		// this one is called when lua's garbage collector no longer needs our custom data type
 		// we call std::function<int (lua_State*)>'s destructor
 		static int garbage(lua_State* lua) {
 			assert(lua_gettop(lua) == 1);
-			FunctionType* function = (FunctionType*)lua_touserdata(lua, 1);
-			assert(function);
-			assert(*function);
-			function->~function();
+			FunctionData* data = (FunctionData*)lua_touserdata(lua, 1);
+			assert(data);
+			assert(data->function);
+			data->function.~FunctionType();
 			return 0;
 		}
 	};
@@ -211,8 +1118,9 @@ int Lua::LuaContext::_push(std::function<int (lua_State*)> fn) {
 	// creating the object
 	// lua_newuserdata allocates memory in the internals of the lua library and returns it so we can fill it
 	//   and that's what we do with placement-new
-	FunctionType* functionLocation = (FunctionType*)lua_newuserdata(_state, sizeof(FunctionType));
-	new (functionLocation) FunctionType(std::move(fn));
+	FunctionData* dataLocation = (FunctionData*)lua_newuserdata(_state, sizeof(FunctionData));
+	new (&dataLocation->function) FunctionType(std::move(fn));
+	dataLocation->context = this;
 
 	// creating the metatable (over the object on the stack)
 	// lua_settable pops the key and value we just pushed, so stack management is easy
@@ -39,24 +39,28 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <type_traits>
 #include <string>
 #include <sstream>
+#include <vector>
 
 extern "C" {
-#	include "..\lua\src\lua.h"
-#	include "..\lua\src\lualib.h"
-#	include "..\lua\src\lauxlib.h"
+#	include "../lua/src/lua.h"
+#	include "../lua/src/lualib.h"
+#	include "../lua/src/lauxlib.h"
 }
 
+#include "LuaAllocator.h"
+
 #if defined(__GNUC__) && __GNUC__ <= 4 && __GNUC_MINOR__ <= 5
 #	define nullptr		0
 #endif
 
 #if !defined(_MSC_VER) || _MSC_VER >= 1700
+#	include <mutex>
 #	include <thread>
 #else
-#	include "..\..\common\boost\boost\thread.hpp"
-#	include "..\..\common\boost\boost\thread\locks.hpp"
-#	include "..\..\common\boost\boost\thread\mutex.hpp"
-#	include "..\..\common\boost\boost\type_traits.hpp"
+#	include "../../common/boost/boost/thread.hpp"
+#	include "../../common/boost/boost/thread/locks.hpp"
+#	include "../../common/boost/boost/thread/mutex.hpp"
+#	include "../../common/boost/boost/type_traits.hpp"
 	namespace std {
 		using ::boost::thread;
 		using ::boost::mutex;
@@ -67,6 +71,35 @@ extern "C" {
 #endif
 
 namespace Lua {
+	/**	\brief Read-only view of a whole file mapped in memory
+		\details Used to give script files to LuaContext::loadChunk without reading them through a stream ; the data stays valid
+				until the MappedFile is destroyed. An empty file is opened successfully with a size of 0.
+	*/
+	class MappedFile {
+	public:
+		explicit MappedFile(const std::string& fileName);
+		~MappedFile();
+
+		/// \brief Returns true if the file was opened and mapped
+		bool				isOpen() const									{ return _open; }
+		/// \brief Returns the content of the file, which is not null-terminated
+		const char*			data() const									{ return _data; }
+		size_t				size() const									{ return _size; }
+
+	private:
+		MappedFile(const MappedFile&);
+		MappedFile& operator=(const MappedFile&);
+
+		bool				_open;
+		const char*			_data;
+		size_t				_size;
+		void*				_mapping;		// handle of the file mapping object on Windows, unused elsewhere
+	};
+
+	class LuaFunctionRefBase;
+	template<typename TFunctionType>
+	class LuaFunctionRef;
+
 	/**	\brief Defines a Lua context
 		\details A Lua context is used to interpret Lua code. Since everything in Lua is a variable (including functions),
 				we only provide few functions like readVariable and writeVariable. Note that these functions can visit arrays,
@@ -79,9 +112,7 @@ namespace Lua {
 	class LuaContext {
 	public:
 		 LuaContext();
-		 LuaContext(LuaContext&& s) : _state(s._state) { s._state = nullptr; }
-		 LuaContext& operator=(LuaContext&& s) { std::swap(_state, s._state); return *this; }
-		~LuaContext()							{ if (_state != nullptr) lua_close(_state); }
+		~LuaContext()							{ if (_state != nullptr) { _closing = true; lua_close(_state); } }
 		
 
 		/// \brief Thrown when an error happens during execution (like not enough parameters for a function)
@@ -93,12 +124,243 @@ namespace Lua {
 		/// \brief Thrown when trying to cast a lua variable to an unvalid type
 		class WrongTypeException : public std::runtime_error { public: WrongTypeException() : std::runtime_error("Trying to cast a lua variable to an unvalid type") { } };
 
+		/// \brief Variable name compiled by compileVariablePath
+		/// \details Keeps the name already split by dots, with every part pinned in the registry as a lua string, so that
+		///			readVariable, writeVariable, doesVariableExist and callLuaFunction don't have to split and intern the name again.
+		///			A path can only be used with the context that compiled it, and must be given to releaseVariablePath when not needed anymore.
+		class VariablePath {
+		public:
+			VariablePath()																		{}
+			/// \brief Returns the name the path was compiled from
+			const std::string&		name() const												{ return _name; }
+			/// \brief Returns false for a default-constructed or released path
+			bool					isValid() const												{ return !_keys.empty(); }
+
+		private:
+			friend class LuaContext;
+			std::string				_name;
+			std::vector<int>		_keys;		// registry refs of each part of the name
+		};
+
 		
 		/// \brief Executes lua code from the stream \param code A stream that lua will read its code from
 		void				executeCode(std::istream& code);
 		/// \brief Executes lua code given as parameter \param code A string containing code that will be executed by lua
-		void				executeCode(const std::string& code)			{ std::istringstream str(code); executeCode(str); }
-		
+		void				executeCode(const std::string& code)			{ executeCode(code.data(), code.size()); }
+		/// \brief Executes lua code (source or precompiled bytecode) stored in memory, which lua reads in place without copying it
+		void				executeCode(const char* code, size_t size);
+		/// \brief Executes a lua script file, which is mapped in memory instead of being read through a stream \return false if the file could not be opened
+		bool				executeFile(const std::string& fileName);
+
+
+		/// \brief Compiles lua code from the stream without running it, so that it can be run many times without being parsed again
+		/// \return A handle to pass to executeChunk, createCoroutine and releaseChunk, or LUA_NOREF if the code could not be loaded
+		/// \param errorMessage If not nullptr, receives the error lua reported when the code could not be loaded (eg. "@file.lua:12: '=' expected near 'x'")
+		int					loadChunk(std::istream& code, std::string* errorMessage = nullptr);
+		/// \brief Same as above, but lua reads the code in place from memory \param chunkName Name shown in error messages and debug information
+		int					loadChunk(const char* code, size_t size, const char* chunkName = "chunk", std::string* errorMessage = nullptr);
+		/// \brief Same as above, with the code of a file mapped in memory \return LUA_NOREF if the file could not be opened or loaded
+		int					loadChunkFromFile(const std::string& fileName, std::string* errorMessage = nullptr);
+		/// \brief Runs a chunk compiled by loadChunk
+		void				executeChunk(int chunk)							{ std::lock_guard<std::mutex> stateLock(_stateMutex); lua_rawgeti(_state, LUA_REGISTRYINDEX, chunk); _call<std::tuple<>>(std::tuple<>()); }
+		/// \brief Writes a chunk compiled by loadChunk as precompiled bytecode (like luac does) \return true on success
+		/// \details The bytecode can be given back to loadChunk or executeCode, which then skip parsing entirely
+		bool				dumpChunk(int chunk, std::ostream& output);
+		/// \brief Releases a chunk compiled by loadChunk
+		void				releaseChunk(int chunk)							{ std::lock_guard<std::mutex> stateLock(_stateMutex); luaL_unref(_state, LUA_REGISTRYINDEX, chunk); }
+
+
+		/// \brief Makes a copy of a chunk compiled by loadChunk that any number of contexts can load with loadSharedChunk, in any thread
+		/// \details The contexts loading it all use the same instructions and line numbers, which are most of the memory a compiled chunk
+		///			takes ; only the constants and the debug names are allocated again in each context.
+		/// \return nullptr if the chunk is not valid or there is not enough memory ; otherwise it must be given to releaseSharedChunk
+		lua_SharedChunk*	shareChunk(int chunk);
+		/// \brief Loads a chunk made by shareChunk, possibly in another context \return Same as loadChunk
+		int					loadSharedChunk(lua_SharedChunk* sharedChunk, const char* chunkName = "chunk");
+		/// \brief Releases a chunk made by shareChunk, which stays alive for as long as any context still uses functions loaded from it
+		static void			releaseSharedChunk(lua_SharedChunk* sharedChunk)	{ lua_releaseshared(sharedChunk); }
+
+
+		/// \brief One variable read or written by readVariables and writeVariables
+		/// \details The variable is given either by its name or by a compiled path, which must stay alive until the batch has been read or written
+		struct BatchVariable {
+			enum Type { Number, Boolean, String };
+
+			BatchVariable(const std::string& variableName, Type valueType) : name(variableName), path(nullptr), type(valueType), exists(false), number(0), boolean(false) {}
+			BatchVariable(const VariablePath& variablePath, Type valueType) : name(variablePath.name()), path(&variablePath), type(valueType), exists(false), number(0), boolean(false) {}
+
+			std::string				name;
+			const VariablePath*		path;
+			Type					type;		// which one of the values below is read or written
+			bool					exists;		// set by readVariables and writeVariables to whether the variable was not nil (before writing)
+			lua_Number				number;
+			bool					boolean;
+			std::string				string;
+		};
+
+		/// \brief Reads all the variables under a single lock of the context, converting each value to the type of the entry
+		/// \details Variables that don't exist have their "exists" flag cleared and read as 0, false or an empty string
+		void				readVariables(std::vector<BatchVariable>& variables) const;
+		/// \brief Writes the value of each entry into its variable under a single lock of the context
+		/// \param onlyExisting If true, variables that don't exist (are nil) are left untouched ; their "exists" flag tells which ones were written
+		void				writeVariables(std::vector<BatchVariable>& variables, bool onlyExisting = false);
+
+
+		/// \brief Memory used by the context, as counted by its allocator (see LuaAllocator)
+		struct MemoryStatistics {
+			size_t					bytesInUse;
+			size_t					peakBytesInUse;
+			size_t					objectsInUse;
+			size_t					totalAllocations;
+			size_t					memoryLimit;		// 0 when there is no limit
+			size_t					gcCycles;			// number of garbage collection cycles completed
+			unsigned long long		totalBytesAllocated;	// see LuaAllocator::totalBytesAllocated
+			unsigned long long		gcMicroSeconds;		// time spent collecting garbage, always 0 unless lua is built with LUA_GCTIMING (see isGarbageCollectionTimed)
+		};
+
+		/// \brief Returns the memory used by the context \note Waits for any code currently running in the context
+		/// \details gcMicroSeconds is only kept up to date if this is called at least once every 35 minutes of garbage collection
+		MemoryStatistics	getMemoryStatistics() const;
+		/// \brief Reads only the totalBytesAllocated and gcMicroSeconds of getMemoryStatistics, for measuring each pass of a script
+		void				getAllocationCounters(unsigned long long& totalBytesAllocated, unsigned long long& gcMicroSeconds) const;
+		/// \brief Returns true if lua was built with LUA_GCTIMING, false if gcMicroSeconds is always 0
+		bool				isGarbageCollectionTimed() const;
+
+		/// \brief Sets the function told how many nanoseconds each call from lua to a C++ function took, an empty function stops the timing
+		/// \details It is called by the thread running the lua code, with the context locked ; resetToSnapshot removes it
+		void				setCallbackObserver(std::function<void (unsigned long long)> observer);
+
+		/// \brief Sets the maximum number of bytes lua may use in this context, 0 meaning no limit
+		/// \details When lua code would go over the limit, it gets a "not enough memory" error that it can catch with pcall ;
+		///			if it doesn't, the function called by the C++ code throws std::bad_alloc like when the system runs out of memory.
+		///			Only allocations made while lua code is running are refused, so the limit may be exceeded slightly by
+		///			writeVariable and the other functions pushing values from C++.
+		void				setMemoryLimit(size_t bytes);
+
+
+		/// \brief Sets how long the garbage collector waits before starting a new cycle (like collectgarbage("setpause")), returns the previous value
+		/// \details A value of 200 means that a new cycle starts when the memory in use is twice what it was at the end of the previous one
+		int					setGarbageCollectorPause(int percent);
+		/// \brief Sets how much work the garbage collector does for each allocation (like collectgarbage("setstepmul")), returns the previous value
+		int					setGarbageCollectorStepMultiplier(int percent);
+		/// \brief Stops the garbage collection done while lua code runs, the garbage is then only collected by stepGarbageCollector
+		/// \note A full collection asked by the script with collectgarbage() restarts the collector, like in lua
+		void				stopGarbageCollector();
+		/// \brief Lets the garbage be collected while lua code runs again, which is the default
+		void				restartGarbageCollector();
+		/// \brief Does one small step of the incremental garbage collector, returns true if this step completed a collection cycle
+		/// \details Meant to be called repeatedly while the host has nothing else to do ; the collector stays stopped if it was
+		///			In generational mode, the step starting a major collection does all of it.
+		bool				stepGarbageCollector();
+		/// \brief Switches the garbage collector between generational and incremental mode (like collectgarbage("generational")), returns true if it was generational
+		/// \details In generational mode, objects surviving a collection become old and the following (minor) collections only
+		///			look at the objects created since, which is much cheaper for code creating lots of short-lived tables and strings.
+		///			The old objects are only collected when the memory in use has grown past LUAI_GCMAJOR percent since the last full
+		///			collection.  Switching does a full collection.
+		bool				setGenerationalGarbageCollector(bool enabled);
+
+
+		/// \brief What the profiler found the lua code doing, see startProfiler
+		struct Profile {
+			size_t							samples;
+			int								instructionsPerSample;	// 0 when the profiler is stopped
+			std::map<std::string, size_t>	functions;		// samples taken in each function, named like "name (source:line defined)"
+			std::map<std::string, size_t>	lines;			// samples taken at each line, named like "source:line"
+			std::map<std::string, size_t>	stacks;			// samples of each call stack, its functions from the outermost separated by ';'
+
+			Profile() : samples(0), instructionsPerSample(0) {}
+
+			/// \brief Writes the functions from the one most samples were taken in, with the share of the samples taken in them
+			///			(self) and in them or the functions they called (total), followed by the lines the same way
+			void			writeFlatProfile(std::ostream& output) const;
+			/// \brief Writes one line per call stack, "outer;inner count", which flamegraph.pl and the like turn into a flame graph
+			void			writeCollapsedStacks(std::ostream& output) const;
+		};
+
+		/// \brief Starts sampling the lua code run in the context every "instructionsPerSample" virtual machine instructions
+		/// \details The sample is the call stack of the coroutine the lua code runs in, down to the line being run, taken by a count
+		///			hook (see lua_sethook). Coroutines get the hook the next time resumeCoroutine runs them. Calling it again
+		///			only changes the interval ; the samples are added to the profile until clearProfile is called.
+		///			resetToSnapshot stops the profiler and clears the profile. It replaces any hook set with debug.sethook.
+		void				startProfiler(int instructionsPerSample);
+		/// \brief Stops sampling, the profile is kept
+		void				stopProfiler();
+		/// \brief Returns a copy of the profile \note Waits for any code currently running in the context
+		Profile				getProfile() const;
+		void				clearProfile();
+
+
+		/// \brief Records the current globals and libraries as the state that resetToSnapshot goes back to
+		/// \details Shallow copies are kept of the globals table, of the tables reachable from it in at most two steps (like string
+		///			or package.loaded), of the registry and of the tables directly in it, and of the metatable of strings. Calling it again
+		///			replaces the previous snapshot.
+		void				takeSnapshot();
+		/// \brief Puts the context back in the state recorded by takeSnapshot, so that it can be reused to run unrelated code
+		/// \details Fields added to the recorded tables since are removed, the ones changed or removed get their value back, and so
+		///			do the metatables of those tables. Registry references made since (chunks, coroutines, LuaFunctionRef, VariablePath)
+		///			become invalid. The garbage collector gets back its default settings, and the garbage left behind is collected
+		///			right away if it takes more memory than the snapshot did (otherwise the collector gets to it while the next code runs).
+		///			The memory limit is removed, and the peak memory use and the count of collection cycles start again from there.
+		/// \return false if there is no snapshot, or if a finalizer failed during the collection ; the context should then be destroyed
+		bool				resetToSnapshot();
+
+
+		/// \brief Splits a variable name like "a.b.c" once for all, so that it can be used many times without any string work
+		VariablePath		compileVariablePath(const std::string& variableName);
+		/// \brief Releases the strings pinned by compileVariablePath ; the path is invalid afterwards
+		void				releaseVariablePath(VariablePath& variablePath);
+
+
+		/// \brief Loads lua code from the stream into a new coroutine, without running it
+		/// \details The coroutine shares the globals of this context but has its own stack, so many of them can be suspended at the same time
+		/// \return A handle to pass to resumeCoroutine and destroyCoroutine, or LUA_NOREF if the code could not be loaded
+		int					createCoroutine(std::istream& code);
+		/// \brief Creates a new coroutine running a chunk compiled by loadChunk \return Same as above
+		int					createCoroutine(int chunk);
+		/// \brief Runs a coroutine until it yields or finishes \return true if the coroutine yielded and may be resumed again, false if it finished
+		/// \throw ExecutionErrorException if an error happened in the coroutine, which can then no longer be resumed
+		bool				resumeCoroutine(int coroutine)					{ std::tuple<> yielded; return resumeCoroutine(coroutine, yielded); }
+		/// \brief Runs a coroutine until it yields or finishes, and reads the values it passed to coroutine.yield
+		/// \details Template parameter is the type of the yielded values (tuples are supported) ; "yielded" is left untouched when the coroutine finishes
+		template<typename R>
+		bool				resumeCoroutine(int coroutine, R& yielded) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			lua_State* thread = _getCoroutine(coroutine);
+			if (thread == nullptr)		return false;
+
+			// a coroutine that has returned keeps status 0 with an empty stack, and lua_resume must not be called on it again
+			if (lua_status(thread) == 0 && lua_gettop(thread) == 0)		return false;
+
+			_syncProfilerHook(thread);
+			const bool limitEnforced = _allocator.enforceLimit(true);
+			auto resumeReturnValue = lua_resume(thread, 0);
+			_allocator.enforceLimit(limitEnforced);
+
+			if (resumeReturnValue == LUA_YIELD) {
+				// the yielded values are moved to our own stack so that they can be read with _readTopAndPop
+				const int outArguments = std::tuple_size<typename Tupleizer<R>::type>::value;
+				lua_settop(thread, outArguments);
+				lua_xmove(thread, _state, outArguments);
+				yielded = _readTopAndPop(outArguments, (R*)nullptr);
+				return true;
+			}
+
+			if (resumeReturnValue != 0) {
+				// an error occured during execution, an error message was pushed on the coroutine's stack
+				const char* errorMsg = lua_tostring(thread, -1);
+				std::string message = (errorMsg != nullptr) ? errorMsg : "unknown error";
+				lua_settop(thread, 0);
+				if (resumeReturnValue == LUA_ERRMEM)		throw(std::bad_alloc());
+				throw(ExecutionErrorException(message));
+			}
+
+			// the coroutine finished, its return values are discarded
+			lua_settop(thread, 0);
+			return false;
+		}
+		/// \brief Releases a coroutine created by createCoroutine, whether it finished or not
+		void				destroyCoroutine(int coroutine)					{ std::lock_guard<std::mutex> stateLock(_stateMutex); luaL_unref(_state, LUA_REGISTRYINDEX, coroutine); }
+
 
 		/// \brief Tells that lua will be allowed to access an object's function
 		template<typename T>
@@ -198,6 +460,69 @@ namespace Lua {
 		}
 		
 
+		/// \brief Same as above, with a name compiled by compileVariablePath
+		template<typename R>
+		R callLuaFunction(const VariablePath& variablePath) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			_getGlobal(variablePath);
+			return _call<R>(std::tuple<>());
+		}
+		template<typename R, typename T1>
+		R callLuaFunction(const VariablePath& variablePath, const T1& t1) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			_getGlobal(variablePath);
+			return _call<R>(std::make_tuple(t1));
+		}
+		template<typename R, typename T1, typename T2>
+		R callLuaFunction(const VariablePath& variablePath, const T1& t1, const T2& t2) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			_getGlobal(variablePath);
+			return _call<R>(std::make_tuple(t1,t2));
+		}
+		template<typename R, typename T1, typename T2, typename T3>
+		R callLuaFunction(const VariablePath& variablePath, const T1& t1, const T2& t2, const T3& t3) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			_getGlobal(variablePath);
+			return _call<R>(std::make_tuple(t1,t2,t3));
+		}
+		template<typename R, typename T1, typename T2, typename T3, typename T4>
+		R callLuaFunction(const VariablePath& variablePath, const T1& t1, const T2& t2, const T3& t3, const T4& t4) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			_getGlobal(variablePath);
+			return _call<R>(std::make_tuple(t1,t2,t3,t4));
+		}
+		template<typename R, typename T1, typename T2, typename T3, typename T4, typename T5>
+		R callLuaFunction(const VariablePath& variablePath, const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			_getGlobal(variablePath);
+			return _call<R>(std::make_tuple(t1,t2,t3,t4,t5));
+		}
+		template<typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
+		R callLuaFunction(const VariablePath& variablePath, const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			_getGlobal(variablePath);
+			return _call<R>(std::make_tuple(t1,t2,t3,t4,t5,t6));
+		}
+		template<typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
+		R callLuaFunction(const VariablePath& variablePath, const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6, const T7& t7) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			_getGlobal(variablePath);
+			return _call<R>(std::make_tuple(t1,t2,t3,t4,t5,t6,t7));
+		}
+		template<typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8>
+		R callLuaFunction(const VariablePath& variablePath, const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6, const T7& t7, const T8& t8) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			_getGlobal(variablePath);
+			return _call<R>(std::make_tuple(t1,t2,t3,t4,t5,t6,t7,t8));
+		}
+		template<typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9>
+		R callLuaFunction(const VariablePath& variablePath, const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6, const T7& t7, const T8& t8, const T9& t9) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			_getGlobal(variablePath);
+			return _call<R>(std::make_tuple(t1,t2,t3,t4,t5,t6,t7,t8,t9));
+		}
+		
+
 		/// \brief Returns true if the value of the variable is an array \param variableName Name of the variable to check
 		bool							isVariableArray(const std::string& variableName) const;
 		/// \brief Writes an empty array into the given variable \note To write something in the array, use writeVariable. Example: writeArrayIntoVariable("myArr"); writeVariable("myArr.something", 5);
@@ -206,6 +531,8 @@ namespace Lua {
 		/// \brief Returns true if variable exists (ie. not nil), otherwise false if it does not
 		/// (edited by Aknor Jaden according to issue posted here: https://code.google.com/p/luawrapper/issues/detail?id=12)
 		bool							doesVariableExist(const std::string& variableName) const			{ std::lock_guard<std::mutex> lock(_stateMutex); _getGlobal(variableName); bool answer = ((lua_isnil(_state, -1) == 0) ? true : false); lua_pop(_state, 1); return answer; }
+		/// \brief Same as above, with a name compiled by compileVariablePath
+		bool							doesVariableExist(const VariablePath& variablePath) const			{ std::lock_guard<std::mutex> lock(_stateMutex); _getGlobal(variablePath); bool answer = ((lua_isnil(_state, -1) == 0) ? true : false); lua_pop(_state, 1); return answer; }
 
 		/// \brief Returns true if functionName is a function, otherwise false if it is not
 		/// (added by Aknor Jaden according to issue posted here: https://code.google.com/p/luawrapper/issues/detail?id=12)
@@ -215,7 +542,9 @@ namespace Lua {
 		void							clearVariable(const std::string& variableName)							{ std::lock_guard<std::mutex> lock(_stateMutex); lua_pushnil(_state); _setGlobal(variableName); }
 		
 		/// \brief Returns the content of a variable \throw VariableDoesntExistException if variable doesn't exist \note If you wrote a ObjectWrapper<T> into a variable, you can only read its value using a std::shared_ptr<T>
-		template<typename T> T			readVariable(const std::string& variableName) const				{ std::lock_guard<std::mutex> lock(_stateMutex); _getGlobal(variableName); return _read(-1, (T*)nullptr); }
+		template<typename T> T			readVariable(const std::string& variableName) const				{ std::lock_guard<std::mutex> lock(_stateMutex); _getGlobal(variableName); try { T value = _read(-1, (T*)nullptr); lua_pop(_state, 1); return value; } catch(...) { lua_pop(_state, 1); throw; } }
+		/// \brief Same as above, with a name compiled by compileVariablePath
+		template<typename T> T			readVariable(const VariablePath& variablePath) const				{ std::lock_guard<std::mutex> lock(_stateMutex); _getGlobal(variablePath); try { T value = _read(-1, (T*)nullptr); lua_pop(_state, 1); return value; } catch(...) { lua_pop(_state, 1); throw; } }
 
 		/// \brief Changes the content of a global lua variable
 		/// \details Accepted values are: all base types (integers, floats), std::string, std::function or ObjectWrapper<...>. All objects are passed by copy and destroyed by the garbage collector.
@@ -226,14 +555,38 @@ namespace Lua {
 			_setGlobal(variableName);
 			lua_pop(_state, pushedElems - 1);
 		}
+		/// \brief Same as above, with a name compiled by compileVariablePath
+		template<typename T> void writeVariable(const VariablePath& variablePath, T&& data) {
+			static_assert(!std::is_same<typename Tupleizer<T>::type,T>::value, "Error: you can't use LuaContext::writeVariable with a tuple");
+			std::lock_guard<std::mutex> lock(_stateMutex);
+			int pushedElems = _push(std::forward<T>(data));
+			_setGlobal(variablePath);
+			lua_pop(_state, pushedElems - 1);
+		}
 
 
 
 	private:
-		// forbidding copy
+		// forbidding copy (and move), lua keeps pointers to the allocator and to the context
 		LuaContext(const LuaContext&);
 		LuaContext& operator=(const LuaContext&);
 
+		// LuaFunctionRef pins functions in the registry and calls them through these
+		friend class LuaFunctionRefBase;
+		template<typename> friend class LuaFunctionRef;
+
+		// returns a registry reference to the function stored in the variable, or LUA_NOREF if it doesn't contain a function
+		int _referenceFunction(const std::string& functionName);
+		void _releaseReference(int reference)													{ std::lock_guard<std::mutex> stateLock(_stateMutex); luaL_unref(_state, LUA_REGISTRYINDEX, reference); }
+
+		// calls the function pinned in the registry by _referenceFunction ; In should be a tuple, like for _call
+		template<typename Out, typename In>
+		Out _callReference(int reference, const In& in) {
+			std::lock_guard<std::mutex> stateLock(_stateMutex);
+			lua_rawgeti(_state, LUA_REGISTRYINDEX, reference);
+			return _call<Out>(in);
+		}
+
 
 		// the state is the most important variable in the class since it is our interface with Lua
 		// the mutex is here because the lua design is not thread safe (based on a stack)
@@ -241,6 +594,67 @@ namespace Lua {
 		// the mutex should be locked by all public functions that use the stack
 		lua_State*					_state;
 		mutable std::mutex			_stateMutex;
+
+		// every allocation of _state goes through this, so it must be destroyed after _state is closed
+		// lua keeps a pointer to it, which is why a LuaContext can't be moved
+		LuaAllocator				_allocator;
+
+		// counted by the finalizer of a userdata that nothing references, which creates a new one each time it is called
+		//   so that there is always one to be collected by the next cycle ; no new one is created while the state is closed
+		size_t						_gcCycles;
+		bool						_closing;
+
+		// lua_gc(LUA_GCTIME) wraps around, getMemoryStatistics adds up the differences
+		mutable unsigned long long	_gcMicroSeconds;
+		mutable int					_gcTimeRead;
+		unsigned long long			_readGCMicroSeconds() const;		// with _stateMutex locked
+
+		// told the time taken by every C++ function lua calls, when not empty
+		std::function<void (unsigned long long)>	_callbackObserver;
+
+		// set by stopGarbageCollector, since a step of the collector restarts it
+		bool						_gcStopped;
+		static void					_createGCSentinel(lua_State* state, LuaContext* context);
+		static int					_gcSentinelFinalizer(lua_State* state);
+
+		// the profiler's count hook finds the context in the registry, at the address of a static variable
+		// a sample only looks up the functions in its stack by the address of their source and name, which lua keeps as long
+		//   as the function exists ; the text of both is checked too, in case a collected function's strings were reused
+		//   the names of the functions and lines sampled are only made by getProfile
+		struct ProfileFrameKey {
+			const char*				source;
+			const char*				name;
+			int						lineDefined;
+			char					what;
+			bool operator<(const ProfileFrameKey& other) const;
+		};
+		struct ProfileFrame {
+			std::string				source;
+			std::string				name;				// nothing when lua doesn't know it
+			std::string				displayName;		// "name (source:line defined)"
+			std::string				shortSource;		// the source as lua shows it in error messages
+		};
+		bool						_profiling;
+		int							_profileInterval;
+		size_t						_profileSamples;
+		std::map<ProfileFrameKey, size_t>				_profileFrameIds;		// index in _profileFrames
+		std::vector<ProfileFrame>						_profileFrames;
+		std::map<std::vector<size_t>, size_t>			_profileStacks;			// samples of each stack of frame ids, from the outermost
+		std::map<std::pair<size_t, int>, size_t>		_profileLines;			// samples of each current line of each frame id
+		std::vector<size_t>								_profileStack;			// the stack of the sample being taken, from the innermost
+		static void					_profilerHook(lua_State* state, lua_Debug* debugInfo);
+		void						_takeProfileSample(lua_State* state);
+		size_t						_getProfileFrame(const lua_Debug& frame);
+		void						_syncProfilerHook(lua_State* thread);
+		void						_clearProfile();
+
+		// takeSnapshot records the table on the top of the stack (and pops it) as { table, copy, metatable } at the end of the
+		//   "entries" array, then the tables it contains down to "depth" levels ; "seen" has every table already recorded as a key
+		static void					_snapshotTable(lua_State* state, int entries, int seen, int depth);
+		// run by resetToSnapshot with lua_cpcall, since a finalizer may raise an error
+		static int					_resetGarbageCollector(lua_State* state);
+		// memory in use right after takeSnapshot
+		size_t						_snapshotBytes;
 		
 		// all the user types in the _state must have the value of typeid(T).name() in their
 		//   metatable at key "_typeid"
@@ -252,6 +666,21 @@ namespace Lua {
 		// important: _setGlobal will pop the value even if it throws an exception, while _getGlobal won't push the value if it throws an exception
 		void _getGlobal(const std::string& variable) const;
 		void _setGlobal(const std::string& variable);
+		// same as above with a compiled path, except that _getGlobal pushes nil when the variable (or one of its tables) doesn't exist,
+		//   and _setGlobal pops the value without writing it when the table to write into doesn't exist
+		// the first "segments" parts of the path are read by the second _getGlobal, which _setGlobal uses to find the table
+		void _getGlobal(const VariablePath& variable) const										{ _getGlobal(variable, variable._keys.size()); }
+		void _getGlobal(const VariablePath& variable, size_t segments) const;
+		void _setGlobal(const VariablePath& variable);
+
+		// loads a chunk from the stream on the top of the stack of "state", which is either _state or one of its coroutines
+		// returns the value returned by lua_load ; if it is not 0, nothing was pushed and the error message is stored in "errorMessage" if not nullptr
+		static int _load(lua_State* state, std::istream& code, std::string* errorMessage = nullptr);
+		// same as above, but the whole code is handed to lua_load at once, without being copied
+		static int _load(lua_State* state, const char* code, size_t size, const char* chunkName, std::string* errorMessage = nullptr);
+
+		// returns the coroutine pinned in the registry by createCoroutine, or nullptr if "coroutine" is not a coroutine
+		lua_State* _getCoroutine(int coroutine) const;
 
 		// simple function that reads the top # elements of the stack, pops them, and returns them
 		// warning: first parameter is the number of parameters, not the parameter index
@@ -339,7 +768,10 @@ namespace Lua {
 			} catch(...) { lua_pop(_state, 1); throw; }
 
 			// calling pcall automatically pops the parameters and pushes output
+			// the memory limit is only enforced here since an error is caught by pcall
+			const bool limitEnforced = _allocator.enforceLimit(true);
 			auto pcallReturnValue = lua_pcall(_state, inArguments, outArguments, 0);
+			_allocator.enforceLimit(limitEnforced);
 
 			// if pcall failed, analyzing the problem and throwing
 			if (pcallReturnValue != 0) {
@@ -556,6 +988,42 @@ namespace Lua {
 			p += _push(std::get<5>(t));
 			return p;
 		}
+		template<typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
+		int _push(const std::tuple<T1,T2,T3,T4,T5,T6,T7>& t) {
+			int p = _push(std::get<0>(t));
+			p += _push(std::get<1>(t));
+			p += _push(std::get<2>(t));
+			p += _push(std::get<3>(t));
+			p += _push(std::get<4>(t));
+			p += _push(std::get<5>(t));
+			p += _push(std::get<6>(t));
+			return p;
+		}
+		template<typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8>
+		int _push(const std::tuple<T1,T2,T3,T4,T5,T6,T7,T8>& t) {
+			int p = _push(std::get<0>(t));
+			p += _push(std::get<1>(t));
+			p += _push(std::get<2>(t));
+			p += _push(std::get<3>(t));
+			p += _push(std::get<4>(t));
+			p += _push(std::get<5>(t));
+			p += _push(std::get<6>(t));
+			p += _push(std::get<7>(t));
+			return p;
+		}
+		template<typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9>
+		int _push(const std::tuple<T1,T2,T3,T4,T5,T6,T7,T8,T9>& t) {
+			int p = _push(std::get<0>(t));
+			p += _push(std::get<1>(t));
+			p += _push(std::get<2>(t));
+			p += _push(std::get<3>(t));
+			p += _push(std::get<4>(t));
+			p += _push(std::get<5>(t));
+			p += _push(std::get<6>(t));
+			p += _push(std::get<7>(t));
+			p += _push(std::get<8>(t));
+			return p;
+		}
 
 		
 
@@ -598,7 +1066,8 @@ namespace Lua {
 		std::string _read(int index, std::string* = nullptr) const {
 			if (lua_isuserdata(_state, index))
 				throw(WrongTypeException());
-			return lua_tostring(_state, index);
+			const char* str = lua_tostring(_state, index);
+			return (str != nullptr) ? str : std::string();		// nil and other values that can't be converted are read as an empty string
 		}
 
 		// reading a shared_ptr
@@ -850,6 +1319,94 @@ namespace Lua {
 	struct LuaContext::Tupleizer<std::tuple<T1,T2,T3,T4,T5,T6,T7,T8>>		{ typedef std::tuple<T1,T2,T3,T4,T5,T6,T7,T8> type; };
 	template<typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9>
 	struct LuaContext::Tupleizer<std::tuple<T1,T2,T3,T4,T5,T6,T7,T8,T9>>	{ typedef std::tuple<T1,T2,T3,T4,T5,T6,T7,T8,T9> type; };
+
+	/**	\brief Handle to a lua function, looked up once and then called without any name lookup
+		\details Template parameter is the signature of the function, eg. LuaFunctionRef<double (int, std::string)> (up to 9 parameters).
+				The function found in the variable at construction is pinned in the registry, so it is called even if the variable
+				is assigned something else later ; isValid() returns false if the variable did not contain a function.
+				The handle must be destroyed before the LuaContext it was created from.
+	*/
+	class LuaFunctionRefBase {
+	public:
+		~LuaFunctionRefBase()																	{ release(); }
+
+		/// \brief Returns true if the handle refers to a function
+		bool				isValid() const													{ return _reference != LUA_NOREF; }
+		/// \brief Releases the function before the handle is destroyed ; calling it afterwards throws ExecutionErrorException
+		void				release()														{ if (_reference != LUA_NOREF) _context->_releaseReference(_reference); _reference = LUA_NOREF; }
+
+	protected:
+		LuaFunctionRefBase(LuaContext& context, const std::string& functionName) : _context(&context), _reference(context._referenceFunction(functionName)) {}
+
+		LuaContext*			_context;
+		int					_reference;
+
+	private:
+		// forbidding copy
+		LuaFunctionRefBase(const LuaFunctionRefBase&);
+		LuaFunctionRefBase& operator=(const LuaFunctionRefBase&);
+	};
+
+	template<typename R>
+	class LuaFunctionRef<R()> : public LuaFunctionRefBase {
+	public:
+		LuaFunctionRef(LuaContext& context, const std::string& functionName) : LuaFunctionRefBase(context, functionName) {}
+		R operator()()			{ return _context->_callReference<R>(_reference, std::tuple<>()); }
+	};
+	template<typename R, typename T1>
+	class LuaFunctionRef<R(T1)> : public LuaFunctionRefBase {
+	public:
+		LuaFunctionRef(LuaContext& context, const std::string& functionName) : LuaFunctionRefBase(context, functionName) {}
+		R operator()(const T1& t1)			{ return _context->_callReference<R>(_reference, std::make_tuple(t1)); }
+	};
+	template<typename R, typename T1, typename T2>
+	class LuaFunctionRef<R(T1,T2)> : public LuaFunctionRefBase {
+	public:
+		LuaFunctionRef(LuaContext& context, const std::string& functionName) : LuaFunctionRefBase(context, functionName) {}
+		R operator()(const T1& t1, const T2& t2)			{ return _context->_callReference<R>(_reference, std::make_tuple(t1,t2)); }
+	};
+	template<typename R, typename T1, typename T2, typename T3>
+	class LuaFunctionRef<R(T1,T2,T3)> : public LuaFunctionRefBase {
+	public:
+		LuaFunctionRef(LuaContext& context, const std::string& functionName) : LuaFunctionRefBase(context, functionName) {}
+		R operator()(const T1& t1, const T2& t2, const T3& t3)			{ return _context->_callReference<R>(_reference, std::make_tuple(t1,t2,t3)); }
+	};
+	template<typename R, typename T1, typename T2, typename T3, typename T4>
+	class LuaFunctionRef<R(T1,T2,T3,T4)> : public LuaFunctionRefBase {
+	public:
+		LuaFunctionRef(LuaContext& context, const std::string& functionName) : LuaFunctionRefBase(context, functionName) {}
+		R operator()(const T1& t1, const T2& t2, const T3& t3, const T4& t4)			{ return _context->_callReference<R>(_reference, std::make_tuple(t1,t2,t3,t4)); }
+	};
+	template<typename R, typename T1, typename T2, typename T3, typename T4, typename T5>
+	class LuaFunctionRef<R(T1,T2,T3,T4,T5)> : public LuaFunctionRefBase {
+	public:
+		LuaFunctionRef(LuaContext& context, const std::string& functionName) : LuaFunctionRefBase(context, functionName) {}
+		R operator()(const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5)			{ return _context->_callReference<R>(_reference, std::make_tuple(t1,t2,t3,t4,t5)); }
+	};
+	template<typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
+	class LuaFunctionRef<R(T1,T2,T3,T4,T5,T6)> : public LuaFunctionRefBase {
+	public:
+		LuaFunctionRef(LuaContext& context, const std::string& functionName) : LuaFunctionRefBase(context, functionName) {}
+		R operator()(const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6)			{ return _context->_callReference<R>(_reference, std::make_tuple(t1,t2,t3,t4,t5,t6)); }
+	};
+	template<typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
+	class LuaFunctionRef<R(T1,T2,T3,T4,T5,T6,T7)> : public LuaFunctionRefBase {
+	public:
+		LuaFunctionRef(LuaContext& context, const std::string& functionName) : LuaFunctionRefBase(context, functionName) {}
+		R operator()(const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6, const T7& t7)			{ return _context->_callReference<R>(_reference, std::make_tuple(t1,t2,t3,t4,t5,t6,t7)); }
+	};
+	template<typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8>
+	class LuaFunctionRef<R(T1,T2,T3,T4,T5,T6,T7,T8)> : public LuaFunctionRefBase {
+	public:
+		LuaFunctionRef(LuaContext& context, const std::string& functionName) : LuaFunctionRefBase(context, functionName) {}
+		R operator()(const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6, const T7& t7, const T8& t8)			{ return _context->_callReference<R>(_reference, std::make_tuple(t1,t2,t3,t4,t5,t6,t7,t8)); }
+	};
+	template<typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9>
+	class LuaFunctionRef<R(T1,T2,T3,T4,T5,T6,T7,T8,T9)> : public LuaFunctionRefBase {
+	public:
+		LuaFunctionRef(LuaContext& context, const std::string& functionName) : LuaFunctionRefBase(context, functionName) {}
+		R operator()(const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6, const T7& t7, const T8& t8, const T9& t9)			{ return _context->_callReference<R>(_reference, std::make_tuple(t1,t2,t3,t4,t5,t6,t7,t8,t9)); }
+	};
 	
 }
 
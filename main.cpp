@@ -22,18 +22,18 @@ int main(int argc, char * argv[])
 	myLuaThread_A.ResumeScript();
 	myLuaThread_B.ResumeScript();
 
-	Sleep(10000);
-
     // 2) Make a call to myLuaThread's GetXXXX() functions that will get variables created and filled with data inside the script
     double width = 0.0, height = 0.0;
 
-	while( !myLuaThread_A.HasScriptExecutedOnce() );
+	if( !myLuaThread_A.WaitForCompletion(10000) )
+		std::cout << std::endl << "myLuaThread_A | script did not complete within 10 seconds!" << std::endl;
 	width = myLuaThread_A.GetDouble("width");
 	height = myLuaThread_A.GetDouble("height");
 
 	std::cout << std::endl << "myLuaThread_A | width = " << width << ", height = " << height << std::endl;
 
-	while( !myLuaThread_B.HasScriptExecutedOnce() );
+	if( !myLuaThread_B.WaitForCompletion(10000) )
+		std::cout << std::endl << "myLuaThread_B | script did not complete within 10 seconds!" << std::endl;
 	width = myLuaThread_B.GetDouble("width");
 	height = myLuaThread_B.GetDouble("height");
 